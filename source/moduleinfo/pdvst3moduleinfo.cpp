@@ -0,0 +1,286 @@
+/*
+ * This file is part of pdvst3.
+ *
+ * Copyright (C) 2025 Lucas Cordiviola
+ * based on original work from 2004 by Joseph A. Sarlo and 2018 by Jean-Yves Gratius
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* pdvst3moduleinfo: writes Contents/moduleinfo.json of a pdvst3 bundle from
+   its config.txt, with the same names and class IDs that parseSetupFile()
+   and doFUIDs() compute when the plugin is loaded.
+
+   usage: pdvst3moduleinfo <path/to/plugin.vst3> [<sdk version string>] */
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <math.h>
+#include "pdvst3_base_defines.h"
+
+#define CONFIGFILE "config.txt"
+#define MODULEINFOFILE "moduleinfo.json"
+
+#if _WIN32
+    #define SEP '\\'
+#else
+    #define SEP '/'
+#endif
+
+long pluginId = 0x70647670;  // 'pdvp'
+char pluginName[MAXSTRLEN];
+char pluginVersion[MAXSTRLEN];
+char author[MAXSTRLEN];
+char url[MAXSTRLEN];
+char mail[MAXSTRLEN];
+
+
+char *trimWhitespace(char *str)
+{
+    char *buf;
+
+    if (strlen(str) > 0)
+    {
+        buf = str;
+        while (isspace(*buf) && (buf - str) <= (int)strlen(str))
+            buf++;
+        memmove(str, buf, (strlen(buf) + 1) * sizeof(char));
+        if (strlen(str) > 0)
+        {
+            buf = str + strlen(str) - 1;
+            while (isspace(*buf) && (buf >= str))
+            {
+                *buf = 0;
+                buf--;
+            }
+        }
+    }
+    return (str);
+}
+
+char *strlowercase(char *str)
+{
+    for (int i = 0; str[i]; i++)
+    {
+        str[i] = tolower(str[i]);
+    }
+    return str;
+}
+
+// the bundle's folder name without .vst3, like parseSetupFile()
+void nameFromBundle(const char *bundlePath)
+{
+    char buf[MAXFILENAMELEN];
+    char *p;
+
+    strcpy(buf, bundlePath);
+    while (strlen(buf) > 0 && (buf[strlen(buf) - 1] == '/' || buf[strlen(buf) - 1] == SEP))
+        buf[strlen(buf) - 1] = 0;
+    #if _WIN32
+        // the Windows loader lowercases the whole name
+        strlowercase(buf);
+    #endif
+    if (strstr(buf, ".vst3"))
+        *(strstr(buf, ".vst3")) = 0;
+    p = strrchr(buf, SEP);
+    if (p == NULL)
+        p = strrchr(buf, '/');
+    strcpy(pluginName, p ? p + 1 : buf);
+}
+
+int parseConfig(const char *configFile)
+{
+    FILE *setupFile;
+    char line[MAXSTRLEN];
+    char param[MAXSTRLEN];
+    char value[MAXSTRLEN];
+    int i, equalPos;
+
+    setupFile = fopen(configFile, "r");
+    if (!setupFile)
+        return 0;
+    while (fgets(line, sizeof(line), setupFile))
+    {
+        equalPos = strchr(line, '=') - line;
+        if (equalPos > 0 && equalPos < MAXSTRLEN && line[0] != '#')
+        {
+            strcpy(param, line);
+            param[equalPos] = 0;
+            strcpy(value, line + equalPos + 1);
+            strcpy(param, trimWhitespace(strlowercase(param)));
+            strcpy(value, trimWhitespace(value));
+            // vst plugin ID
+            if (strcmp(param, "id") == 0)
+            {
+                pluginId = 0;
+                for (i = 0; i < 4; i++)
+                    pluginId += (long)pow((double)16,(int) (i * 2)) * value[3 - i];
+            }
+            if (strcmp(param, "version") == 0)
+                strcpy(pluginVersion, value);
+            if (strcmp(param, "author") == 0)
+                strcpy(author, value);
+            if (strcmp(param, "url") == 0)
+                strcpy(url, value);
+            if (strcmp(param, "mail") == 0)
+                strcpy(mail, value);
+            if (strcmp(param, "plugname") == 0)
+                strcpy(pluginName, value);
+        }
+    }
+    fclose(setupFile);
+    return 1;
+}
+
+// same string as convertVST2UID_To_FUID() hands to FUID::fromString()
+void makeUID(char *uidString, int myVST2UID_4Chars, const char *name, bool forControllerUID)
+{
+    int vstfxid;
+    char buf[9];
+    size_t len = strlen(name);
+
+    if (forControllerUID)
+        vstfxid = (('V' << 16) | ('S' << 8) | 'E');
+    else
+        vstfxid = (('V' << 16) | ('S' << 8) | 'T');
+    sprintf(uidString, "%06X", vstfxid);
+    sprintf(buf, "%08X", myVST2UID_4Chars);
+    strcat(uidString, buf);
+    for (int i = 0; i <= 8; i++)
+    {
+        unsigned char c = i < (int)len ? name[i] : 0;
+        sprintf(buf, "%02X", c);
+        strcat(uidString, buf);
+    }
+}
+
+void writeString(FILE *f, const char *str)
+{
+    putc('"', f);
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\')
+            fprintf(f, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(f, "\\u%04x", *str);
+        else
+            putc(*str, f);
+    }
+    putc('"', f);
+}
+
+void writeClass(FILE *f, const char *cid, const char *category, const char *subCategory,
+                int classFlags, const char *sdkVersion)
+{
+    fprintf(f, "    {\n      \"CID\": \"%s\",\n      \"Category\": ", cid);
+    writeString(f, category);
+    fprintf(f, ",\n      \"Name\": ");
+    writeString(f, pluginName);
+    // the host takes the factory vendor for classes without one
+    fprintf(f, ",\n      \"Vendor\": ");
+    writeString(f, author);
+    fprintf(f, ",\n      \"Version\": ");
+    writeString(f, pluginVersion);
+    fprintf(f, ",\n      \"SDKVersion\": ");
+    writeString(f, sdkVersion);
+    fprintf(f, ",\n      \"Sub Categories\": [");
+    if (subCategory[0])
+    {
+        fprintf(f, "\n        ");
+        writeString(f, subCategory);
+        fprintf(f, "\n      ");
+    }
+    fprintf(f, "],\n      \"Class Flags\": %d,\n", classFlags);
+    fprintf(f, "      \"Cardinality\": %d,\n", 0x7FFFFFFF);  // kManyInstances
+    fprintf(f, "      \"Snapshots\": []\n    }");
+}
+
+int main(int argc, char **argv)
+{
+    char bundlePath[MAXFILENAMELEN];
+    char configFile[MAXFILENAMELEN];
+    char outFile[MAXFILENAMELEN];
+    char procUID[33], contUID[33];
+    const char *sdkVersion = (argc > 2) ? argv[2] : "VST 3.7.13";
+    FILE *f;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <plugin.vst3> [<sdk version>]\n", argv[0]);
+        return 1;
+    }
+    // room for the separator appended below
+    if (snprintf(bundlePath, MAXFILENAMELEN - 1, "%s", argv[1]) >= MAXFILENAMELEN - 1)
+    {
+        fprintf(stderr, "path too long: %s\n", argv[1]);
+        return 1;
+    }
+    if (bundlePath[strlen(bundlePath) - 1] != SEP && bundlePath[strlen(bundlePath) - 1] != '/')
+    {
+        bundlePath[strlen(bundlePath) + 1] = 0;
+        bundlePath[strlen(bundlePath)] = SEP;
+    }
+    nameFromBundle(bundlePath);
+    strcpy(pluginVersion, "0.0.1");
+    if (snprintf(configFile, MAXFILENAMELEN, "%s%s", bundlePath, CONFIGFILE) >= MAXFILENAMELEN)
+    {
+        fprintf(stderr, "path too long: %s%s\n", bundlePath, CONFIGFILE);
+        return 1;
+    }
+    if (!parseConfig(configFile))
+    {
+        fprintf(stderr, "can't open %s\n", configFile);
+        return 1;
+    }
+    makeUID(procUID, pluginId, pluginName, false);
+    makeUID(contUID, pluginId, pluginName, true);
+
+    if (snprintf(outFile, MAXFILENAMELEN, "%sContents%c%s", bundlePath, SEP,
+                 MODULEINFOFILE) >= MAXFILENAMELEN)
+    {
+        fprintf(stderr, "path too long: %sContents%c%s\n", bundlePath, SEP, MODULEINFOFILE);
+        return 1;
+    }
+    f = fopen(outFile, "w");
+    if (!f)
+    {
+        fprintf(stderr, "can't write %s\n", outFile);
+        return 1;
+    }
+    fprintf(f, "{\n  \"Name\": ");
+    writeString(f, pluginName);
+    fprintf(f, ",\n  \"Version\": ");
+    writeString(f, pluginVersion);
+    fprintf(f, ",\n  \"Factory Info\": {\n    \"Vendor\": ");
+    writeString(f, author);
+    fprintf(f, ",\n    \"URL\": ");
+    writeString(f, url);
+    fprintf(f, ",\n    \"E-Mail\": ");
+    writeString(f, mail);
+    fprintf(f, ",\n    \"Flags\": {\n");
+    fprintf(f, "      \"Unicode\": false,\n");
+    fprintf(f, "      \"Classes Discardable\": false,\n");
+    fprintf(f, "      \"Component Non Discardable\": false\n");
+    fprintf(f, "    }\n  },\n  \"Compatibility\": [],\n  \"Classes\": [\n");
+    // as registered in GetPluginFactory()
+    writeClass(f, procUID, "Audio Module Class", "Fx", 1, sdkVersion);  // kDistributable
+    fprintf(f, ",\n");
+    writeClass(f, contUID, "Component Controller Class", "", 0, sdkVersion);
+    fprintf(f, "\n  ]\n}\n");
+    fclose(f);
+    printf("%s: %s\n", outFile, pluginName);
+    return 0;
+}
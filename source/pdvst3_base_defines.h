@@ -9,7 +9,6 @@
 #define PDBLKSIZE 64
 #define MAXEXTERNS 128
 #define MAXVSTBUFSIZE 4096
-#define MAXPARAMS 128
 #define MAXPROGRAMS 128
 #define MAXCHANS 128
 #define MAXFILENAMELEN 1024
@@ -18,8 +17,38 @@
 #define PDWAITMAX 1000
 #define DEFPDVSTBUFFERSIZE 1024
 #define MAXCHANNELS 64
-#define MAXPARAMETERS 128
+#define MAXPARAMETERS 4096  // upper bound for PARAMETERS in config.txt
+#define LEGACYSTATEPARAMS 128  // states without a header hold this many values
+#define PDVSTSTATEVERSION 1
 #define MAXBLOCKSIZE 256
 #define MAXSTRINGSIZE 4096
 #define MAXMIDIQUEUESIZE 1024
 #define MAXMIDIOUTQUEUESIZE 1024
+#define MAXPARAMQUEUESIZE 1024
+#define MAXSYSEXQUEUESIZE 256
+#define MAXSYSEXBYTES 131072  // SysEx arena of each direction, a power of two
+#define CHUNKSEGMENTSIZE 65536  // state chunks are sent in pieces of this size
+#define MAXCHUNKSIZE 0x40000000  // largest state chunk setState accepts
+// Pd supervisor (all times in ms)
+#define PDMAXTIMEOUTS 3
+#define PDCHUNKMS 1         // state chunk thread, while it sends or receives
+#define PDCHUNKIDLEMS 10
+#define PDARRAYSNAPSHOTMS 1000 // how old the [vstarray] arrays in getState can be
+#define PDSUPERVISORMS 50
+#define PDHEARTBEATTIMEOUT 3000
+#define PDSTARTUPTIMEOUT 15000
+#define PDMAXRESTARTS 3
+#define PDHEALTHYRESET 30000
+// shared Pd server
+#define MAXPDINSTANCES 128
+#define PDVSTNAMELEN 64
+#define PDFIFOBLOCKS (2 * MAXVSTBUFSIZE / PDBLKSIZE)
+#define PDSERVERIDLE 0.02  // seconds without blocks before an instance is not waited for
+#define PDSERVERWAITMS 10
+// log rings (see pdvstTransfer.h)
+#define PDVSTLOGSIZE 256     // lines waiting to be written
+#define PDVSTLOGLINE 240
+#define PDVSTLOGINTERVAL 1.0 // seconds between two overflow or timeout messages of a kind
+#define PDVSTTRACESIZE 4096  // trace events of each side waiting to be written
+// pool of idle Pd processes
+#define MAXPOOLSIZE 16
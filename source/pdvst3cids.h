@@ -28,7 +28,14 @@ namespace Steinberg {
 enum pdvst3Params : Vst::ParamID
 {
 	kParamId = 100,
-	kUnusedId = 1000
+	kUnusedId = 1000,
+	// program change parameter, also the id of the program list (IUnitInfo)
+	kProgramId = 0x8000,
+	// hidden program change parameters, kMidiProgramId + channel (0 to 15)
+	kMidiProgramId = 0x9000,
+	// hidden parameters the host maps MIDI controllers to (see IMidiMapping):
+	// kMidiMapId + channel * Vst::kCountCtrlNumber + controller
+	kMidiMapId = 0x10000
 };
 
 
@@ -17,19 +17,44 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "pdvst3controller.h"
 #include "pdvst3cids.h"
 // #include "vstgui/plugin-bindings/vst3editor.h"
 #include "base/source/fstreamer.h"
 #include "pluginterfaces/base/ibstream.h"
 #include "pdvst3_base_defines.h"
+#include "pdvst3processor.h"
 #include "public.sdk/source/vst/utility/stringconvert.h"
 
 extern int globalNParams;
-extern char globalVstParamName[MAXPARAMETERS][MAXSTRLEN];
+extern char *globalVstParamName[MAXPARAMETERS];
+extern int globalNPrograms;
+extern pdvstProgram globalProgram[MAXPROGRAMS];
 
 using namespace Steinberg;
 
+// the standard note expressions, all of them go to [vstnote] as they come
+static const struct
+{
+    Vst::NoteExpressionTypeID id;
+    const char *title;
+    const char *shortTitle;
+    double defaultValue;
+    bool bipolar;
+} noteExpressions[] =
+{
+    {Vst::kVolumeTypeID,     "Volume",     "Vol",  0.25, false},
+    {Vst::kPanTypeID,        "Pan",        "Pan",  0.5,  true},
+    {Vst::kTuningTypeID,     "Tuning",     "Tun",  0.5,  true},
+    {Vst::kVibratoTypeID,    "Vibrato",    "Vib",  0.,   false},
+    {Vst::kExpressionTypeID, "Expression", "Expr", 0.,   false},
+    {Vst::kBrightnessTypeID, "Brightness", "Brt",  0.,   false}
+};
+#define NNOTEEXPRESSIONS (int32)(sizeof(noteExpressions) / sizeof(noteExpressions[0]))
+
 namespace Steinberg {
 
 //------------------------------------------------------------------------
@@ -53,17 +78,77 @@ tresult PLUGIN_API pdvst3Controller::initialize (FUnknown* context)
         Steinberg::Vst::TChar buf[MAXSTRLEN];
         for(int i = 0; i < globalNParams ; i++)
         {
-            Steinberg::Vst::StringConvert::convert ((char*)globalVstParamName[i], buf);
+            Steinberg::Vst::StringConvert::convert (globalVstParamName[i] ?
+                                                    globalVstParamName[i] : "<unnamed>", buf);
             parameters.addParameter (buf, nullptr, 0, 0.,
                                  Vst::ParameterInfo::kCanAutomate, pdvst3Params::kParamId+i, 0,
                                  nullptr);
         }
+        // MIDI controllers come as these, the processor turns them back into MIDI
+        for (int ch = 0; ch < 16; ch++)
+        {
+            for (int cc = 0; cc < Vst::kCountCtrlNumber; cc++)
+            {
+                char name[32];
+                midiMap[ch][cc] = pdvst3Params::kMidiMapId + ch * Vst::kCountCtrlNumber + cc;
+                if (cc == Vst::kPitchBend)
+                    sprintf(name, "MIDI ch%d pitch bend", ch + 1);
+                else if (cc == Vst::kAfterTouch)
+                    sprintf(name, "MIDI ch%d aftertouch", ch + 1);
+                else
+                    sprintf(name, "MIDI ch%d CC%d", ch + 1, cc);
+                Steinberg::Vst::StringConvert::convert (name, buf);
+                // pitch bend rests in the middle
+                parameters.addParameter (buf, nullptr, 0, (cc == Vst::kPitchBend) ? 0.5 : 0.,
+                                     Vst::ParameterInfo::kIsHidden, midiMap[ch][cc], 0,
+                                     nullptr);
+            }
+            // IMidiMapping can't take program changes, hosts send them to a
+            // kIsProgramChange parameter. with PROGRAM keys channel 1 has the
+            // program list below instead
+            if (ch == 0 && globalNPrograms > 0)
+                continue;
+            char name[32];
+            sprintf(name, "MIDI ch%d program", ch + 1);
+            Steinberg::Vst::StringConvert::convert (name, buf);
+            parameters.addParameter (buf, nullptr, 127, 0.,
+                                 Vst::ParameterInfo::kIsHidden | Vst::ParameterInfo::kIsProgramChange,
+                                 pdvst3Params::kMidiProgramId + ch, 0, nullptr);
+        }
+        // the programs of config.txt, one list in the root unit
+        if (globalNPrograms > 0)
+        {
+            addUnit (new Vst::Unit (STR16 ("Root"), Vst::kRootUnitId, Vst::kNoParentUnitId,
+                                    pdvst3Params::kProgramId));
+            Vst::ProgramList* list = new Vst::ProgramList (STR16 ("Programs"),
+                                                          pdvst3Params::kProgramId,
+                                                          Vst::kRootUnitId);
+            for (int i = 0; i < globalNPrograms; i++)
+            {
+                Steinberg::Vst::StringConvert::convert (globalProgram[i].name, buf);
+                list->addProgram (buf);
+            }
+            addProgramList (list);
+            parameters.addParameter (list->getParameter ());
+        }
 
     }
 
     return result;
 }
 
+//------------------------------------------------------------------------
+tresult PLUGIN_API pdvst3Controller::getMidiControllerAssignment (int32 busIndex, int16 channel,
+                                                                   Vst::CtrlNumber midiControllerNumber,
+                                                                   Vst::ParamID& id)
+{
+    if (busIndex != 0 || channel < 0 || channel >= 16 ||
+        midiControllerNumber < 0 || midiControllerNumber >= Vst::kCountCtrlNumber)
+        return kResultFalse;
+    id = midiMap[channel][midiControllerNumber];
+    return kResultTrue;
+}
+
 //------------------------------------------------------------------------
 tresult PLUGIN_API pdvst3Controller::terminate ()
 {
@@ -81,12 +166,13 @@ tresult PLUGIN_API pdvst3Controller::setComponentState (IBStream* state)
         return kResultFalse;
 
     IBStreamer streamer (state, kLittleEndian);
+    int nValues = 0;
+    double *values = pdvstReadStateValues (streamer, &nValues);
+    if (!values)
+        return kResultFalse;
     for (int i = 0; i < globalNParams; i++)
-    {
-        double value = 0;
-        streamer.readDouble (value);
-        setParamNormalized (pdvst3Params::kParamId + i, (Vst::ParamValue)value);
-    }
+        setParamNormalized (pdvst3Params::kParamId + i, (i < nValues) ? values[i] : 0.);
+    delete[] values;
     return kResultOk;
 }
 
@@ -108,6 +194,61 @@ tresult PLUGIN_API pdvst3Controller::getState (IBStream* state)
 
     return kResultTrue;
 }
+//------------------------------------------------------------------------
+int32 PLUGIN_API pdvst3Controller::getNoteExpressionCount (int32 busIndex, int16 channel)
+{
+    return (busIndex == 0) ? NNOTEEXPRESSIONS : 0;
+}
+
+//------------------------------------------------------------------------
+tresult PLUGIN_API pdvst3Controller::getNoteExpressionInfo (int32 busIndex, int16 channel,
+                                                             int32 noteExpressionIndex,
+                                                             Vst::NoteExpressionTypeInfo& info)
+{
+    if (busIndex != 0 || noteExpressionIndex < 0 || noteExpressionIndex >= NNOTEEXPRESSIONS)
+        return kResultFalse;
+    memset(&info, 0, sizeof(info));
+    info.typeId = noteExpressions[noteExpressionIndex].id;
+    Steinberg::Vst::StringConvert::convert (noteExpressions[noteExpressionIndex].title, info.title);
+    Steinberg::Vst::StringConvert::convert (noteExpressions[noteExpressionIndex].shortTitle,
+                                            info.shortTitle);
+    info.unitId = -1;
+    info.valueDesc.defaultValue = noteExpressions[noteExpressionIndex].defaultValue;
+    info.valueDesc.minimum = 0.;
+    info.valueDesc.maximum = 1.;
+    info.associatedParameterId = -1;
+    info.flags = noteExpressions[noteExpressionIndex].bipolar ?
+                 Vst::NoteExpressionTypeInfo::kIsBipolar : 0;
+    return kResultTrue;
+}
+
+//------------------------------------------------------------------------
+tresult PLUGIN_API pdvst3Controller::getNoteExpressionStringByValue (int32 busIndex, int16 channel,
+                                                                      Vst::NoteExpressionTypeID id,
+                                                                      Vst::NoteExpressionValue valueNormalized,
+                                                                      Vst::String128 string)
+{
+    char buf[32];
+
+    sprintf(buf, "%.3f", valueNormalized);
+    Steinberg::Vst::StringConvert::convert (buf, string);
+    return kResultTrue;
+}
+
+//------------------------------------------------------------------------
+tresult PLUGIN_API pdvst3Controller::getNoteExpressionValueByString (int32 busIndex, int16 channel,
+                                                                      Vst::NoteExpressionTypeID id,
+                                                                      const Vst::TChar* string,
+                                                                      Vst::NoteExpressionValue& valueNormalized)
+{
+    valueNormalized = atof(Steinberg::Vst::StringConvert::convert (string).c_str());
+    if (valueNormalized < 0.)
+        valueNormalized = 0.;
+    if (valueNormalized > 1.)
+        valueNormalized = 1.;
+    return kResultTrue;
+}
+
 /*
 //------------------------------------------------------------------------
 IPlugView* PLUGIN_API pdvst3Controller::createView (FIDString name)
@@ -127,9 +268,36 @@ tresult PLUGIN_API pdvst3Controller::setParamNormalized (Vst::ParamID tag, Vst::
 {
     // called by host to update your parameters
     tresult result = EditControllerEx1::setParamNormalized (tag, value);
+    // a program: show its values, the processor applies them itself
+    if (tag == pdvst3Params::kProgramId && result == kResultTrue)
+    {
+        Vst::Parameter* programParam = getParameterObject (tag);
+        int index = programParam ? (int)programParam->toPlain (value) : -1;
+        if (index >= 0 && index < globalNPrograms)
+        {
+            for (int i = 0; i < globalNParams; i++)
+                EditControllerEx1::setParamNormalized (pdvst3Params::kParamId + i,
+                    globalProgram[index].paramValue ? globalProgram[index].paramValue[i] : 0.);
+            if (componentHandler)
+                componentHandler->restartComponent (Vst::kParamValuesChanged);
+        }
+    }
     return result;
 }
 
+//------------------------------------------------------------------------
+tresult PLUGIN_API pdvst3Controller::notify (Vst::IMessage* message)
+{
+    // the processor's latency changed (shared Pd server attached or detached)
+    if (message && strcmp (message->getMessageID (), PDVSTLATENCYMESSAGE) == 0)
+    {
+        if (componentHandler)
+            componentHandler->restartComponent (Vst::kLatencyChanged);
+        return kResultOk;
+    }
+    return EditControllerEx1::notify (message);
+}
+
 //------------------------------------------------------------------------
 tresult PLUGIN_API pdvst3Controller::getParamStringByValue (Vst::ParamID tag, Vst::ParamValue valueNormalized, Vst::String128 string)
 {
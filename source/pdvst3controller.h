@@ -20,6 +20,8 @@
 #pragma once
 
 #include "public.sdk/source/vst/vsteditcontroller.h"
+#include "pluginterfaces/vst/ivstmidicontrollers.h"
+#include "pluginterfaces/vst/ivstnoteexpression.h"
 
 
 namespace Steinberg {
@@ -27,7 +29,8 @@ namespace Steinberg {
 //------------------------------------------------------------------------
 //  pdvst3Controller
 //------------------------------------------------------------------------
-class pdvst3Controller : public Steinberg::Vst::EditControllerEx1
+class pdvst3Controller : public Steinberg::Vst::EditControllerEx1, public Steinberg::Vst::IMidiMapping,
+                         public Steinberg::Vst::INoteExpressionController
 {
 public:
 //------------------------------------------------------------------------
@@ -58,15 +61,45 @@ public:
                                                          Steinberg::Vst::TChar* string,
                                                          Steinberg::Vst::ParamValue& valueNormalized) SMTG_OVERRIDE;
 
+	// ComponentBase
+	Steinberg::tresult PLUGIN_API notify (Steinberg::Vst::IMessage* message) SMTG_OVERRIDE;
+
+	// IMidiMapping
+	Steinberg::tresult PLUGIN_API getMidiControllerAssignment (Steinberg::int32 busIndex,
+                                                               Steinberg::int16 channel,
+                                                               Steinberg::Vst::CtrlNumber midiControllerNumber,
+                                                               Steinberg::Vst::ParamID& id) SMTG_OVERRIDE;
+
+	// INoteExpressionController
+	Steinberg::int32 PLUGIN_API getNoteExpressionCount (Steinberg::int32 busIndex,
+                                                        Steinberg::int16 channel) SMTG_OVERRIDE;
+	Steinberg::tresult PLUGIN_API getNoteExpressionInfo (Steinberg::int32 busIndex,
+                                                         Steinberg::int16 channel,
+                                                         Steinberg::int32 noteExpressionIndex,
+                                                         Steinberg::Vst::NoteExpressionTypeInfo& info) SMTG_OVERRIDE;
+	Steinberg::tresult PLUGIN_API getNoteExpressionStringByValue (Steinberg::int32 busIndex,
+                                                                  Steinberg::int16 channel,
+                                                                  Steinberg::Vst::NoteExpressionTypeID id,
+                                                                  Steinberg::Vst::NoteExpressionValue valueNormalized,
+                                                                  Steinberg::Vst::String128 string) SMTG_OVERRIDE;
+	Steinberg::tresult PLUGIN_API getNoteExpressionValueByString (Steinberg::int32 busIndex,
+                                                                  Steinberg::int16 channel,
+                                                                  Steinberg::Vst::NoteExpressionTypeID id,
+                                                                  const Steinberg::Vst::TChar* string,
+                                                                  Steinberg::Vst::NoteExpressionValue& valueNormalized) SMTG_OVERRIDE;
+
  	//---Interface---------
 	DEFINE_INTERFACES
 		// Here you can add more supported VST3 interfaces
-		// DEF_INTERFACE (Vst::IXXX)
-	END_DEFINE_INTERFACES (EditController)
-    DELEGATE_REFCOUNT (EditController)
+		DEF_INTERFACE (Vst::IMidiMapping)
+		DEF_INTERFACE (Vst::INoteExpressionController)
+	END_DEFINE_INTERFACES (EditControllerEx1)
+    DELEGATE_REFCOUNT (EditControllerEx1)
 
 //------------------------------------------------------------------------
 protected:
+	// MIDI channel and controller (with aftertouch and pitch bend) -> parameter
+	Steinberg::Vst::ParamID midiMap[16][Steinberg::Vst::kCountCtrlNumber];
 };
 
 //------------------------------------------------------------------------
@@ -58,7 +58,7 @@ int globalNParams = 0;
 int globalNExternalLibs = 0;
 long globalPluginId = 'pdvp';
 char globalExternalLib[MAXEXTERNS][MAXSTRLEN];
-char globalVstParamName[MAXPARAMS][MAXSTRLEN];
+char *globalVstParamName[MAXPARAMETERS];  // 0 for <unnamed>
 char globalPluginPath[MAXFILENAMELEN];
 char globalPluginName[MAXSTRLEN];
 char globalPluginVersion[MAXSTRLEN];
@@ -76,6 +76,19 @@ int globalCustomGuiWidth= 320;
 int globalCustomGuiHeight= 150;
 pdvstProgram globalProgram[MAXPROGRAMS];
 int globalLatency = 0;
+bool globalSharedPd = false;
+int globalPoolSize = 0;
+float globalParamThreshold = 0;  // PARAMTHRESHOLD
+float globalParamRate = 0;       // PARAMRATE
+float globalParamThresholds[MAXPARAMETERS];  // PARAMTHRESHOLD<n>, -1 for the default
+float globalParamRates[MAXPARAMETERS];       // PARAMRATE<n>, -1 for the default
+int globalMidiCoalesce = 0;  // COALESCE* keys, PDVSTCOALESCE() bits
+bool globalCompressState = false;  // COMPRESSSTATE
+int globalRestoreMessages = 0;        // RESTOREMESSAGES
+int globalRestoreMicroseconds = 500;  // RESTOREMICROSECONDS
+int globalLogLevel = PDVSTLOGINFO;  // LOGLEVEL
+char globalLogDir[MAXFILENAMELEN];  // LOGDIR
+bool globalTrace = false;  // TRACE, or the PDVST3_TRACE environment variable
 
 
 #if SMTG_OS_WINDOWS
@@ -259,13 +272,30 @@ void parseSetupFile()
     sprintf(globalPluginVersion, "0.0.1", buf);
 
     // initialize program info
-    strcpy(globalProgram[0].name, "Default");
-    memset(globalProgram[0].paramValue, 0, MAXPARAMS * sizeof(float));
+    for (i = 0; i < MAXPROGRAMS; i++)
+    {
+        free(globalProgram[i].paramValue);
+        globalProgram[i].paramValue = NULL;
+    }
     // initialize parameter info
     globalNParams = 0;
-    for (i = 0; i < MAXPARAMS; i++)
-        strcpy(globalVstParamName[i], "<unnamed>");
-    globalNPrograms = 1;
+    globalParamThreshold = 0;
+    globalParamRate = 0;
+    globalMidiCoalesce = 0;
+    globalCompressState = false;
+    globalRestoreMessages = 0;
+    globalRestoreMicroseconds = 500;
+    globalLogLevel = PDVSTLOGINFO;
+    globalLogDir[0] = 0;
+    globalTrace = (getenv("PDVST3_TRACE") != NULL);
+    for (i = 0; i < MAXPARAMETERS; i++)
+    {
+        free(globalVstParamName[i]);
+        globalVstParamName[i] = NULL;
+        globalParamThresholds[i] = -1;
+        globalParamRates[i] = -1;
+    }
+    globalNPrograms = 0;  // no program list without PROGRAM keys
 
 
     setupFile = fopen(globalConfigFile, "r");
@@ -345,17 +375,21 @@ void parseSetupFile()
                 {
                     int numParams = atoi(value);
 
-                    if (numParams >= 0 && numParams < MAXPARAMS)
+                    if (numParams >= 0 && numParams <= MAXPARAMETERS)
                         globalNParams = numParams;
                 }
                 // parameters names
                 if (strstr(param, "nameparameter") == \
-                        param && globalNPrograms < MAXPARAMS)
+                        param)
                 {
                     int paramNum = atoi(param + strlen("nameparameter"));
 
-                    if (paramNum < MAXPARAMS && paramNum >= 0)
+                    if (paramNum < MAXPARAMETERS && paramNum >= 0)
+                    {
+                        free(globalVstParamName[paramNum]);
+                        globalVstParamName[paramNum] = (char *)malloc(strlen(value) + 1);
                         strcpy(globalVstParamName[paramNum], value);
+                    }
                 }
                 // plug version
                 if (strcmp(param, "version") == 0)
@@ -392,6 +426,124 @@ void parseSetupFile()
                 {
                     globalLatency = atoi(value);
                 }
+                // one Pd process for all instances
+                if (strcmp(param, "sharedpd") == 0)
+                {
+                    if (strcmp(strlowercase(value), "true") == 0)
+                    {
+                        globalSharedPd = true;
+                    }
+                    else if (strcmp(strlowercase(value), "false") == 0)
+                    {
+                        globalSharedPd = false;
+                    }
+                }
+                // idle Pd processes kept ready for new instances
+                if (strcmp(param, "poolsize") == 0)
+                {
+                    globalPoolSize = atoi(value);
+                }
+                // smallest change and most updates per second sent to Pd,
+                // for all parameters or for parameter <n>
+                if (strstr(param, "paramthreshold") == param)
+                {
+                    char *num = param + strlen("paramthreshold");
+                    int paramNum = atoi(num);
+
+                    if (!*num)
+                        globalParamThreshold = (float)atof(value);
+                    else if (isdigit(*num) && paramNum < MAXPARAMETERS)
+                        globalParamThresholds[paramNum] = (float)atof(value);
+                }
+                if (strstr(param, "paramrate") == param)
+                {
+                    char *num = param + strlen("paramrate");
+                    int paramNum = atoi(num);
+
+                    if (!*num)
+                        globalParamRate = (float)atof(value);
+                    else if (isdigit(*num) && paramNum < MAXPARAMETERS)
+                        globalParamRates[paramNum] = (float)atof(value);
+                }
+                // dense MIDI streams: Pd only gets the latest value of each tick
+                if (strstr(param, "coalesce") == param)
+                {
+                    int type = -1;
+
+                    if (strcmp(param, "coalescecc") == 0)
+                        type = PDVSTCOALESCE(CONTROLLER_CHANGE);
+                    else if (strcmp(param, "coalescepitchbend") == 0)
+                        type = PDVSTCOALESCE(PITCH_BEND);
+                    else if (strcmp(param, "coalesceaftertouch") == 0)
+                        type = PDVSTCOALESCE(CHANNEL_PRESSURE);
+                    else if (strcmp(param, "coalescepolyaftertouch") == 0)
+                        type = PDVSTCOALESCE(KEY_PRESSURE);
+                    else if (strcmp(param, "coalesceexpression") == 0)
+                        type = PDVSTCOALESCEEXPRESSION;
+                    if (type >= 0 && strcmp(strlowercase(value), "true") == 0)
+                        globalMidiCoalesce |= type;
+                    else if (type >= 0 && strcmp(strlowercase(value), "false") == 0)
+                        globalMidiCoalesce &= ~type;
+                }
+                if (strcmp(param, "compressstate") == 0)
+                {
+                    if (strcmp(strlowercase(value), "true") == 0)
+                        globalCompressState = true;
+                    else if (strcmp(strlowercase(value), "false") == 0)
+                        globalCompressState = false;
+                }
+                // rvstdata messages per Pd tick when a state is loaded
+                if (strcmp(param, "restoremessages") == 0)
+                    globalRestoreMessages = atoi(value);
+                if (strcmp(param, "restoremicroseconds") == 0)
+                    globalRestoreMicroseconds = atoi(value);
+                if (strcmp(param, "loglevel") == 0)
+                {
+                    strlowercase(value);
+                    if (strcmp(value, "none") == 0)
+                        globalLogLevel = PDVSTLOGNONE;
+                    else if (strcmp(value, "error") == 0)
+                        globalLogLevel = PDVSTLOGERROR;
+                    else if (strcmp(value, "warning") == 0)
+                        globalLogLevel = PDVSTLOGWARNING;
+                    else if (strcmp(value, "info") == 0)
+                        globalLogLevel = PDVSTLOGINFO;
+                    else if (strcmp(value, "debug") == 0)
+                        globalLogLevel = PDVSTLOGDEBUG;
+                }
+                if (strcmp(param, "logdir") == 0)
+                    strcpy(globalLogDir, value);
+                if (strcmp(param, "trace") == 0)
+                {
+                    if (strcmp(strlowercase(value), "true") == 0)
+                        globalTrace = true;
+                    else if (strcmp(strlowercase(value), "false") == 0)
+                        globalTrace = false;
+                }
+                // programs: PROGRAM starts one, its PARAMETER<n> follow
+                if (strcmp(param, "program") == 0 && \
+                    globalNPrograms < MAXPROGRAMS)
+                {
+                    progNum++;
+                    strcpy(globalProgram[progNum].name, value);
+                    globalNPrograms = progNum + 1;
+                }
+                // program parameters
+                if (strstr(param, "parameter") == \
+                    param && progNum >= 0 &&
+                    !isalpha(param[strlen("parameter")]))
+                {
+                    int paramNum = atoi(param + strlen("parameter"));
+
+                    if (paramNum < MAXPARAMETERS && paramNum >= 0)
+                    {
+                        if (!globalProgram[progNum].paramValue)
+                            globalProgram[progNum].paramValue = \
+                                (float *)calloc(MAXPARAMETERS, sizeof(float));
+                        globalProgram[progNum].paramValue[paramNum] = \
+                                                             (float)atof(value);
+                    }
+                }
             // --------------------------------------------
                 // unused in pdvst3
                 #if 0
@@ -443,25 +595,6 @@ void parseSetupFile()
 
                 }
 
-                // program name
-                if (strcmp(param, "program") == 0 && \
-                    globalNPrograms < MAXPROGRAMS)
-                {
-                    progNum++;
-                    strcpy(globalProgram[progNum].name, value);
-                    globalNPrograms = progNum + 1;
-                }
-                // program parameters
-                if (strstr(param, "parameter") == \
-                    param && globalNPrograms < MAXPROGRAMS &&
-                    !isalpha(param[strlen("parameter")]))
-                {
-                    int paramNum = atoi(param + strlen("parameter"));
-
-                    if (paramNum < MAXPARAMS && paramNum >= 0)
-                        globalProgram[progNum].paramValue[paramNum] = \
-                                                             (float)atof(value);
-                }
                 // programsarechunks (save custom data in .fxp or .fxb file)
                 if (strcmp(param, "programsarechunks") == 0)
                 {
@@ -43,6 +43,12 @@
 #endif
 
 #include <cstdlib>
+#include <mutex>
+
+extern int globalPoolSize;
+extern int globalNChannelsIn;
+extern int globalNChannelsOut;
+extern int globalNParams;
 
 namespace Steinberg {
 
@@ -65,6 +71,8 @@ CPluginFactory::~CPluginFactory ()
 	if (gPluginFactory == this)
 		gPluginFactory = nullptr;
 
+	pdvstPoolClear ();
+
 	if (classes)
 		free (classes);
 
@@ -344,5 +352,83 @@ tresult PLUGIN_API CPluginFactory::setHostContext (FUnknown* context)
 #endif
 }
 
+//------------------------------------------------------------------------
+//  pool of idle Pd processes (POOLSIZE in config.txt)
+//------------------------------------------------------------------------
+// Every Pd is started without a patch and runs our scheduler free-running,
+// an instance claims one and only asks it to open the patch. The pool is
+// filled on the first claim so scanning the plug-in does not start Pd.
+static struct
+{
+	std::mutex lock;
+	int count;
+	int launched;
+	pdvstResources entry[MAXPOOLSIZE];
+} pdPool;
+
+//------------------------------------------------------------------------
+static int poolChannels (int nChannels)
+{
+	// same rounding to stereo buses as the processor
+	if (nChannels > MAXCHANNELS)
+		nChannels = MAXCHANNELS;
+	return (nChannels / 2) * 2;
+}
+
+//------------------------------------------------------------------------
+static void poolLaunch (pdvstResources* r)
+{
+	char tag[32], extraFlags[MAXSTRLEN], commandLine[MAXSTRLEN];
+	int chIn = poolChannels (globalNChannelsIn);
+	int chOut = poolChannels (globalNChannelsOut);
+
+	sprintf (tag, "pool%d", pdPool.launched++);
+	pdvstCreateResources (r, tag, PDVSTMAPSIZE (globalNParams, 0, 0));
+	pdvstInitTransfer (r->data, chIn, chOut, true);
+	pdvstSchedulerFlags (r, extraFlags);
+	pdvstMakeCommandLine (commandLine, extraFlags, chIn, chOut, false);
+	void* process = pdvstSpawnPd (commandLine);
+#if _WIN32
+	r->process = (HANDLE)process;
+#else
+	(void) process;
+#endif
+}
+
+//------------------------------------------------------------------------
+bool pdvstPoolClaim (pdvstResources* r)
+{
+	int poolSize = (globalPoolSize > MAXPOOLSIZE) ? MAXPOOLSIZE : globalPoolSize;
+	std::lock_guard<std::mutex> guard (pdPool.lock);
+
+	if (poolSize <= 0)
+		return false;
+	if (pdPool.launched == 0)
+	{
+		while (pdPool.count < poolSize)
+			poolLaunch (&pdPool.entry[pdPool.count++]);
+	}
+	// the oldest one has had the most time to start
+	*r = pdPool.entry[0];
+	memmove (&pdPool.entry[0], &pdPool.entry[1], --pdPool.count * sizeof (pdvstResources));
+	poolLaunch (&pdPool.entry[pdPool.count++]);
+	return true;
+}
+
+//------------------------------------------------------------------------
+void pdvstPoolClear ()
+{
+	std::lock_guard<std::mutex> guard (pdPool.lock);
+
+	while (pdPool.count > 0)
+	{
+		pdvstResources* r = &pdPool.entry[--pdPool.count];
+		// Pd quits on its next loop, it keeps its own mapping until then
+		r->data->active = 0;
+		pdvstDestroyResources (r);
+	}
+	pdPool.launched = 0;
+}
+
 //------------------------------------------------------------------------
 } // namespace Steinberg
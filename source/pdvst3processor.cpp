@@ -42,6 +42,8 @@
     #include <fcntl.h>
     #include <sys/mman.h>
     #include <unistd.h>
+    #include <signal.h>
+    #include <errno.h>
 #endif
 #include <string.h>
 #include <stdlib.h>
@@ -50,6 +52,8 @@
 #include <ctype.h>
 #include <sys/stat.h>
 #include <fstream>
+#include <chrono>
+#include <mutex>
 #ifdef _MSC_VER
     #define stat _stat
 #endif
@@ -62,7 +66,18 @@ extern int globalNParams;
 extern long globalPluginId;
 extern int globalNExternalLibs;
 extern char globalExternalLib[MAXEXTERNS][MAXSTRLEN];
-extern char globalVstParamName[MAXPARAMETERS][MAXSTRLEN];
+extern char *globalVstParamName[MAXPARAMETERS];
+extern float globalParamThreshold;
+extern float globalParamRate;
+extern float globalParamThresholds[MAXPARAMETERS];
+extern float globalParamRates[MAXPARAMETERS];
+extern int globalMidiCoalesce;
+extern bool globalCompressState;
+extern int globalRestoreMessages;
+extern int globalRestoreMicroseconds;
+extern int globalLogLevel;
+extern char globalLogDir[MAXFILENAMELEN];
+extern bool globalTrace;
 extern char globalPluginPath[MAXFILENAMELEN];
 extern char globalPluginName[MAXSTRLEN];
 extern char globalPdMoreFlags[MAXSTRLEN];
@@ -74,6 +89,7 @@ extern bool globalCustomGui;
 extern bool globalIsASynth;
 extern pdvstProgram globalProgram[MAXPROGRAMS];
 extern int globalLatency;
+extern bool globalSharedPd;
 int Steinberg::pdvst3Processor::referenceCount = 0;
 
 
@@ -84,182 +100,181 @@ using namespace Steinberg;
 namespace Steinberg {
 
 
-void pdvst3Processor::debugLog(char *fmt, ...)
-{
-    va_list ap;
-
-    if (debugFile)
-    {
-        va_start(ap, fmt);
-        vfprintf(debugFile, fmt, ap);
-        va_end(ap);
-        putc('\n', debugFile);
-        fflush(debugFile);
-    }
-}
+//------------------------------------------------------------------------
+// mutexes events semaphores
+//------------------------------------------------------------------------
 
-void pdvst3Processor::set_resources()
+static int waitHandle(pdvstHandle h, int ms)
 {
-    #ifdef _WIN32
-    sprintf(pdvstTransferMutexName, "mutex%d%x", GetCurrentProcessId(), this);
-    sprintf(pdvstTransferFileMapName, "filemap%d%x", GetCurrentProcessId(), this);
-    sprintf(vstProcEventName, "vstprocevent%d%x", GetCurrentProcessId(), this);
-    sprintf(pdProcEventName, "pdprocevent%d%x", GetCurrentProcessId(), this);
-    mu_tex[PDVSTTRANSFERMUTEX]  = CreateMutexA(NULL, 0, pdvstTransferMutexName);
-    mu_tex[VSTPROCEVENT] = CreateEventA(NULL, TRUE, TRUE, vstProcEventName);
-    mu_tex[PDPROCEVENT] = CreateEventA(NULL, TRUE, FALSE, pdProcEventName);
-    pdvstTransferFileMap = CreateFileMappingA(INVALID_HANDLE_VALUE,
-                                             NULL,
-                                             PAGE_READWRITE,
-                                             0,
-                                             sizeof(pdvstTransferData),
-                                             pdvstTransferFileMapName);
-    pdvstData = (pdvstTransferData *)MapViewOfFile(pdvstTransferFileMap,
-                                                   FILE_MAP_ALL_ACCESS,
-                                                   0,
-                                                   0,
-                                                   sizeof(pdvstTransferData));
-    #else // Unix
-
-    sprintf(pdvstSharedAddressesMapName, "/sharedmap%d%x", getpid(), this);
-    fd = shm_open(pdvstSharedAddressesMapName, O_CREAT | O_RDWR, 0666);
-    ftruncate(fd, sizeof(pdvstSharedAddresses));
-    pdvstSharedAddressesMap = (char*)mmap(NULL, sizeof(pdvstSharedAddresses),
-                                PROT_READ | PROT_WRITE, MAP_SHARED,
-                                fd, 0);
-    ::close(fd);
-    pdvstShared = (pdvstSharedAddresses *)pdvstSharedAddressesMap;
-    sprintf(pdvstShared->pdvstTransferMutexName, "/mutex%d%x", getpid(), this);
-    sprintf(pdvstShared->pdvstTransferFileMapName, "/filemap%d%x", getpid(), this);
-    sprintf(pdvstShared->vstProcEventName, "/vstprocevent%d%x", getpid(), this);
-    sprintf(pdvstShared->pdProcEventName, "/pdprocevent%d%x", getpid(), this);
-    mu_tex[PDVSTTRANSFERMUTEX] = sem_open(pdvstShared->pdvstTransferMutexName, O_CREAT, 0666, 1);
-    mu_tex[VSTPROCEVENT] = sem_open(pdvstShared->vstProcEventName, O_CREAT, 0666, 1);  // Initial value 1 (TRUE)
-    mu_tex[PDPROCEVENT] = sem_open(pdvstShared->pdProcEventName, O_CREAT, 0666, 0);
-    fd = shm_open(pdvstShared->pdvstTransferFileMapName, O_CREAT | O_RDWR, 0666);
-    ftruncate(fd, sizeof(pdvstTransferData));
-    pdvstTransferFileMap = (char*)mmap(NULL, sizeof(pdvstTransferData),
-                                PROT_READ | PROT_WRITE, MAP_SHARED,
-                                fd, 0);
-    mlock(pdvstTransferFileMap, sizeof(pdvstTransferData));
-    ::close(fd);
-    pdvstData = (pdvstTransferData *)pdvstTransferFileMap;
+    #if _WIN32
+        int ret;
+        ret = WaitForSingleObject(h, ms);
 
+        if (ret == WAIT_TIMEOUT)
+            return 0;
+        else if (ret == WAIT_OBJECT_0)
+            return 1;
+        else
+            return(ret);
+    #else
+        if (ms == -1) ms = 30000;
+        float elapsed_time = 0;
+        int wait_time = 10; // Wait time between attempts in microseconds
+        while (1)
+        {
+            if (sem_trywait(h) == 0)
+                return 1;
+            if (elapsed_time >= ms)
+            {
+                // Timeout has been reached
+                return 0;
+            }
+            usleep(wait_time);
+            elapsed_time += (wait_time / 1000.);
+        }
     #endif
 }
 
-void pdvst3Processor::clean_resources()
+static void releaseHandle(pdvstHandle h)
 {
-    #ifdef _WIN32
-        CloseHandle(mu_tex[PDVSTTRANSFERMUTEX]);
-        UnmapViewOfFile(pdvstTransferFileMap);
-        CloseHandle(pdvstTransferFileMap);
+    #if _WIN32
+        ReleaseMutex(h);
     #else
-        sem_close(mu_tex[VSTPROCEVENT]);
-        sem_close(mu_tex[PDPROCEVENT]);
-        sem_close(mu_tex[PDVSTTRANSFERMUTEX]);
-        sem_unlink(pdvstShared->vstProcEventName);
-        sem_unlink(pdvstShared->pdProcEventName);
-        sem_unlink(pdvstShared->pdvstTransferMutexName);
-        munlock(pdvstTransferFileMap, sizeof(pdvstTransferData));
-        munmap(pdvstTransferFileMap, sizeof(pdvstTransferData));
-        munmap(pdvstSharedAddressesMap, sizeof(pdvstSharedAddresses));
-
+        sem_post(h);
     #endif
 }
 
-void pdvst3Processor::startPd()
+// after Pd was killed: take a mutex it may have died holding. the other
+// holders keep it for a few ms at most, so when it doesn't come within
+// PDWAITMAX the dead Pd has it and it is ours to release (Windows gives
+// such a mutex to the waiter as abandoned). 0 if it was left taken
+static int takeFromDeadPd(pdvstHandle h)
 {
-    char commandLineArgs[MAXSTRLEN],
-             debugString[MAXSTRLEN],
-                     buf[MAXSTRLEN];
-    int i;
-    set_resources();
-    pdvstData->active = 1;
-    pdvstData->blockSize = PDBLKSIZE;
-    pdvstData->nChannelsIn = nChannelsIn;
-    pdvstData->nChannelsOut = nChannelsOut;
-    pdvstData->sampleRate = 48000;
-    pdvstData->nParameters = globalNParams;
-    pdvstData->guiState.updated = 0;
-    pdvstData->guiState.type = FLOAT_TYPE;
-    pdvstData->guiState.direction = PD_RECEIVE;
-    for (i = 0; i < MAXPARAMETERS; i++)
-    {
-        pdvstData->vstParameters[i].direction = PD_RECEIVE;
-        pdvstData->vstParameters[i].updated = 0;
-    }
-    if (globalDebug)
-    {
-        strcpy(debugString, "");
-    }
-    else
+    return waitHandle(h, PDWAITMAX) != 0;
+}
+
+// kill a Pd and wait up to PDWAITMAX for it to be gone. false if it is
+// still there: nothing it may hold can be released then
+#ifdef _WIN32
+static bool killProcess(HANDLE process)
+{
+    TerminateProcess(process, 1);
+    return WaitForSingleObject(process, PDWAITMAX) == WAIT_OBJECT_0;
+}
+#else
+static bool killProcess(int pid)
+{
+    kill(pid, SIGKILL);
+    for (int ms = 0; ms < PDWAITMAX; ms++)
     {
-        strcpy(debugString, " -nogui");
+        // Pd is detached from us (system() + &), init reaps it
+        if (kill(pid, 0) == -1 && errno == ESRCH)
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
+    return false;
+}
+#endif
 
-    while(1)
-    {
-        sprintf(commandLineArgs, "\"%s\"", globalPureDataPath);
-        FILE *foo;
-        foo = fopen(globalPureDataPath, "r");
-        if( foo != NULL )
-            break;
-        else
+static void setHandle(pdvstHandle h)
+{
+    #if _WIN32
+        SetEvent(h);
+    #else
+        int value;
+        sem_getvalue(h, &value);
+        if (value == 0)
         {
-        sprintf(errorMessage,"pd program not found. Check your settings in in file: %s",
-                              globalConfigFile);
-            break;
+            sem_post(h);  // Increment to 1 (signaled)
         }
-    }
+    #endif
+}
+
+static void resetHandle(pdvstHandle h)
+{
+    #if _WIN32
+        ResetEvent(h);
+    #else
+        int value;
+        sem_getvalue(h, &value);
+        while (value > 0)
+        {
+            sem_wait(h);  // Decrement until count is 0
+            sem_getvalue(h, &value);
+        }
+    #endif
+}
 
+//------------------------------------------------------------------------
+// shared Pd server: one per plugin binary, shared by all its instances
+//------------------------------------------------------------------------
+
+static struct
+{
+    std::mutex lock;
+    int refCount;
+    int generation;         // bumped on every relaunch
+    pdvstServerData *data;
+    pdvst3Processor *slotOwner[MAXPDINSTANCES];
+    pdvstHandle mu_tex[2];
+    char fileMapName[PDVSTNAMELEN],
+         mutexName[PDVSTNAMELEN],
+         eventName[PDVSTNAMELEN];
+    char commandLine[MAXSTRLEN];
+#if _WIN32
+    HANDLE fileMap;
+    HANDLE process;
+#endif
+} pdServer;
+
+// the command line that starts Pd with our scheduler. extraFlags are for
+// the scheduler. without openPatch Pd starts empty (shared server, pool)
+void pdvstMakeCommandLine(char *commandLineArgs, const char *extraFlags,
+                          int chIn, int chOut, bool openPatch)
+{
+    char buf[MAXSTRLEN];
+    int i;
+
+    sprintf(commandLineArgs, "\"%s\"", globalPureDataPath);
     sprintf(buf,
             "%s %s",
-            debugString,
+            globalDebug ? "" : " -nogui",
             globalPdMoreFlags);
     strcat(commandLineArgs, buf);
     sprintf(buf,
             " -schedlib \"%spdvst3scheduler\"",
             globalSchedulerPath);
     strcat(commandLineArgs, buf);
-    #ifdef _WIN32
-        sprintf(buf,
-                " -extraflags \"-vstproceventname %s -pdproceventname %s -vsthostid %d -mutexname %s -filemapname %s\"",
-                vstProcEventName,
-                pdProcEventName,
-                GetCurrentProcessId(),
-                pdvstTransferMutexName,
-                pdvstTransferFileMapName);
-    #else
-        sprintf(buf,
-                " -extraflags \"-vsthostid %d  -sharedmapname %s\"",
-               getpid(),
-               pdvstSharedAddressesMapName);
-    #endif
+    sprintf(buf,
+            " -extraflags \"%s\"",
+            extraFlags);
     strcat(commandLineArgs, buf);
     sprintf(buf,
             " -outchannels %d -inchannels %d",
-            nChannelsOut,
-            nChannelsIn);
+            chOut,
+            chIn);
     strcat(commandLineArgs, buf);
     sprintf(buf,
             " -r %d",
             48000);
     strcat(commandLineArgs, buf);
-    sprintf(buf,
-            " -open \"%s%s\"",
-            globalPluginPath,
-            globalPdFile);
-    strcat(commandLineArgs, buf);
+    if (openPatch)
+    {
+        sprintf(buf,
+                " -open \"%s%s\"",
+                globalPluginPath,
+                globalPdFile);
+        strcat(commandLineArgs, buf);
+    }
     sprintf(buf,
             " -path \"%s\"",
             globalPluginPath);
     strcat(commandLineArgs, buf);
-    for (i = 0; i < nExternalLibs; i++)
+    for (i = 0; i < globalNExternalLibs; i++)
     {
         sprintf(buf,
                 " -lib %s",
-                externalLib[i]);
+                globalExternalLib[i]);
         strcat(commandLineArgs, buf);
     }
     #ifndef _WIN32
@@ -267,16 +282,22 @@ void pdvst3Processor::startPd()
                     " 2>/dev/null &");
         strcat(commandLineArgs, buf);
     #endif
-    debugLog("command line: %s", commandLineArgs);
-    suspend();
+}
+
+// start Pd in the background. on Windows returns its process handle
+void *pdvstSpawnPd(const char *commandLine)
+{
+    char commandLineArgs[MAXSTRLEN];
 
+    // CreateProcessA may write into the command line
+    strcpy(commandLineArgs, commandLine);
     #ifdef _WIN32
         STARTUPINFOA si;
         PROCESS_INFORMATION pi;
         ZeroMemory(&si, sizeof(si));
         si.cb = sizeof(si);
         ZeroMemory(&pi, sizeof(pi));
-        CreateProcessA(NULL,
+        if (CreateProcessA(NULL,
                       commandLineArgs,
                       NULL,
                       NULL,
@@ -285,20 +306,895 @@ void pdvst3Processor::startPd()
                       NULL,
                       NULL,
                       &si,
-                      &pi);
+                      &pi))
+        {
+            CloseHandle(pi.hThread);
+            return pi.hProcess;
+        }
+        return NULL;
     #else
         system(commandLineArgs);
+        return NULL;
+    #endif
+}
+
+static void launchServer()
+{
+    void *process = pdvstSpawnPd(pdServer.commandLine);
+    #ifdef _WIN32
+        pdServer.process = (HANDLE)process;
+    #else
+        (void) process;
+    #endif
+}
+
+// log lines go to hostLog from any thread without blocking, the
+// supervisor writes them to the log file (see drainLog())
+void pdvst3Processor::debugLog(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    pdvstLogV(hostLog, PDVSTLOGINFO, fmt, ap);
+    va_end(ap);
+}
+
+void pdvst3Processor::logMessage(int level, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    pdvstLogV(hostLog, level, fmt, ap);
+    va_end(ap);
+}
+
+// the lines of both log rings to the log file, opened on the first one.
+// supervisor thread, or pdvstquit() once it is gone
+void pdvst3Processor::drainLog()
+{
+    static const char *levelName[] = {"error", "warning", "info", "debug"};
+    static const char *source[] = {"host", "pd"};
+    pdvstLogRing *rings[] = {hostLog, &pdvstData->pdLog};
+    pdvstLogEntry entry;
+    bool wrote = false;
+
+    for (int k = 0; k < 2; k++)
+    {
+        uint32_t dropped = rings[k]->dropped;
+        while (pdvstLogRead(rings[k], &entry))
+        {
+            if (!debugFile && logPath[0])
+            {
+                debugFile = fopen(logPath, "at");
+                if (!debugFile)
+                    logPath[0] = 0;  // don't try again
+            }
+            if (debugFile)
+            {
+                fprintf(debugFile, "%.6f %s %s: %s\n", entry.time, source[k],
+                        levelName[(entry.level >= 0 && entry.level <= PDVSTLOGDEBUG) ?
+                        entry.level : PDVSTLOGDEBUG], entry.text);
+                wrote = true;
+            }
+        }
+        if (dropped != logDropped[k] && debugFile)
+        {
+            fprintf(debugFile, "%.6f %s warning: %u lines lost, the log ring was full\n",
+                    pdvstLogNow(), source[k], dropped - logDropped[k]);
+            wrote = true;
+        }
+        logDropped[k] = dropped;
+    }
+    if (wrote)
+        fflush(debugFile);
+}
+
+// the events of both trace rings to the .trace file, read by pdvst3trace:
+// "PDVT", version and record size (uint32), then pdvstTraceEvent records
+void pdvst3Processor::drainTrace()
+{
+    pdvstTraceEvent event;
+    bool wrote = false;
+
+    if (!pdvstData->tracing || !tracePath[0])
+        return;
+    if (!traceFile)
+    {
+        uint32_t header[2] = {PDVSTTRACEVERSION, sizeof(pdvstTraceEvent)};
+        traceFile = fopen(tracePath, "wb");
+        if (!traceFile)
+        {
+            logMessage(PDVSTLOGERROR, "can't write the trace to %s", tracePath);
+            tracePath[0] = 0;
+            return;
+        }
+        fwrite("PDVT", 1, 4, traceFile);
+        fwrite(header, sizeof(uint32_t), 2, traceFile);
+    }
+    for (int k = 0; k < 2; k++)
+    {
+        uint32_t dropped = pdvstData->trace[k].dropped;
+        while (pdvstTraceRead(&pdvstData->trace[k], &event))
+        {
+            fwrite(&event, sizeof(pdvstTraceEvent), 1, traceFile);
+            wrote = true;
+        }
+        if (dropped != traceDropped[k])
+        {
+            event.time = pdvstLogNow();
+            event.type = PDVSTTRACELOST;
+            event.arg = (int32_t)(dropped - traceDropped[k]);
+            fwrite(&event, sizeof(pdvstTraceEvent), 1, traceFile);
+            wrote = true;
+        }
+        traceDropped[k] = dropped;
+    }
+    if (wrote)
+        fflush(traceFile);
+}
+
+//------------------------------------------------------------------------
+// transfer resources
+//------------------------------------------------------------------------
+
+// names are made unique with our pid and tag
+void pdvstCreateResources(pdvstResources *r, const char *tag, int size)
+{
+    r->size = size;
+    #ifdef _WIN32
+    r->process = NULL;
+    sprintf(r->mutexName, "mutex%d%s", GetCurrentProcessId(), tag);
+    sprintf(r->fileMapName, "filemap%d%s", GetCurrentProcessId(), tag);
+    sprintf(r->vstProcEventName, "vstprocevent%d%s", GetCurrentProcessId(), tag);
+    sprintf(r->pdProcEventName, "pdprocevent%d%s", GetCurrentProcessId(), tag);
+    r->mu_tex[PDVSTTRANSFERMUTEX]  = CreateMutexA(NULL, 0, r->mutexName);
+    r->mu_tex[VSTPROCEVENT] = CreateEventA(NULL, TRUE, TRUE, r->vstProcEventName);
+    r->mu_tex[PDPROCEVENT] = CreateEventA(NULL, TRUE, FALSE, r->pdProcEventName);
+    r->fileMap = CreateFileMappingA(INVALID_HANDLE_VALUE,
+                                    NULL,
+                                    PAGE_READWRITE,
+                                    0,
+                                    size,
+                                    r->fileMapName);
+    r->data = (pdvstTransferData *)MapViewOfFile(r->fileMap,
+                                                 FILE_MAP_ALL_ACCESS,
+                                                 0,
+                                                 0,
+                                                 size);
+    #else // Unix
+    int fd;
+
+    sprintf(r->sharedAddressesMapName, "/sharedmap%d%s", getpid(), tag);
+    fd = shm_open(r->sharedAddressesMapName, O_CREAT | O_RDWR, 0666);
+    ftruncate(fd, sizeof(pdvstSharedAddresses));
+    r->sharedAddressesMap = (char*)mmap(NULL, sizeof(pdvstSharedAddresses),
+                                PROT_READ | PROT_WRITE, MAP_SHARED,
+                                fd, 0);
+    ::close(fd);
+    r->shared = (pdvstSharedAddresses *)r->sharedAddressesMap;
+    sprintf(r->shared->pdvstTransferMutexName, "/mutex%d%s", getpid(), tag);
+    sprintf(r->shared->pdvstTransferFileMapName, "/filemap%d%s", getpid(), tag);
+    sprintf(r->shared->vstProcEventName, "/vstprocevent%d%s", getpid(), tag);
+    sprintf(r->shared->pdProcEventName, "/pdprocevent%d%s", getpid(), tag);
+    r->mu_tex[PDVSTTRANSFERMUTEX] = sem_open(r->shared->pdvstTransferMutexName, O_CREAT, 0666, 1);
+    r->mu_tex[VSTPROCEVENT] = sem_open(r->shared->vstProcEventName, O_CREAT, 0666, 1);  // Initial value 1 (TRUE)
+    r->mu_tex[PDPROCEVENT] = sem_open(r->shared->pdProcEventName, O_CREAT, 0666, 0);
+    fd = shm_open(r->shared->pdvstTransferFileMapName, O_CREAT | O_RDWR, 0666);
+    ftruncate(fd, size);
+    r->fileMap = (char*)mmap(NULL, size,
+                                PROT_READ | PROT_WRITE, MAP_SHARED,
+                                fd, 0);
+    mlock(r->fileMap, size);
+    ::close(fd);
+    r->data = (pdvstTransferData *)r->fileMap;
+
+    #endif
+    r->data->mapSize = size;
+}
+
+void pdvstDestroyResources(pdvstResources *r)
+{
+    #ifdef _WIN32
+        CloseHandle(r->mu_tex[PDVSTTRANSFERMUTEX]);
+        CloseHandle(r->mu_tex[VSTPROCEVENT]);
+        CloseHandle(r->mu_tex[PDPROCEVENT]);
+        UnmapViewOfFile(r->data);
+        CloseHandle(r->fileMap);
+        if (r->process != NULL)
+            CloseHandle(r->process);
+    #else
+        sem_close(r->mu_tex[VSTPROCEVENT]);
+        sem_close(r->mu_tex[PDPROCEVENT]);
+        sem_close(r->mu_tex[PDVSTTRANSFERMUTEX]);
+        sem_unlink(r->shared->vstProcEventName);
+        sem_unlink(r->shared->pdProcEventName);
+        sem_unlink(r->shared->pdvstTransferMutexName);
+        shm_unlink(r->shared->pdvstTransferFileMapName);
+        munlock(r->fileMap, r->size);
+        munmap(r->fileMap, r->size);
+        munmap(r->sharedAddressesMap, sizeof(pdvstSharedAddresses));
+        shm_unlink(r->sharedAddressesMapName);
+
+    #endif
+    r->data = NULL;
+}
+
+// what the scheduler needs to find the resources
+void pdvstSchedulerFlags(pdvstResources *r, char *extraFlags)
+{
+    #ifdef _WIN32
+        sprintf(extraFlags,
+                "-vstproceventname %s -pdproceventname %s -vsthostid %d -mutexname %s -filemapname %s",
+                r->vstProcEventName,
+                r->pdProcEventName,
+                GetCurrentProcessId(),
+                r->mutexName,
+                r->fileMapName);
+    #else
+        sprintf(extraFlags,
+                "-vsthostid %d  -sharedmapname %s",
+               getpid(),
+               r->sharedAddressesMapName);
+    #endif
+}
+
+// what Pd needs before it starts. fresh: no Pd writes to d yet, so its
+// log ring can be cleared (a pooled Pd may be logging already)
+void pdvstInitTransfer(pdvstTransferData *d, int nChannelsIn, int nChannelsOut, bool fresh)
+{
+    d->active = 1;
+    d->blockSize = PDBLKSIZE;
+    d->nChannelsIn = nChannelsIn;
+    d->nChannelsOut = nChannelsOut;
+    d->sampleRate = 48000;
+    d->nParameters = globalNParams;
+    d->midiCoalesce = globalMidiCoalesce;
+    d->chunkCompress = globalCompressState;
+    d->restoreMessages = globalRestoreMessages;
+    d->restoreMicroseconds = globalRestoreMicroseconds;
+    if (fresh)
+        pdvstLogReset(&d->pdLog, globalLogLevel);
+    else
+        d->pdLog.level = globalLogLevel;
+    pdvstTraceReset(d, 0);  // startPd() turns it on once the rings are ours
+    d->guiState.updated = 0;
+    d->guiState.type = FLOAT_TYPE;
+    d->guiState.direction = PD_RECEIVE;
+    memset(PDVSTDIRTY(d), 0, PDVSTDIRTYWORDS(d->nParameters) * sizeof(uint32_t));
+    d->paramOutHead = d->paramOutTail = 0;
+    d->chunkIn.full = d->chunkOut.full = 0;
+    d->chunkRequest = d->chunkOnRequest = 0;
+    d->sysexIn.head = d->sysexIn.tail = d->sysexIn.byteHead = d->sysexIn.byteTail = 0;
+    d->sysexOut.head = d->sysexOut.tail = d->sysexOut.byteHead = d->sysexOut.byteTail = 0;
+}
+
+void pdvst3Processor::set_resources()
+{
+    int fifoChannels = (nChannelsIn > nChannelsOut) ? nChannelsIn : nChannelsOut;
+    int size = PDVSTMAPSIZE(nParameters, sharedPd ? PDFIFOBLOCKS : 0, fifoChannels);
+    char tag[32];
+
+    sprintf(tag, "%x", this);
+    pdvstCreateResources(&res, tag, size);
+    pdvstData = res.data;
+    pdvstData->nParameters = nParameters;
+    pdvstData->fifoBlocks = PDFIFOBLOCKS;
+    pdvstData->fifoChannels = fifoChannels;
+    pdvstData->inHead = pdvstData->inTail = 0;
+    pdvstData->outHead = pdvstData->outTail = 0;
+}
+
+void pdvst3Processor::clean_resources()
+{
+    pdvstDestroyResources(&res);
+}
+
+// start Pd and its supervisor once, when the host first activates us.
+// host scans only create and query the plugin and never get here
+void pdvst3Processor::activatePd()
+{
+    if (pdStarted)
+        return;
+    pdStarted = true;
+    debugLog("startingPd...");
+    startPd();
+    supervisorRun = true;
+    supervisor = std::thread(&pdvst3Processor::supervise, this);
+    chunkRun = true;
+    chunkThread = std::thread(&pdvst3Processor::transferChunks, this);
+    debugLog("done");
+}
+
+void pdvst3Processor::startPd()
+{
+    char commandLineArgs[MAXSTRLEN],
+                 extraFlags[MAXSTRLEN];
+    bool pooled = false;
+    pdvstTransferData *pending = pdvstData;
+
+    // a Pd from the pool is already up with our scheduler, it only has
+    // to open the patch
+    if (!sharedPd && pdvstPoolClaim(&res))
+    {
+        pooled = true;
+        pdvstData = res.data;
+        xxWaitForSingleObject(PDVSTTRANSFERMUTEX, -1);
+    }
+    else
+        set_resources();
+    pdvstInitTransfer(pdvstData, nChannelsIn, nChannelsOut, !pooled);
+    pdvstData->tracing = globalTrace;
+    // what the host gave us before Pd was started
+    memcpy(PDVSTPARAMS(pdvstData), PDVSTPARAMS(pending), PDVSTPARAMBYTES(nParameters));
+    applyStagedState();
+    pdvstData->plugName = pending->plugName;
+    pdvstData->progname2pd = pending->progname2pd;
+    pdvstData->prognumber2pd = pending->prognumber2pd;
+    free(pending);
+    if (pooled)
+    {
+        strcpy(pdvstData->patchName, globalPdFile);
+        strcpy(pdvstData->patchDir, globalPluginPath);
+        pdvstData->openPatch = 1;
+        xxReleaseMutex(PDVSTTRANSFERMUTEX);
+        debugLog("Pd from the pool");
+    }
+
+    FILE *foo;
+    foo = fopen(globalPureDataPath, "r");
+    if (foo != NULL)
+        fclose(foo);
+    else
+        sprintf(errorMessage,"pd program not found. Check your settings in in file: %s",
+                              globalConfigFile);
+
+    if (sharedPd)
+    {
+        suspend();
+        attachServer();
+        return;
+    }
+    // a restart launches a fresh Pd with the patch on the same resources
+    pdvstSchedulerFlags(&res, extraFlags);
+    pdvstMakeCommandLine(commandLineArgs, extraFlags, nChannelsIn, nChannelsOut, true);
+    debugLog("command line: %s", commandLineArgs);
+    strcpy(pdCommandLine, commandLineArgs);
+    suspend();
+    if (!pooled)
+        launchPd();
+}
+
+// the first instance creates the server control region and starts Pd
+void pdvst3Processor::startServer()
+{
+    char extraFlags[MAXSTRLEN];
+
+    #ifdef _WIN32
+        sprintf(pdServer.fileMapName, "pdvstserver%d%x", GetCurrentProcessId(), &pdServer);
+        sprintf(pdServer.mutexName, "pdvstservermutex%d%x", GetCurrentProcessId(), &pdServer);
+        sprintf(pdServer.eventName, "pdvstserverevent%d%x", GetCurrentProcessId(), &pdServer);
+        pdServer.mu_tex[SERVERMUTEX] = CreateMutexA(NULL, 0, pdServer.mutexName);
+        pdServer.mu_tex[SERVEREVENT] = CreateEventA(NULL, TRUE, FALSE, pdServer.eventName);
+        pdServer.fileMap = CreateFileMappingA(INVALID_HANDLE_VALUE,
+                                              NULL,
+                                              PAGE_READWRITE,
+                                              0,
+                                              sizeof(pdvstServerData),
+                                              pdServer.fileMapName);
+        pdServer.data = (pdvstServerData *)MapViewOfFile(pdServer.fileMap,
+                                                         FILE_MAP_ALL_ACCESS,
+                                                         0,
+                                                         0,
+                                                         sizeof(pdvstServerData));
+        pdServer.process = NULL;
+    #else
+        sprintf(pdServer.fileMapName, "/pdvstserver%d%x", getpid(), &pdServer);
+        sprintf(pdServer.mutexName, "/pdvstservermutex%d%x", getpid(), &pdServer);
+        sprintf(pdServer.eventName, "/pdvstserverevent%d%x", getpid(), &pdServer);
+        pdServer.mu_tex[SERVERMUTEX] = sem_open(pdServer.mutexName, O_CREAT, 0666, 1);
+        pdServer.mu_tex[SERVEREVENT] = sem_open(pdServer.eventName, O_CREAT, 0666, 0);
+        int sfd = shm_open(pdServer.fileMapName, O_CREAT | O_RDWR, 0666);
+        ftruncate(sfd, sizeof(pdvstServerData));
+        pdServer.data = (pdvstServerData *)mmap(NULL, sizeof(pdvstServerData),
+                                                PROT_READ | PROT_WRITE, MAP_SHARED,
+                                                sfd, 0);
+        ::close(sfd);
+    #endif
+    memset(pdServer.data, 0, sizeof(pdvstServerData));
+    pdServer.data->active = 1;
+    pdServer.data->channelsPerInstance = (nChannelsIn > nChannelsOut) ? nChannelsIn : nChannelsOut;
+    strcpy(pdServer.data->patchName, globalPdFile);
+    strcpy(pdServer.data->patchDir, globalPluginPath);
+    #ifdef _WIN32
+        sprintf(extraFlags,
+                "-vsthostid %d -servermapname %s -servermutexname %s -servereventname %s",
+                GetCurrentProcessId(),
+                pdServer.fileMapName,
+                pdServer.mutexName,
+                pdServer.eventName);
+    #else
+        sprintf(extraFlags,
+                "-vsthostid %d -servermapname %s -servermutexname %s -servereventname %s",
+                getpid(),
+                pdServer.fileMapName,
+                pdServer.mutexName,
+                pdServer.eventName);
+    #endif
+    pdvstMakeCommandLine(pdServer.commandLine, extraFlags,
+                         pdServer.data->channelsPerInstance * MAXPDINSTANCES,
+                         pdServer.data->channelsPerInstance * MAXPDINSTANCES,
+                         false);
+    debugLog("server command line: %s", pdServer.commandLine);
+    launchServer();
+}
+
+// take a slot in the server, Pd opens our patch on its next loop
+void pdvst3Processor::attachServer()
+{
+    int k;
+    std::lock_guard<std::mutex> guard(pdServer.lock);
+
+    if (pdServer.refCount++ == 0)
+        startServer();
+    pdGeneration = pdServer.generation;
+    pdSlot = -1;
+    for (k = 0; k < MAXPDINSTANCES; k++)
+    {
+        if (!pdServer.slotOwner[k])
+        {
+            pdSlot = k;
+            break;
+        }
+    }
+    if (pdSlot < 0)
+    {
+        logMessage(PDVSTLOGERROR, "shared Pd: no free slot (%d instances)", MAXPDINSTANCES);
+        return;
+    }
+    pdvstServerSlot *slot = &pdServer.data->slots[pdSlot];
+    // Pd holds it only to read and answer the requests, never while a patch loads
+    if (!waitHandle(pdServer.mu_tex[SERVERMUTEX], PDWAITMAX))
+    {
+        logMessage(PDVSTLOGERROR, "shared Pd: the server doesn't answer, no slot taken");
+        pdSlot = -1;
+        return;
+    }
+    pdServer.slotOwner[pdSlot] = this;
+    #ifdef _WIN32
+        strcpy(slot->mutexName, res.mutexName);
+        strcpy(slot->fileMapName, res.fileMapName);
+        strcpy(slot->vstProcEventName, res.vstProcEventName);
+        strcpy(slot->pdProcEventName, res.pdProcEventName);
+    #else
+        strcpy(slot->mutexName, res.shared->pdvstTransferMutexName);
+        strcpy(slot->fileMapName, res.shared->pdvstTransferFileMapName);
+        strcpy(slot->vstProcEventName, res.shared->vstProcEventName);
+        strcpy(slot->pdProcEventName, res.shared->pdProcEventName);
+    #endif
+    slot->state = SLOT_ATTACH;
+    releaseHandle(pdServer.mu_tex[SERVERMUTEX]);
+    debugLog("shared Pd: instance %d", pdSlot);
+}
+
+// give our slot back, the last instance stops the server
+void pdvst3Processor::detachServer()
+{
+    std::lock_guard<std::mutex> guard(pdServer.lock);
+    // a hung server gets the request anyway, it is only asked to let go
+    int locked = waitHandle(pdServer.mu_tex[SERVERMUTEX], PDWAITMAX);
+
+    if (pdSlot >= 0)
+    {
+        pdServer.data->slots[pdSlot].state = SLOT_DETACH;
+        pdServer.slotOwner[pdSlot] = NULL;
+        pdSlot = -1;
+    }
+    if (--pdServer.refCount == 0)
+        pdServer.data->active = 0;
+    if (locked)
+        releaseHandle(pdServer.mu_tex[SERVERMUTEX]);
+    if (pdServer.refCount > 0)
+        return;
+    #ifdef _WIN32
+        if (pdServer.process != NULL)
+            CloseHandle(pdServer.process);
+        CloseHandle(pdServer.mu_tex[SERVERMUTEX]);
+        CloseHandle(pdServer.mu_tex[SERVEREVENT]);
+        UnmapViewOfFile(pdServer.data);
+        CloseHandle(pdServer.fileMap);
+    #else
+        sem_close(pdServer.mu_tex[SERVERMUTEX]);
+        sem_close(pdServer.mu_tex[SERVEREVENT]);
+        sem_unlink(pdServer.mutexName);
+        sem_unlink(pdServer.eventName);
+        munmap(pdServer.data, sizeof(pdvstServerData));
+        shm_unlink(pdServer.fileMapName);
+    #endif
+    pdServer.data = NULL;
+}
+
+// the server died or hung: the first instance to notice relaunches it and
+// every attached instance is opened again (their supervisors replay state)
+void pdvst3Processor::relaunchServer(int generation)
+{
+    int k;
+    std::lock_guard<std::mutex> guard(pdServer.lock);
+
+    if (generation != pdServer.generation || !pdServer.data)
+        return;  // somebody else did it already
+    pdServer.generation++;
+    bool gone = false;
+    #ifdef _WIN32
+        if (pdServer.process != NULL)
+        {
+            gone = killProcess(pdServer.process);
+            CloseHandle(pdServer.process);
+            pdServer.process = NULL;
+        }
+    #else
+        if (pdServer.data->pdProcessId > 0)
+            gone = killProcess(pdServer.data->pdProcessId);
+    #endif
+    if (!gone)
+        logMessage(PDVSTLOGWARNING, "shared Pd: the server didn't exit when killed");
+    // a mutex is released only if it is ours: taken now, or left taken by
+    // a server that is gone. one a live server holds stays taken
+    bool serverTaken = takeFromDeadPd(pdServer.mu_tex[SERVERMUTEX]);
+    if (!serverTaken && gone)
+        logMessage(PDVSTLOGWARNING, "shared Pd: the server died holding its mutex");
+    pdServer.data->schedulerReady = 0;
+    pdServer.data->heartbeat = 0;
+    pdServer.data->pdProcessId = 0;
+    pdServer.data->active = 1;
+    for (k = 0; k < MAXPDINSTANCES; k++)
+    {
+        pdvst3Processor *x = pdServer.slotOwner[k];
+        pdServer.data->slots[k].state = x ? SLOT_ATTACH : SLOT_FREE;
+        if (!x)
+            continue;
+        bool taken = takeFromDeadPd(x->res.mu_tex[PDVSTTRANSFERMUTEX]);
+        x->pdvstData->schedulerReady = 0;
+        x->pdvstData->heartbeat = 0;
+        x->pdvstData->pdProcessId = 0;
+        x->pdvstData->inTail = x->pdvstData->inHead;
+        x->pdvstData->outHead = x->pdvstData->outTail;
+        if (taken || gone)
+            releaseHandle(x->res.mu_tex[PDVSTTRANSFERMUTEX]);
+    }
+    if (serverTaken || gone)
+        releaseHandle(pdServer.mu_tex[SERVERMUTEX]);
+    launchServer();
+}
+
+void pdvst3Processor::launchPd()
+{
+    void *process = pdvstSpawnPd(pdCommandLine);
+    #ifdef _WIN32
+        res.process = (HANDLE)process;
+    #else
+        (void) process;
+    #endif
+}
+
+bool pdvst3Processor::pdProcessAlive()
+{
+    #ifdef _WIN32
+        HANDLE process = sharedPd ? pdServer.process : res.process;
+        if (process == NULL)
+            return false;
+        return WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+    #else
+        // Pd is detached from us (system() + &), so use the pid the scheduler reported
+        int pid = pdvstData->pdProcessId;
+        if (pid <= 0)
+            return true;  // not known yet
+        return !(kill(pid, 0) == -1 && errno == ESRCH);
+    #endif
+}
+
+// true once Pd is known to be gone (waits up to PDWAITMAX for it)
+bool pdvst3Processor::killPd()
+{
+    bool gone = false;
+
+    #ifdef _WIN32
+        if (res.process != NULL)
+        {
+            gone = killProcess(res.process);
+            CloseHandle(res.process);
+            res.process = NULL;
+        }
+    #else
+        if (pdvstData->pdProcessId > 0)
+            gone = killProcess(pdvstData->pdProcessId);
     #endif
+    return gone;
+}
+
+// a Pd that won't die may still hold the transfer mutex, or post it when
+// it lets go: the next Pd gets a new one. the old handle is left open,
+// the audio thread may be trying it right now
+void pdvst3Processor::renewTransferMutex()
+{
+    #ifdef _WIN32
+        static std::atomic<int> renewed(0);
+        sprintf(res.mutexName, "mutex%drenew%d", GetCurrentProcessId(), ++renewed);
+        res.mu_tex[PDVSTTRANSFERMUTEX] = CreateMutexA(NULL, 0, res.mutexName);
+    #else
+        // same name for the next Pd, the old Pd keeps the old semaphore
+        sem_unlink(res.shared->pdvstTransferMutexName);
+        res.mu_tex[PDVSTTRANSFERMUTEX] = sem_open(res.shared->pdvstTransferMutexName,
+                                                  O_CREAT, 0666, 1);
+    #endif
+    // the Windows name is on the command line
+    char extraFlags[MAXSTRLEN];
+    pdvstSchedulerFlags(&res, extraFlags);
+    pdvstMakeCommandLine(pdCommandLine, extraFlags, nChannelsIn, nChannelsOut, true);
+}
+
+// mark everything the host owns as updated so a fresh Pd gets it all again
+void pdvst3Processor::replayState()
+{
+    int i;
+    int locked = xxWaitForSingleObject(PDVSTTRANSFERMUTEX, PDWAITMAX);
+
+    // with the values the host sent while Pd was gone
+    for (i = 0; i < nParameters; i++)
+    {
+        PDVSTPARAMS(pdvstData)[i] = stateParams[i].load(std::memory_order_relaxed);
+        PDVSTSETDIRTY(pdvstData, i);
+    }
+    // segments the old Pd didn't take or send are gone with it
+    pdvstData->chunkIn.full = pdvstData->chunkOut.full = 0;
+    chunkLock.lock();
+    if (chunkSize > 0)
+    {
+        chunkToPd = true;
+        chunkSent = 0;
+    }
+    chunkLock.unlock();
+    if (pdvstData->plugName.value.stringData[0])
+    {
+        pdvstData->plugName.direction = PD_RECEIVE;
+        pdvstData->plugName.updated = 1;
+    }
+    // the host may have changed it while Pd was gone
+    if (curProgram >= 0)
+        program_name_to_pd(curProgram);
+    pdvstData->hostTimeInfo.updated = 1;
+    if (locked)
+        xxReleaseMutex(PDVSTTRANSFERMUTEX);
+}
+
+void pdvst3Processor::restartPd()
+{
+    pdRunning = false;
+    if (pdRestarts >= PDMAXRESTARTS)
+    {
+        if (pdRestarts++ == PDMAXRESTARTS)
+            logMessage(PDVSTLOGERROR, "Pd keeps failing, giving up after %d restarts", PDMAXRESTARTS);
+        return;
+    }
+    pdRestarts++;
+    logMessage(PDVSTLOGWARNING, "Pd is gone, restarting (%d)", pdRestarts);
+    // the last lines of the old Pd
+    drainLog();
+    if (sharedPd)
+    {
+        // the server may still be alive and writing, its ring goes on
+        setSyncToVst(0);
+        relaunchServer(pdGeneration);
+        return;
+    }
+    // a Pd that died in the middle of a line would block the ring, it is
+    // cleared once nothing can write to it any more
+    bool gone = killPd();
+    if (gone)
+    {
+        pdvstLogReset(&pdvstData->pdLog, globalLogLevel);
+        logDropped[1] = 0;
+    }
+    else
+        logMessage(PDVSTLOGWARNING, "Pd didn't exit when killed, its log ring is kept");
+    // released below only if it is ours: taken now, or left taken by a
+    // Pd that is gone
+    bool taken = takeFromDeadPd(res.mu_tex[PDVSTTRANSFERMUTEX]);
+    if (!taken && gone)
+        logMessage(PDVSTLOGWARNING, "Pd died holding the transfer mutex");
+    else if (!taken)
+    {
+        logMessage(PDVSTLOGWARNING, "Pd holds the transfer mutex, the next Pd gets a new one");
+        renewTransferMutex();
+        taken = takeFromDeadPd(res.mu_tex[PDVSTTRANSFERMUTEX]);
+    }
+    pdvstData->schedulerReady = 0;
+    pdvstData->heartbeat = 0;
+    pdvstData->pdProcessId = 0;
+    pdvstData->syncToVst = 0;
+    pdvstData->active = 1;
+    pdvstData->openPatch = 0;  // the new Pd opens the patch itself
+    if (taken || gone)
+        xxReleaseMutex(PDVSTTRANSFERMUTEX);
+    xxResetEvent(PDPROCEVENT);
+    xxSetEvent(VSTPROCEVENT);
+    launchPd();
+}
+
+void pdvst3Processor::supervise()
+{
+    bool starting = true;
+    int lastBeat = 0, stalledMs = 0, startingMs = 0, healthyMs = 0;
+
+    while (supervisorRun)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(PDSUPERVISORMS));
+        drainLog();
+        drainTrace();
+        if (starting)
+        {
+            if (pdvstData->schedulerReady)
+            {
+                if (pdRestarts)
+                    replayState();
+                if (sharedPd)
+                    pdGeneration = pdServer.generation;
+                starting = false;
+                lastBeat = pdvstData->heartbeat;
+                stalledMs = healthyMs = 0;
+                pdRunning = true;
+                debugLog("Pd ready");
+            }
+            else if ((startingMs += PDSUPERVISORMS) >= PDSTARTUPTIMEOUT)
+            {
+                restartPd();
+                startingMs = 0;
+            }
+            continue;
+        }
+        if (pdvstData->heartbeat != lastBeat)
+        {
+            lastBeat = pdvstData->heartbeat;
+            stalledMs = 0;
+            // the audio thread gives up on short stalls, Pd is fine again
+            pdRunning = true;
+            if ((healthyMs += PDSUPERVISORMS) >= PDHEALTHYRESET)
+                pdRestarts = 0;
+        }
+        else
+        {
+            stalledMs += PDSUPERVISORMS;
+            healthyMs = 0;
+        }
+        if (!pdProcessAlive() || stalledMs >= PDHEARTBEATTIMEOUT)
+        {
+            restartPd();
+            starting = true;
+            startingMs = 0;
+        }
+    }
+}
+
+// grow a chunk buffer to hold size bytes and a terminating 0
+static bool chunkReserve(char **buffer, int *capacity, int size)
+{
+    char *grown;
+
+    if (size < *capacity)
+        return true;
+    grown = (char *)realloc(*buffer, size + 1);
+    if (!grown)
+        return false;
+    *buffer = grown;
+    *capacity = size + 1;
+    return true;
+}
+
+// the next segment of the chunk to Pd, once Pd took the last one.
+// true while there is more to send
+bool pdvst3Processor::chunk_to_pd()
+{
+    pdvstChunkStream *stream = &pdvstData->chunkIn;
+    int size;
+
+    std::lock_guard<std::mutex> lock(chunkLock);
+    if (!chunkToPd || stream->full)
+        return chunkToPd;
+    size = chunkSize - chunkSent;
+    if (size > CHUNKSEGMENTSIZE)
+        size = CHUNKSEGMENTSIZE;
+    memcpy(stream->data, chunk + chunkSent, size);
+    stream->total = chunkSize;
+    stream->offset = chunkSent;
+    stream->size = size;
+    PDVST_BARRIER();
+    stream->full = 1;
+    chunkSent += size;
+    if (chunkSent >= chunkSize)
+        chunkToPd = false;
+    return true;
+}
+
+// a segment of svstdata from Pd. the chunk replaces ours once complete
+bool pdvst3Processor::chunk_from_pd()
+{
+    pdvstChunkStream *stream = &pdvstData->chunkOut;
+    int total;
+
+    if (!stream->full)
+        return false;
+    PDVST_BARRIER();
+    total = stream->total;
+    if (stream->offset == 0)
+        chunkFromPdSize = 0;
+    if (stream->offset == chunkFromPdSize && total <= MAXCHUNKSIZE &&
+        stream->size >= 0 && stream->offset + stream->size <= total &&
+        chunkReserve(&chunkFromPd, &chunkFromPdCapacity, total))
+    {
+        memcpy(chunkFromPd + stream->offset, stream->data, stream->size);
+        chunkFromPdSize += stream->size;
+        if (chunkFromPdSize == total)
+        {
+            std::lock_guard<std::mutex> lock(chunkLock);
+            char *received = chunkFromPd;
+            int capacity = chunkFromPdCapacity;
+
+            chunkFromPd = chunk;
+            chunkFromPdCapacity = chunkCapacity;
+            chunk = received;
+            chunkCapacity = capacity;
+            chunkSize = total;
+            chunkToPd = false;
+            chunkFromPdSize = 0;
+            chunkAnswered = stream->request;
+        }
+    }
+    PDVST_BARRIER();
+    stream->full = 0;
+    return true;
+}
+
+// moves the state chunk between the host and Pd, polling faster while
+// a transfer is going on. with [vstarray] it also asks Pd for a fresh
+// snapshot of the arrays every PDARRAYSNAPSHOTMS, getState never waits
+// for one
+void pdvst3Processor::transferChunks()
+{
+    auto lastRequest = std::chrono::steady_clock::now();
+
+    while (chunkRun)
+    {
+        bool busy = false;
+
+        if (pdRunning)
+        {
+            auto now = std::chrono::steady_clock::now();
+
+            // one request at a time, Pd answers the last one it sees
+            if (pdvstData->chunkOnRequest && chunkAnswered - chunkRequests >= 0 &&
+                (arraysWanted || now - lastRequest >=
+                 std::chrono::milliseconds(PDARRAYSNAPSHOTMS)))
+            {
+                arraysWanted = false;
+                lastRequest = now;
+                pdvstData->chunkRequest = ++chunkRequests;
+            }
+            busy = chunk_to_pd();
+            busy = chunk_from_pd() || busy;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(busy ? PDCHUNKMS : PDCHUNKIDLEMS));
+    }
 }
 
 void pdvst3Processor::setSyncToVst(int value)
 {
-    xxWaitForSingleObject(PDVSTTRANSFERMUTEX, 10);
+    int locked = xxWaitForSingleObject(PDVSTTRANSFERMUTEX, 10);
+
     if (pdvstData->syncToVst != value)
     {
         pdvstData->syncToVst = value;
     }
-    xxReleaseMutex(PDVSTTRANSFERMUTEX);
+    if (locked)
+        xxReleaseMutex(PDVSTTRANSFERMUTEX);
 }
 
 
@@ -325,6 +1221,10 @@ void pdvst3Processor::resume()
     int i;
     setSyncToVst(1);
     xxSetEvent(VSTPROCEVENT);
+    while (sharedPd && audioBuffer->size < sharedLatency + MAXVSTBUFSIZE)
+    {
+        audioBuffer->resize(audioBuffer->size * 2);
+    }
     for (i = 0; i < audioBuffer->nChannelsIn; i++)
     {
         memset(audioBuffer->in[i], 0, audioBuffer->size * sizeof(float));
@@ -334,13 +1234,56 @@ void pdvst3Processor::resume()
         memset(audioBuffer->out[i], 0, audioBuffer->size * sizeof(float));
     }
     audioBuffer->inFrameCount = audioBuffer->outFrameCount = 0;
+    if (sharedPd)
+    {
+        // drop what Pd made while we were off and start one buffer late
+        pdvstData->outTail = pdvstData->outHead;
+        audioBuffer->outFrameCount = sharedLatency;
+    }
     dspActive = true;
 }
 
 void pdvst3Processor::pdvst()
 {
-     // set debug output
-    debugFile = fopen("pdvstdebug.txt", "wt");
+    // log file: <LOGDIR>/pdvst3-<plugin>-<pid>-<n>.log, created with the
+    // first line. nothing is written while the host only scans plugins.
+    // the trace (TRACE = TRUE) goes next to it in a .trace file
+    static std::atomic<int> logInstances(0);
+    char logDir[MAXFILENAMELEN];
+    debugFile = NULL;
+    traceFile = NULL;
+    traceDropped[0] = traceDropped[1] = 0;
+    hostLog = new pdvstLogRing;
+    pdvstLogReset(hostLog, globalLogLevel);
+    logDropped[0] = logDropped[1] = 0;
+    memset(&midiInFull, 0, sizeof(pdvstLogLimit));
+    memset(&noteInFull, 0, sizeof(pdvstLogLimit));
+    memset(&sysexInFull, 0, sizeof(pdvstLogLimit));
+    memset(&paramQueueFull, 0, sizeof(pdvstLogLimit));
+    memset(&pdTimeout, 0, sizeof(pdvstLogLimit));
+    if (globalLogDir[0])
+        strcpy(logDir, globalLogDir);
+    else
+    {
+    #if _WIN32
+        GetTempPathA(MAXFILENAMELEN, logDir);
+    #else
+        strcpy(logDir, getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+    #endif
+    }
+    if (strlen(logDir) > 0 && (logDir[strlen(logDir) - 1] == '/' || logDir[strlen(logDir) - 1] == '\\'))
+        logDir[strlen(logDir) - 1] = 0;
+    snprintf(logPath, MAXFILENAMELEN - 8, "%s/pdvst3-%s-%d-%d", logDir, globalPluginName,
+    #if _WIN32
+             (int)GetCurrentProcessId(),
+    #else
+             (int)getpid(),
+    #endif
+             ++logInstances);
+    sprintf(tracePath, "%s.trace", logPath);
+    strcat(logPath, ".log");
+    if (globalLogLevel == PDVSTLOGNONE)
+        logPath[0] = 0;
 
     // copy global data
     isASynth = globalIsASynth;
@@ -348,6 +1291,7 @@ void pdvst3Processor::pdvst()
     nChannelsIn = (globalNChannelsIn > MAXCHANNELS) ? MAXCHANNELS : globalNChannelsIn;
     nChannelsOut = (globalNChannelsOut > MAXCHANNELS) ? MAXCHANNELS : globalNChannelsOut;
     nPrograms = globalNPrograms;
+    curProgram = -1;
     nParameters = globalNParams;
     nExternalLibs = globalNExternalLibs;
     debugLog("name: %s", globalPluginName);
@@ -355,10 +1299,9 @@ void pdvst3Processor::pdvst()
 
     int i, j;
     // initialize memory
-    vstParamName = new char*[MAXPARAMETERS];
-    for (i = 0; i < MAXPARAMETERS; i++)
+    vstParamName = new char*[nParameters];
+    for (i = 0; i < nParameters; i++)
         vstParamName[i] = new char[MAXSTRLEN];
-    memset(vstParam, 0, MAXPARAMETERS * sizeof(float));
     program = new pdvstProgram[MAXPROGRAMS];
 
     for (i = 0; i < nExternalLibs; i++)
@@ -380,120 +1323,494 @@ void pdvst3Processor::pdvst()
     debugLog("in channels: %d", nChannelsIn);
     debugLog("out channels: %d", nChannelsOut);
     audioBuffer = new pdVstBuffer(nChannelsIn, nChannelsOut);
-    for (i = 0; i < MAXPARAMETERS; i++)
+    for (i = 0; i < nParameters; i++)
     {
-        strcpy(vstParamName[i], globalVstParamName[i]);
+        strcpy(vstParamName[i], globalVstParamName[i] ? globalVstParamName[i] : "<unnamed>");
     }
     debugLog("path: %s", globalPluginPath);
     debugLog("nParameters = %d", nParameters);
     for (i = 0; i < nPrograms; i++)
     {
         strcpy(program[i].name, globalProgram[i].name);
+        program[i].paramValue = new float[nParameters];
         for (j = 0; j < nParameters; j++)
         {
-            program[i].paramValue[j] = globalProgram[i].paramValue[j];
+            program[i].paramValue[j] = globalProgram[i].paramValue ?
+                                       globalProgram[i].paramValue[j] : 0.f;
+        }
+    }
+    pdRunning = false;
+    pdStarted = false;
+    pdTimeouts = 0;
+    pdRestarts = 0;
+    sharedPd = globalSharedPd;
+    pdSlot = -1;
+    pdGeneration = 0;
+    sharedLatency = DEFPDVSTBUFFERSIZE;
+    reportedLatency = (uint32)globalLatency;
+    sampleTime = bufferTime = 0;
+    paramState = new pdvstParamState[nParameters];
+    heldList = new int[nParameters];
+    nHeld = 0;
+    sysexBuffer = new unsigned char[MAXSYSEXBYTES];
+    stateParams = new std::atomic<float>[nParameters];
+    stagedParams = new float[nParameters];
+    for (i = 0; i < nParameters; i++)
+        stateParams[i] = 0.f;
+    stateStage = STAGE_FREE;
+    chunk = chunkFromPd = NULL;
+    chunkSize = chunkCapacity = chunkSent = 0;
+    chunkFromPdSize = chunkFromPdCapacity = 0;
+    chunkToPd = false;
+    chunkRun = false;
+    chunkAnswered = chunkRequests = 0;
+    arraysWanted = false;
+    for (i = 0; i < nParameters; i++)
+    {
+        paramState[i].threshold = (globalParamThresholds[i] >= 0) ?
+                                  globalParamThresholds[i] : globalParamThreshold;
+        paramState[i].rate = (globalParamRates[i] >= 0) ?
+                             globalParamRates[i] : globalParamRate;
+        paramState[i].sent = -1;  // out of range: the first value always goes
+        paramState[i].held = 0;
+        paramState[i].isHeld = false;
+        paramState[i].inHeldList = false;
+        paramState[i].endPending = false;
+        paramState[i].pointBuffer = -1;
+        paramState[i].sentTime = paramState[i].lastTime = 0;
+    }
+    // Pd is started on the first activation (see activatePd()), until
+    // then the host's parameters and state are kept here
+    res.data = NULL;
+    pdvstData = (pdvstTransferData *)calloc(1, PDVSTMAPSIZE(nParameters, 0, 0));
+    pdvstData->nParameters = nParameters;
+    pdvstInitTransfer(pdvstData, nChannelsIn, nChannelsOut, true);
+    referenceCount++;
+
+}
+
+void pdvst3Processor::pdvstquit()
+{
+    int i;
+    referenceCount--;
+    if (pdStarted)
+    {
+        supervisorRun = false;
+        if (supervisor.joinable())
+            supervisor.join();
+        chunkRun = false;
+        if (chunkThread.joinable())
+            chunkThread.join();
+        drainLog();
+        drainTrace();
+        xxWaitForSingleObject(PDVSTTRANSFERMUTEX, -1);
+        pdvstData->active = 0;
+        xxReleaseMutex(PDVSTTRANSFERMUTEX);
+        if (sharedPd)
+            detachServer();
+        clean_resources();
+    }
+    else
+    {
+        drainLog();
+        free(pdvstData);
+    }
+    for (i = 0; i < nParameters; i++)
+        delete[] vstParamName[i];
+    delete[] vstParamName;
+    for (i = 0; i < nPrograms; i++)
+        delete[] program[i].paramValue;
+    delete[] program;
+    delete[] paramState;
+    delete[] heldList;
+    delete[] sysexBuffer;
+    delete[] stateParams;
+    delete[] stagedParams;
+    free(chunk);
+    free(chunkFromPd);
+    delete audioBuffer;
+    if (debugFile)
+    {
+        fclose(debugFile);
+    }
+    if (traceFile)
+        fclose(traceFile);
+    delete hostLog;
+}
+
+void pdvst3Processor::playhead_to_pd(Vst::ProcessData& data)
+{
+    if (data.processContext)
+    {
+        Vst::ProcessContext *context = data.processContext;
+        pdvstTimeInfo *timeInfo = &pdvstData->hostTimeInfo;
+
+        timeInfo->updated=1;
+        timeInfo->state = context->state;
+        timeInfo->sampleRate = context->sampleRate;
+        timeInfo->projectTimeSamples = context->projectTimeSamples;
+        timeInfo->systemTime = context->systemTime;
+        timeInfo->continousTimeSamples = context->continousTimeSamples;
+        timeInfo->projectTimeMusic = context->projectTimeMusic;
+        timeInfo->barPositionMusic = context->barPositionMusic;
+        timeInfo->cycleStartMusic = context->cycleStartMusic;
+        timeInfo->cycleEndMusic = context->cycleEndMusic;
+        timeInfo->tempo = context->tempo;
+        timeInfo->timeSigNumerator = context->timeSigNumerator;
+        timeInfo->timeSigDenominator = context->timeSigDenominator;
+        timeInfo->chordKeyNote = context->chord.keyNote;
+        timeInfo->chordRootNote = context->chord.rootNote;
+        timeInfo->chordMask = context->chord.chordMask;
+        timeInfo->smpteOffsetSubframes = context->smpteOffsetSubframes;
+        timeInfo->frameRate = context->frameRate.framesPerSecond;
+        timeInfo->frameRateFlags = context->frameRate.flags;
+        timeInfo->samplesToNextClock = context->samplesToNextClock;
+        timeInfo->time = bufferTime;
+    }
+}
+
+// the values of the last setState, if the audio thread hasn't got them
+// yet. call with the transfer mutex
+void pdvst3Processor::applyStagedState()
+{
+    int ready = STAGE_READY;
+
+    if (!stateStage.compare_exchange_strong(ready, STAGE_APPLYING))
+        return;
+    for (int i = 0; i < nParameters; i++)
+    {
+        PDVSTPARAMS(pdvstData)[i] = stagedParams[i];
+        PDVSTSETDIRTY(pdvstData, i);
+        paramState[i].sent = stagedParams[i];
+        paramState[i].isHeld = false;
+        paramState[i].endPending = false;
+    }
+    stateStage = STAGE_FREE;
+}
+
+// a program of config.txt: all its values go to the parameter table at
+// once and Pd gets the ones that change on the same tick, like a state
+void pdvst3Processor::program_to_pd(int index)
+{
+    float *values = program[index].paramValue;
+
+    for (int i = 0; i < nParameters; i++)
+    {
+        pdvstParamState *ps = &paramState[i];
+
+        stateParams[i].store(values[i], std::memory_order_relaxed);
+        ps->isHeld = false;
+        ps->endPending = false;
+        if (values[i] == PDVSTPARAMS(pdvstData)[i] && values[i] == ps->sent)
+            continue;
+        PDVSTPARAMS(pdvstData)[i] = values[i];
+        PDVSTSETDIRTY(pdvstData, i);
+        ps->sent = values[i];
+    }
+    curProgram = index;
+    program_name_to_pd(index);
+}
+
+// rvstprognumber and rvstprogname of program index
+void pdvst3Processor::program_name_to_pd(int index)
+{
+    pdvstData->prognumber2pd.type = FLOAT_TYPE;
+    pdvstData->prognumber2pd.value.floatData = (float)index;
+    pdvstData->prognumber2pd.direction = PD_RECEIVE;
+    pdvstData->prognumber2pd.updated = 1;
+    pdvstData->progname2pd.type = STRING_TYPE;
+    strncpy(pdvstData->progname2pd.value.stringData, program[index].name, MAXSTRINGSIZE - 1);
+    pdvstData->progname2pd.value.stringData[MAXSTRINGSIZE - 1] = 0;
+    pdvstData->progname2pd.direction = PD_RECEIVE;
+    pdvstData->progname2pd.updated = 1;
+}
+
+void pdvst3Processor::params_to_pd(Vst::ProcessData& data)
+{
+    applyStagedState();
+
+    //--- Read inputs parameter changes-----------
+
+    if (data.inputParameterChanges)
+    {
+        int32 numParamsChanged = data.inputParameterChanges->getParameterCount ();
+        for (int32 index = 0; index < numParamsChanged; index++)
+        {
+            Vst::IParamValueQueue* paramQueue =
+                data.inputParameterChanges->getParameterData (index);
+            if (paramQueue)
+            {
+                Vst::ParamValue value;
+                int32 sampleOffset;
+                int32 numPoints = paramQueue->getPointCount ();
+                int32 i = paramQueue->getParameterId () - kParamId;
+                if (paramQueue->getParameterId () == kProgramId)
+                {
+                    // like StringListParameter::toPlain()
+                    if (numPoints > 0 && nPrograms > 0 &&
+                        paramQueue->getPoint (numPoints - 1, sampleOffset, value) == kResultTrue)
+                        program_to_pd((int)(value * nPrograms) < nPrograms ?
+                                      (int)(value * nPrograms) : nPrograms - 1);
+                    continue;
+                }
+                if (paramQueue->getParameterId () >= kMidiMapId ||
+                    (paramQueue->getParameterId () >= kMidiProgramId &&
+                     paramQueue->getParameterId () < kMidiProgramId + 16))
+                {
+                    midi_map_to_pd(paramQueue);
+                    continue;
+                }
+                if (i < 0 || i >= nParameters)
+                    continue;
+                pdvstParamState *ps = &paramState[i];
+                // Pd delivers the points on the tick they fall in, minus the
+                // ones that don't change anything or come too fast
+                for (int32 p = 0; p < numPoints; p++)
+                {
+                    if (paramQueue->getPoint (p, sampleOffset, value) != kResultTrue)
+                        continue;
+                    float v = (float)value;
+                    int64_t time = bufferTime + sampleOffset;
+                    PDVSTPARAMS(pdvstData)[i] = v;
+                    stateParams[i].store(v, std::memory_order_relaxed);
+                    ps->pointBuffer = bufferTime;
+                    if (v == ps->sent)
+                    {
+                        // flat: the ramp to the next point starts here
+                        ps->isHeld = false;
+                        ps->endPending = false;
+                        ps->lastTime = time;
+                    }
+                    else if (ps->endPending && v == ps->endValue)
+                    {
+                        // flat below threshold: the gesture stopped there
+                        ps->endPending = false;
+                        param_change_to_pd(i, v, time);
+                    }
+                    else if (fabsf(v - ps->sent) < ps->threshold)
+                    {
+                        // sent only if the gesture ends here, see below
+                        ps->endPending = true;
+                        ps->endValue = v;
+                        if (!ps->inHeldList)
+                        {
+                            ps->inHeldList = true;
+                            heldList[nHeld++] = i;
+                        }
+                    }
+                    else
+                        param_change_to_pd(i, v, time);
+                }
+            }
+        }
+    }
+    // held values go once their parameter's rate allows it. a gesture
+    // that stopped short of the threshold (no points in a later buffer)
+    // still ends where the host left it
+    int n = 0;
+    for (int k = 0; k < nHeld; k++)
+    {
+        int i = heldList[k];
+        pdvstParamState *ps = &paramState[i];
+        if (ps->endPending && ps->pointBuffer != bufferTime)
+        {
+            ps->endPending = false;
+            ps->held = ps->endValue;
+            ps->isHeld = true;
+        }
+        int64_t due = ps->sentTime + (ps->rate > 0 ? (int64_t)ceil(GsampleRate / ps->rate) : 0);
+        if (due < bufferTime)
+            due = bufferTime;
+        if ((ps->isHeld && due >= bufferTime + data.numSamples) || ps->endPending)
+        {
+            heldList[n++] = i;
+            continue;
         }
+        ps->inHeldList = false;
+        if (ps->isHeld)
+            param_point_to_pd(i, ps->held, due);
     }
-    debugLog("startingPd...");
-    startPd();
-    debugLog("done");
-    referenceCount++;
-
+    nHeld = n;
 }
 
-void pdvst3Processor::pdvstquit()
+// a new value of parameter i at time: to Pd now, or held until its
+// PARAMRATE allows another one
+void pdvst3Processor::param_change_to_pd(int i, float value, int64_t time)
 {
-    int i;
-    referenceCount--;
-    xxWaitForSingleObject(PDVSTTRANSFERMUTEX, -1);
-    pdvstData->active = 0;
-    xxReleaseMutex(PDVSTTRANSFERMUTEX);
-    clean_resources();
-    for (i = 0; i < MAXPARAMETERS; i++)
-        delete vstParamName[i];
-    delete vstParamName;
-    delete program;
-    delete audioBuffer;
-    if (debugFile)
+    pdvstParamState *ps = &paramState[i];
+
+    if (ps->rate > 0 && (time - ps->sentTime) * ps->rate < GsampleRate)
     {
-        fclose(debugFile);
+        ps->held = value;
+        ps->isHeld = true;
+        // isHeld is cleared elsewhere, the list keeps one entry at most
+        if (!ps->inHeldList)
+        {
+            ps->inHeldList = true;
+            heldList[nHeld++] = i;
+        }
     }
+    else
+        param_point_to_pd(i, value, time);
 }
 
-void pdvst3Processor::playhead_to_pd(Vst::ProcessData& data)
+// process() without the transfer mutex: only the latest value of each
+// parameter, for getState and the next Pd
+void pdvst3Processor::params_to_state(Vst::ProcessData& data)
 {
-    if (data.processContext)
+    Vst::ParamValue value;
+    int32 sampleOffset;
+
+    if (!data.inputParameterChanges)
+        return;
+    for (int32 index = 0; index < data.inputParameterChanges->getParameterCount (); index++)
     {
-        pdvstData->hostTimeInfo.updated=1;
-        pdvstData->hostTimeInfo.state = data.processContext->state;
-        pdvstData->hostTimeInfo.tempo = data.processContext->tempo;
-        pdvstData->hostTimeInfo.projectTimeMusic = data.processContext->projectTimeMusic;
-        pdvstData->hostTimeInfo.barPositionMusic = data.processContext->barPositionMusic;
-        pdvstData->hostTimeInfo.timeSigNumerator = data.processContext->timeSigNumerator;
-        pdvstData->hostTimeInfo.timeSigDenominator = data.processContext->timeSigDenominator;
+        Vst::IParamValueQueue* paramQueue = data.inputParameterChanges->getParameterData (index);
+        if (!paramQueue || paramQueue->getPointCount () <= 0)
+            continue;
+        int32 i = paramQueue->getParameterId () - kParamId;
+        if (paramQueue->getParameterId () == kProgramId)
+        {
+            // as program_to_pd() does, replayState() gives it to the new Pd
+            if (nPrograms > 0 &&
+                paramQueue->getPoint (paramQueue->getPointCount () - 1, sampleOffset, value) == kResultTrue)
+            {
+                int n = (int)(value * nPrograms) < nPrograms ? (int)(value * nPrograms) : nPrograms - 1;
+                for (int k = 0; k < nParameters; k++)
+                    stateParams[k].store(program[n].paramValue[k], std::memory_order_relaxed);
+                curProgram = n;
+            }
+            continue;
+        }
+        if (i < 0 || i >= nParameters || paramQueue->getParameterId () >= kMidiMapId)
+            continue;
+        if (paramQueue->getPoint (paramQueue->getPointCount () - 1, sampleOffset, value) == kResultTrue)
+            stateParams[i].store((float)value, std::memory_order_relaxed);
     }
 }
 
-void pdvst3Processor::params_to_pd(Vst::ProcessData& data)
+// the host's MIDI controllers come as the parameters of the controller's
+// IMidiMapping, and program changes as its kIsProgramChange parameters.
+// they go to Pd as MIDI again at the same offsets
+void pdvst3Processor::midi_map_to_pd(Vst::IParamValueQueue* paramQueue)
 {
-    //--- Read inputs parameter changes-----------
-
-    if (data.inputParameterChanges)
+    bool program = paramQueue->getParameterId () < kMidiMapId;
+    int n = paramQueue->getParameterId () - (program ? kMidiProgramId : kMidiMapId);
+    int channel = program ? n : n / Vst::kCountCtrlNumber;
+    int controller = n % Vst::kCountCtrlNumber;
+    Vst::ParamValue value;
+    int32 sampleOffset;
+
+    if (!pdRunning || channel >= 16)
+        return;
+    for (int32 p = 0; p < paramQueue->getPointCount (); p++)
     {
-        int32 numParamsChanged = data.inputParameterChanges->getParameterCount ();
-        for (int32 index = 0; index < numParamsChanged; index++)
+        if (pdvstData->midiQueueSize >= MAXMIDIQUEUESIZE)
         {
-            Vst::IParamValueQueue* paramQueue =
-                data.inputParameterChanges->getParameterData (index);
-            if (paramQueue)
-            {
-                Vst::ParamValue value;
-                int32 sampleOffset;
-                int32 numPoints = paramQueue->getPointCount ();
-                int32 i = paramQueue->getParameterId ();
-                if (paramQueue->getPoint (numPoints - 1, sampleOffset, value) ==
-                            kResultTrue)
-                {
-                    pdvstData->vstParameters[i - kParamId].type = FLOAT_TYPE;
-                    pdvstData->vstParameters[i - kParamId].value.floatData = (float)value;
-                    pdvstData->vstParameters[i - kParamId].direction = PD_RECEIVE;
-                    pdvstData->vstParameters[i - kParamId].updated = 1;
-                }
-            }
+            pdvstLogRated(hostLog, &midiInFull, PDVSTLOGWARNING,
+                          "MIDI to Pd dropped, queue full");
+            break;
+        }
+        if (paramQueue->getPoint (p, sampleOffset, value) != kResultTrue)
+            continue;
+        pdvstMidiMessage *m = &pdvstData->midiQueue[pdvstData->midiQueueSize];
+        m->channelNumber = channel;
+        m->time = bufferTime + sampleOffset;
+        if (program)
+        {
+            m->messageType = PROGRAM_CHANGE;
+            m->dataByte1 = (int)(value * 127. + .5);
+        }
+        else if (controller == Vst::kPitchBend)
+        {
+            int bend = (int)(value * 16383. + .5);
+            m->messageType = PITCH_BEND;
+            m->dataByte1 = bend & 0x7F;
+            m->dataByte2 = (bend >> 7) & 0x7F;
+        }
+        else if (controller == Vst::kAfterTouch)
+        {
+            m->messageType = CHANNEL_PRESSURE;
+            m->dataByte1 = (int)(value * 127. + .5);
+        }
+        else
+        {
+            m->messageType = CONTROLLER_CHANGE;
+            m->dataByte1 = controller;
+            m->dataByte2 = (int)(value * 127. + .5);
         }
+        pdvstData->midiQueueSize++;
+        pdvstData->midiQueueUpdated = 1;
     }
+}
+
+// one value of parameter i for Pd: a point on the tick it falls in, or just
+// the new value while Pd can't take points
+void pdvst3Processor::param_point_to_pd(int i, float value, int64_t time)
+{
+    pdvstParamState *ps = &paramState[i];
+    int n = pdvstData->paramQueueSize;
 
+    if (pdRunning && n < MAXPARAMQUEUESIZE)
+    {
+        pdvstParamPoint *point = &pdvstData->paramQueue[n];
+        point->index = i;
+        point->value = value;
+        point->time = time;
+        point->start = ps->lastTime;
+        pdvstData->paramQueueSize = n + 1;
+        pdvstData->paramQueueUpdated = 1;
+    }
+    else
+    {
+        if (pdRunning)
+            pdvstLogRated(hostLog, &paramQueueFull, PDVSTLOGINFO,
+                          "parameters to Pd: queue full, sent without ramps");
+        PDVSTSETDIRTY(pdvstData, i);
+    }
+    ps->sent = value;
+    ps->sentTime = ps->lastTime = time;
+    ps->isHeld = false;
+    ps->endPending = false;
 }
 
+// Pd stamps each change with the blockTime of the tick that sent it, so
+// the host gets it at the sample where the input of that tick started.
+// changes from ticks of an earlier buffer go at offset 0
 void pdvst3Processor::params_from_pd(Vst::ProcessData& data)
 {
-    if (data.outputParameterChanges)
+    int tail = pdvstData->paramOutTail;
+
+    while (tail != pdvstData->paramOutHead)
     {
-        int32 index = 0;
+        PDVST_BARRIER();
+        pdvstParamPoint *p = &pdvstData->paramOut[tail];
+        if (p->index >= 0 && p->index < nParameters)
+            stateParams[p->index].store(p->value, std::memory_order_relaxed);
+        if (data.outputParameterChanges && p->index >= 0 && p->index < pdvstData->nParameters)
         {
-            for (int i = 0; i < pdvstData->nParameters; i++)
+            int32 index = 0;
+            int64_t offset = p->time - bufferTime;
+            if (offset >= data.numSamples)
+                offset = data.numSamples - 1;
+            if (offset < 0)
+                offset = 0;
+            Vst::IParamValueQueue* paramQueue2 = \
+                data.outputParameterChanges->addParameterData (kParamId + p->index, index);
+            if (paramQueue2)
             {
-                if (pdvstData->vstParameters[i].direction == PD_SEND && \
-                    pdvstData->vstParameters[i].updated)
-                {
-                    if (pdvstData->vstParameters[i].type == FLOAT_TYPE)
-                    {
-                        Vst::IParamValueQueue* paramQueue2 = \
-                            data.outputParameterChanges->addParameterData (kParamId + i, index);
-                        if (paramQueue2)
-                        {
-                            int32 index2 = 0;
-                            paramQueue2->addPoint (0, \
-                                (Vst::ParamValue)pdvstData->vstParameters[i].value.floatData, index2);
-                        }
-                    }
-                    pdvstData->vstParameters[i].updated = 0;
-                }
+                int32 index2 = 0;
+                paramQueue2->addPoint ((int32)offset, (Vst::ParamValue)p->value, index2);
             }
         }
+        tail = (tail + 1) % MAXPARAMQUEUESIZE;
     }
+    PDVST_BARRIER();
+    pdvstData->paramOutTail = tail;
 }
 
+// like the parameters (see params_from_pd), events are placed at the time
+// Pd sent them within the tick, relative to the input of that tick
 void pdvst3Processor::midi_from_pd(Vst::ProcessData& data)
 {
     if (pdvstData->midiOutQueueUpdated)
@@ -507,12 +1824,17 @@ void pdvst3Processor::midi_from_pd(Vst::ProcessData& data)
                 long channel =  pdvstData->midiOutQueue[i].statusByte & 0x0F;
                 char b1 = pdvstData->midiOutQueue[i].dataByte1;
                 char b2 = pdvstData->midiOutQueue[i].dataByte2;
+                int64_t offset = pdvstData->midiOutQueue[i].time - bufferTime;
 
+                if (offset >= data.numSamples)
+                    offset = data.numSamples - 1;
+                if (offset < 0)
+                    offset = 0;
                 // Add event to output
                 Vst::Event midiEvent = { 0 };
                 midiEvent.busIndex = 0;
-                midiEvent.sampleOffset = 0;
-                midiEvent.ppqPosition = i;
+                midiEvent.sampleOffset = (int32)offset;
+                midiEvent.ppqPosition = 0;
                 midiEvent.flags = 0;
 
                 if (status == 0x80) // note off
@@ -555,12 +1877,170 @@ void pdvst3Processor::midi_from_pd(Vst::ProcessData& data)
                     outlist->addEvent(midiEvent);
 
                 }
+                else if (status == 0xC0) // program change
+                {
+                    midiEvent.type = Vst::Event::kLegacyMIDICCOutEvent;
+                    midiEvent.midiCCOut.channel = channel;
+                    midiEvent.midiCCOut.value = b1;
+                    midiEvent.midiCCOut.value2 = 0;
+                    midiEvent.midiCCOut.controlNumber = Vst::kCtrlProgramChange;
+                    outlist->addEvent(midiEvent);
+                }
+                else if (status == 0xD0) // channel pressure
+                {
+                    midiEvent.type = Vst::Event::kLegacyMIDICCOutEvent;
+                    midiEvent.midiCCOut.channel = channel;
+                    midiEvent.midiCCOut.value = b1;
+                    midiEvent.midiCCOut.value2 = 0;
+                    midiEvent.midiCCOut.controlNumber = Vst::kAfterTouch;
+                    outlist->addEvent(midiEvent);
+                }
+                else if (status == 0xE0) // pitch bend
+                {
+                    midiEvent.type = Vst::Event::kLegacyMIDICCOutEvent;
+                    midiEvent.midiCCOut.channel = channel;
+                    midiEvent.midiCCOut.value = b1;
+                    midiEvent.midiCCOut.value2 = b2;
+                    midiEvent.midiCCOut.controlNumber = Vst::kPitchBend;
+                    outlist->addEvent(midiEvent);
+                }
 
             }
-            pdvstData->midiOutQueueUpdated=0;
-            pdvstData->midiOutQueueSize=0;
         }
+        pdvstData->midiOutQueueUpdated=0;
+        pdvstData->midiOutQueueSize=0;
+    }
+    sysex_from_pd(data);
+}
+
+// the messages are copied out of the arena so that Pd can reuse it while
+// the host still reads them. what doesn't fit goes in the next call
+void pdvst3Processor::sysex_from_pd(Vst::ProcessData& data)
+{
+    pdvstSysexRing *r = &pdvstData->sysexOut;
+    Vst::IEventList* outlist = data.outputEvents;
+    uint32_t tail = r->tail;
+    int used = 0;
+
+    while (tail != r->head)
+    {
+        PDVST_BARRIER();
+        pdvstSysex *m = &r->msg[tail % MAXSYSEXQUEUESIZE];
+        if (outlist)
+        {
+            if (used + m->size > MAXSYSEXBYTES)
+                break;
+            int64_t offset = m->time - bufferTime;
+            if (offset >= data.numSamples)
+                offset = data.numSamples - 1;
+            if (offset < 0)
+                offset = 0;
+            memcpy(sysexBuffer + used, r->bytes + m->start % MAXSYSEXBYTES, m->size);
+            Vst::Event sysexEvent = { 0 };
+            sysexEvent.busIndex = 0;
+            sysexEvent.sampleOffset = (int32)offset;
+            sysexEvent.type = Vst::Event::kDataEvent;
+            sysexEvent.data.type = Vst::DataEvent::kMidiSysEx;
+            sysexEvent.data.size = m->size;
+            sysexEvent.data.bytes = sysexBuffer + used;
+            outlist->addEvent(sysexEvent);
+            used += m->size;
+        }
+        r->byteTail = m->start + m->size;
+        PDVST_BARRIER();
+        r->tail = ++tail;
+    }
+}
+
+// SysEx from the host goes in one piece to the arena, Pd feeds it to
+// sysexin byte by byte on its tick
+void pdvst3Processor::sysex_to_pd(Vst::Event& event)
+{
+    pdvstSysexRing *r = &pdvstData->sysexIn;
+    uint32_t head = r->head;
+    uint32_t at;
+    int size = event.data.size;
+
+    if (event.data.type != Vst::DataEvent::kMidiSysEx || size <= 0 || !event.data.bytes)
+        return;
+    // Pd is behind: drop it rather than wait
+    if (head - r->tail >= MAXSYSEXQUEUESIZE || !pdvstSysexFit(r, r->byteHead, size, &at))
+    {
+        pdvstLogRated(hostLog, &sysexInFull, PDVSTLOGWARNING,
+                      "SysEx to Pd dropped (%d bytes), Pd is behind", size);
+        return;
+    }
+    memcpy(r->bytes + at % MAXSYSEXBYTES, event.data.bytes, size);
+    r->msg[head % MAXSYSEXQUEUESIZE].start = at;
+    r->msg[head % MAXSYSEXQUEUESIZE].size = size;
+    r->msg[head % MAXSYSEXQUEUESIZE].time = bufferTime + event.sampleOffset;
+    r->byteHead = at + size;
+    PDVST_BARRIER();
+    r->head = head + 1;
+}
+
+// 0..1 to 0..127, rounded
+static char midi7bit(float value, int minimum)
+{
+    int v = (int)(value * 127.f + .5f);
+
+    return (char)((v < minimum) ? minimum : (v > 127) ? 127 : v);
+}
+
+// note events also go to [vstnote] as they are, with the note id,
+// tuning and float velocity that MIDI can't carry
+void pdvst3Processor::note_to_pd(Vst::Event& event)
+{
+    int n = pdvstData->noteQueueSize;
+    pdvstNoteEvent *e = &pdvstData->noteQueue[n];
+
+    if (n >= MAXMIDIQUEUESIZE)
+    {
+        pdvstLogRated(hostLog, &noteInFull, PDVSTLOGWARNING,
+                      "note events to Pd dropped, queue full");
+        return;
+    }
+    e->time = bufferTime + event.sampleOffset;
+    e->tuning = 0;
+    e->expression = 0;
+    switch (event.type)
+    {
+        case Vst::Event::kNoteOnEvent:
+            e->type = NOTEEVENT_ON;
+            e->channel = event.noteOn.channel;
+            e->pitch = event.noteOn.pitch;
+            e->noteId = event.noteOn.noteId;
+            e->tuning = event.noteOn.tuning;
+            e->value = event.noteOn.velocity;
+            break;
+        case Vst::Event::kNoteOffEvent:
+            e->type = NOTEEVENT_OFF;
+            e->channel = event.noteOff.channel;
+            e->pitch = event.noteOff.pitch;
+            e->noteId = event.noteOff.noteId;
+            e->tuning = event.noteOff.tuning;
+            e->value = event.noteOff.velocity;
+            break;
+        case Vst::Event::kPolyPressureEvent:
+            e->type = NOTEEVENT_PRESSURE;
+            e->channel = event.polyPressure.channel;
+            e->pitch = event.polyPressure.pitch;
+            e->noteId = event.polyPressure.noteId;
+            e->value = event.polyPressure.pressure;
+            break;
+        case Vst::Event::kNoteExpressionValueEvent:
+            e->type = NOTEEVENT_EXPRESSION;
+            e->channel = 0;
+            e->pitch = 0;
+            e->noteId = event.noteExpressionValue.noteId;
+            e->expression = (int)event.noteExpressionValue.typeId;
+            e->value = (float)event.noteExpressionValue.value;
+            break;
+        default:
+            return;
     }
+    pdvstData->noteQueueSize = n + 1;
+    pdvstData->noteQueueUpdated = 1;
 }
 
 void pdvst3Processor::midi_to_pd(Vst::ProcessData& data)
@@ -572,8 +2052,16 @@ void pdvst3Processor::midi_to_pd(Vst::ProcessData& data)
         for (int32 i = 0; i < numEvent; i++)
         {
             Vst::Event event {};
+            if (pdvstData->midiQueueSize >= MAXMIDIQUEUESIZE)
+            {
+                pdvstLogRated(hostLog, &midiInFull, PDVSTLOGWARNING,
+                              "MIDI to Pd dropped, queue full");
+                break;
+            }
             if (eventList->getEvent (i, event) == kResultOk)
             {
+                note_to_pd(event);
+                pdvstData->midiQueue[pdvstData->midiQueueSize].time = bufferTime + event.sampleOffset;
                 switch (event.type)
                 {
                     //--- -------------------
@@ -581,7 +2069,9 @@ void pdvst3Processor::midi_to_pd(Vst::ProcessData& data)
 
                         pdvstData->midiQueue[pdvstData->midiQueueSize].channelNumber = event.noteOn.channel;
                         pdvstData->midiQueue[pdvstData->midiQueueSize].dataByte1 = event.noteOn.pitch;
-                        pdvstData->midiQueue[pdvstData->midiQueueSize].dataByte2 = (char)127 * event.noteOn.velocity;
+                        // a soft note must not turn into a note off
+                        pdvstData->midiQueue[pdvstData->midiQueueSize].dataByte2 =
+                            (event.noteOn.velocity > 0) ? midi7bit(event.noteOn.velocity, 1) : 0;
                         pdvstData->midiQueue[pdvstData->midiQueueSize].messageType = NOTE_ON;
                         break;
 
@@ -589,7 +2079,7 @@ void pdvst3Processor::midi_to_pd(Vst::ProcessData& data)
                     case Vst::Event::kNoteOffEvent:
                         pdvstData->midiQueue[pdvstData->midiQueueSize].channelNumber = event.noteOff.channel;
                         pdvstData->midiQueue[pdvstData->midiQueueSize].dataByte1 = event.noteOff.pitch;
-                        pdvstData->midiQueue[pdvstData->midiQueueSize].dataByte2 = (char)127 * event.noteOff.velocity;
+                        pdvstData->midiQueue[pdvstData->midiQueueSize].dataByte2 = midi7bit(event.noteOff.velocity, 0);
                         pdvstData->midiQueue[pdvstData->midiQueueSize].messageType = NOTE_OFF;
                         break;
 
@@ -597,18 +2087,47 @@ void pdvst3Processor::midi_to_pd(Vst::ProcessData& data)
                     case Vst::Event::kPolyPressureEvent:
                         pdvstData->midiQueue[pdvstData->midiQueueSize].channelNumber = event.polyPressure.channel;
                         pdvstData->midiQueue[pdvstData->midiQueueSize].dataByte1 = event.polyPressure.pitch;
-                        pdvstData->midiQueue[pdvstData->midiQueueSize].dataByte2 = (char)127 * event.polyPressure.pressure;
+                        pdvstData->midiQueue[pdvstData->midiQueueSize].dataByte2 = midi7bit(event.polyPressure.pressure, 0);
                         pdvstData->midiQueue[pdvstData->midiQueueSize].messageType = KEY_PRESSURE;
                         break;
 
-                    //--- ------------------- this seems the problem. like if we never get here.
+                    //--- ------------------- hosts send controllers through IMidiMapping
+                    // (see midi_map_to_pd), a few send them as events too
                     case Vst::Event::kLegacyMIDICCOutEvent:
-                        pdvstData->midiQueue[pdvstData->midiQueueSize].channelNumber = 0; //event.midiCCOut.channel;
-                        pdvstData->midiQueue[pdvstData->midiQueueSize].dataByte1 = 1;// event.midiCCOut.controlNumber & 0x0F;
-                        pdvstData->midiQueue[pdvstData->midiQueueSize].dataByte2 = event.midiCCOut.value;
-                        pdvstData->midiQueue[pdvstData->midiQueueSize].messageType = CONTROLLER_CHANGE;
+                        pdvstData->midiQueue[pdvstData->midiQueueSize].channelNumber = event.midiCCOut.channel;
+                        if (event.midiCCOut.controlNumber == Vst::kPitchBend)
+                        {
+                            pdvstData->midiQueue[pdvstData->midiQueueSize].dataByte1 = event.midiCCOut.value & 0x7F;
+                            pdvstData->midiQueue[pdvstData->midiQueueSize].dataByte2 = event.midiCCOut.value2 & 0x7F;
+                            pdvstData->midiQueue[pdvstData->midiQueueSize].messageType = PITCH_BEND;
+                        }
+                        else if (event.midiCCOut.controlNumber == Vst::kAfterTouch)
+                        {
+                            pdvstData->midiQueue[pdvstData->midiQueueSize].dataByte1 = event.midiCCOut.value;
+                            pdvstData->midiQueue[pdvstData->midiQueueSize].messageType = CHANNEL_PRESSURE;
+                        }
+                        else if (event.midiCCOut.controlNumber == Vst::kCtrlProgramChange)
+                        {
+                            pdvstData->midiQueue[pdvstData->midiQueueSize].dataByte1 = event.midiCCOut.value;
+                            pdvstData->midiQueue[pdvstData->midiQueueSize].messageType = PROGRAM_CHANGE;
+                        }
+                        else if (event.midiCCOut.controlNumber < 128)
+                        {
+                            pdvstData->midiQueue[pdvstData->midiQueueSize].dataByte1 = event.midiCCOut.controlNumber;
+                            pdvstData->midiQueue[pdvstData->midiQueueSize].dataByte2 = event.midiCCOut.value;
+                            pdvstData->midiQueue[pdvstData->midiQueueSize].messageType = CONTROLLER_CHANGE;
+                        }
+                        else
+                            continue;
                         break;
 
+                    //--- -------------------
+                    case Vst::Event::kDataEvent:
+                        sysex_to_pd(event);
+                        continue;
+
+                    default:
+                        continue;
                 }
                 pdvstData->midiQueueSize++;
                 pdvstData->midiQueueUpdated = 1;
@@ -676,7 +2195,7 @@ tresult PLUGIN_API pdvst3Processor::initialize (FUnknown* context)
     }
 
     /* If you don't need an event bus, you can remove the next line */
-    addEventInput (STR16 ("Event In"), 1);
+    addEventInput (STR16 ("Event In"), 16);
     addEventOutput(STR16 ("Event Out"), 1);
 
     return kResultOk;
@@ -714,33 +2233,84 @@ tresult PLUGIN_API pdvst3Processor::setBusArrangements (Vst::SpeakerArrangement*
 //------------------------------------------------------------------------
 uint32 PLUGIN_API pdvst3Processor::getLatencySamples ()
 {
+    // our blocks come back one host buffer late from the shared server
+    if (sharedPd && pdSlot >= 0)
+        return (uint32)(globalLatency + sharedLatency);
     return (uint32)globalLatency;
 }
 
+// the latency depends on being attached to the shared server and on the
+// host's buffer size: the host only takes a new one through the controller
+void pdvst3Processor::latencyToHost()
+{
+    uint32 latency = getLatencySamples();
+
+    if (latency == reportedLatency)
+        return;
+    reportedLatency = latency;
+    Vst::IMessage *message = allocateMessage();
+    if (message)
+    {
+        message->setMessageID(PDVSTLATENCYMESSAGE);
+        sendMessage(message);
+        message->release();
+    }
+}
+
 //------------------------------------------------------------------------
 tresult PLUGIN_API pdvst3Processor::setActive (TBool state)
 {
     //--- called when the Plug-in is enable/disable (On/Off) -----
+    if (state)
+        activatePd();
     return AudioEffect::setActive (state);
 }
 
 //------------------------------------------------------------------------
 tresult PLUGIN_API pdvst3Processor::process (Vst::ProcessData& data)
 {
+    pdvstTrace(pdvstData, PDVSTTRACEHOST, PDVSTTRACEPROCESSBEGIN, data.numSamples);
+    bufferTime = sampleTime;
+    sampleTime += data.numSamples;
+    if (!pdRunning)
+    {
+        // Pd is starting, dead or hung: keep the host's data and output
+        // silence without waiting on Pd. the supervisor brings it back.
+        // a dead Pd may hold the mutex: then only the values are kept,
+        // replayState() gives them to the next Pd
+        pdTimeouts = 0;
+        if (xxWaitForSingleObject(PDVSTTRANSFERMUTEX, 0))
+        {
+            params_to_pd(data);
+            xxReleaseMutex(PDVSTTRANSFERMUTEX);
+        }
+        else
+            params_to_state(data);
+        for (int32 bus = 0; bus < data.numOutputs; bus++)
+        {
+            for (int32 ch = 0; ch < data.outputs[bus].numChannels; ch++)
+                memset(data.outputs[bus].channelBuffers32[ch], 0, data.numSamples * sizeof(float));
+            data.outputs[bus].silenceFlags = ((uint64)1 << data.outputs[bus].numChannels) - 1;
+        }
+        pdvstTrace(pdvstData, PDVSTTRACEHOST, PDVSTTRACEPROCESSEND, 0);
+        return kResultOk;
+    }
 
-    xxWaitForSingleObject(PDVSTTRANSFERMUTEX, 10);
+    int locked = xxWaitForSingleObject(PDVSTTRANSFERMUTEX, 10);
     {
         params_to_pd(data);
         midi_to_pd(data);
         playhead_to_pd(data);
     }
-    xxReleaseMutex(PDVSTTRANSFERMUTEX);
+    if (locked)
+        xxReleaseMutex(PDVSTTRANSFERMUTEX);
 
     //--- Process Audio---------------------
     //--- ----------------------------------
     if (data.numInputs == 0 || data.numOutputs == 0)
     {
         // nothing to do
+        pdvstTrace(pdvstData, PDVSTTRACEHOST, PDVSTTRACEPROCESSEND, 0);
         return kResultOk;
     }
 
@@ -756,7 +2326,7 @@ tresult PLUGIN_API pdvst3Processor::process (Vst::ProcessData& data)
 
         const int32 numChannelsIn = bus2ch[stereoBusesIn-1];
         const int32 numChannelsOut = bus2ch[stereoBusesOut-1];
-        const int32 numSamples = data.numSamples;
+        int32 numSamples = data.numSamples;
 
         //---------
 
@@ -771,6 +2341,12 @@ tresult PLUGIN_API pdvst3Processor::process (Vst::ProcessData& data)
         {
             setSyncToVst(1);
         }
+        if (sharedPd)
+        {
+            pdvstData->sampleRate = (int)GsampleRate;
+            processShared(input, output, numChannelsIn, numChannelsOut, numSamples);
+            numSamples = 0;
+        }
         for (i = 0; i < numSamples; i++)
         {
             for (j = 0; j < numChannelsIn; j++)
@@ -781,9 +2357,28 @@ tresult PLUGIN_API pdvst3Processor::process (Vst::ProcessData& data)
             // if enough samples to process then do it
             if (audioBuffer->inFrameCount >= PDBLKSIZE)
             {
+                bool pdOk = pdRunning;
                 audioBuffer->inFrameCount = 0;
-                xxWaitForSingleObject(PDPROCEVENT, 10);
-                xxResetEvent(PDPROCEVENT);
+                if (pdOk)
+                {
+                    pdvstTrace(pdvstData, PDVSTTRACEHOST, PDVSTTRACEHOSTWAIT, 0);
+                    if (xxWaitForSingleObject(PDPROCEVENT, 10))
+                    {
+                        pdvstTrace(pdvstData, PDVSTTRACEHOST, PDVSTTRACEHOSTWAKE, 1);
+                        pdTimeouts = 0;
+                    }
+                    else
+                    {
+                        pdvstTrace(pdvstData, PDVSTTRACEHOST, PDVSTTRACEHOSTWAKE, 0);
+                        pdvstLogRated(hostLog, &pdTimeout, PDVSTLOGWARNING,
+                                      "Pd missed a block (%d in a row)", pdTimeouts + 1);
+                        // Pd stopped answering: don't wait on it again, the
+                        // supervisor decides whether it is hung or just slow
+                        if (++pdTimeouts >= PDMAXTIMEOUTS)
+                            pdRunning = false;
+                    }
+                    xxResetEvent(PDPROCEVENT);
+                }
 
                 for (k = 0; k < PDBLKSIZE; k++)
                 {
@@ -794,7 +2389,7 @@ tresult PLUGIN_API pdvst3Processor::process (Vst::ProcessData& data)
                             audioBuffer->resize(audioBuffer->size * 2);
                         }
                         // get pd processed samples
-                        audioBuffer->out[l][audioBuffer->outFrameCount] = pdvstData->samplesOut[l][k];
+                        audioBuffer->out[l][audioBuffer->outFrameCount] = pdOk ? pdvstData->samplesOut[l][k] : 0.f;
                     }
                     (audioBuffer->outFrameCount)++;
                 }
@@ -807,6 +2402,9 @@ tresult PLUGIN_API pdvst3Processor::process (Vst::ProcessData& data)
                     }
                 }
                 pdvstData->sampleRate = (int)GsampleRate;
+                pdvstData->blockTime = bufferTime + i + 1 - PDBLKSIZE;
+                pdvstTrace(pdvstData, PDVSTTRACEHOST, PDVSTTRACEVSTPOST,
+                           (int32_t)pdvstData->blockTime);
                 // signal vst process event
                 xxSetEvent(VSTPROCEVENT);
             }
@@ -819,20 +2417,115 @@ tresult PLUGIN_API pdvst3Processor::process (Vst::ProcessData& data)
                 output[j][i] = audioBuffer->out[j][i];
             }
         }
-        audioBuffer->outFrameCount = 0;
+        if (!sharedPd)
+            audioBuffer->outFrameCount = 0;
     }
-    xxWaitForSingleObject(PDVSTTRANSFERMUTEX, 10);
+    locked = xxWaitForSingleObject(PDVSTTRANSFERMUTEX, 10);
     {
         params_from_pd(data);
         midi_from_pd(data);
     }
-    xxReleaseMutex(PDVSTTRANSFERMUTEX);
-
+    if (locked)
+        xxReleaseMutex(PDVSTTRANSFERMUTEX);
 
+    pdvstTrace(pdvstData, PDVSTTRACEHOST, PDVSTTRACEPROCESSEND, 0);
     return kResultOk;
 
 }
 
+//------------------------------------------------------------------------
+// shared Pd server: our blocks go through the FIFOs and Pd ticks once every
+// busy instance has pushed one, so the output comes one host buffer late
+void pdvst3Processor::processShared(Vst::Sample32** input, Vst::Sample32** output,
+                                    int32 numChannelsIn, int32 numChannelsOut, int32 numSamples)
+{
+    int i, j, n, waitedMs = 0;
+    bool pdOk = pdRunning && pdSlot >= 0;
+
+    while (audioBuffer->outFrameCount + numSamples + PDBLKSIZE > audioBuffer->size)
+    {
+        audioBuffer->resize(audioBuffer->size * 2);
+    }
+    for (i = 0; i < numSamples; i++)
+    {
+        for (j = 0; j < numChannelsIn; j++)
+        {
+            audioBuffer->in[j][audioBuffer->inFrameCount] = input[j][i];
+        }
+        if (++(audioBuffer->inFrameCount) < PDBLKSIZE)
+            continue;
+        audioBuffer->inFrameCount = 0;
+        int head = pdvstData->inHead;
+        if (pdOk && (head + 1) % pdvstData->fifoBlocks != pdvstData->inTail)
+        {
+            float *block = PDVSTFIFOIN(pdvstData, head);
+            for (j = 0; j < numChannelsIn; j++)
+            {
+                memcpy(block + j * PDBLKSIZE, audioBuffer->in[j], PDBLKSIZE * sizeof(float));
+            }
+            pdvstData->inTime[head] = bufferTime + i + 1 - PDBLKSIZE;
+            pdvstTrace(pdvstData, PDVSTTRACEHOST, PDVSTTRACEVSTPOST,
+                       (int32_t)pdvstData->inTime[head]);
+            PDVST_BARRIER();
+            pdvstData->inHead = (head + 1) % pdvstData->fifoBlocks;
+            setHandle(pdServer.mu_tex[SERVEREVENT]);
+        }
+        else if (!pdOk)
+        {
+            // no Pd: keep the timing with silence
+            for (j = 0; j < numChannelsOut; j++)
+            {
+                memset(audioBuffer->out[j] + audioBuffer->outFrameCount, 0, PDBLKSIZE * sizeof(float));
+            }
+            audioBuffer->outFrameCount += PDBLKSIZE;
+        }
+    }
+    // collect the blocks Pd has done, wait a little for the ones we need now
+    while (pdOk && audioBuffer->outFrameCount < numSamples)
+    {
+        if (pdvstData->outTail != pdvstData->outHead)
+        {
+            float *block = PDVSTFIFOOUT(pdvstData, pdvstData->outTail);
+            for (j = 0; j < numChannelsOut; j++)
+            {
+                memcpy(audioBuffer->out[j] + audioBuffer->outFrameCount,
+                       block + j * PDBLKSIZE, PDBLKSIZE * sizeof(float));
+            }
+            audioBuffer->outFrameCount += PDBLKSIZE;
+            PDVST_BARRIER();
+            pdvstData->outTail = (pdvstData->outTail + 1) % pdvstData->fifoBlocks;
+        }
+        else if (waitedMs++ < PDSERVERWAITMS)
+        {
+            pdvstTrace(pdvstData, PDVSTTRACEHOST, PDVSTTRACEHOSTWAIT, 0);
+            waitHandle(res.mu_tex[PDPROCEVENT], 1);
+            resetHandle(res.mu_tex[PDPROCEVENT]);
+            pdvstTrace(pdvstData, PDVSTTRACEHOST, PDVSTTRACEHOSTWAKE,
+                       pdvstData->outTail != pdvstData->outHead);
+        }
+        else
+        {
+            pdvstLogRated(hostLog, &pdTimeout, PDVSTLOGWARNING,
+                          "shared Pd missed a buffer (%d in a row)", pdTimeouts + 1);
+            if (++pdTimeouts >= PDMAXTIMEOUTS)
+                pdRunning = false;
+            break;
+        }
+    }
+    if (audioBuffer->outFrameCount >= numSamples)
+        pdTimeouts = 0;
+    // output pd processed samples, silence for what is missing
+    n = (audioBuffer->outFrameCount < numSamples) ? audioBuffer->outFrameCount : numSamples;
+    for (j = 0; j < numChannelsOut; j++)
+    {
+        memcpy(output[j], audioBuffer->out[j], n * sizeof(float));
+        memset(output[j] + n, 0, (numSamples - n) * sizeof(float));
+        memmove(audioBuffer->out[j], audioBuffer->out[j] + n,
+                (audioBuffer->outFrameCount - n) * sizeof(float));
+    }
+    audioBuffer->outFrameCount -= n;
+}
+
 //------------------------------------------------------------------------
 tresult PLUGIN_API pdvst3Processor::setupProcessing (Vst::ProcessSetup& newSetup)
 {
@@ -841,6 +2534,10 @@ tresult PLUGIN_API pdvst3Processor::setupProcessing (Vst::ProcessSetup& newSetup
         {
             GsampleRate = (int)newSetup.sampleRate; // Store the sample rate
         }
+    // shared Pd server: we get our blocks back one host buffer later
+    sharedLatency = (newSetup.maxSamplesPerBlock + PDBLKSIZE - 1) / PDBLKSIZE * PDBLKSIZE;
+    activatePd();
+    latencyToHost();
 
     //--- called before any processing ----
     return AudioEffect::setupProcessing (newSetup);
@@ -860,6 +2557,76 @@ tresult PLUGIN_API pdvst3Processor::canProcessSampleSize (int32 symbolicSampleSi
     return kResultFalse;
 }
 
+// the parameter values of a state are little endian doubles, moved with
+// one readRaw()/writeRaw()
+static void swapStateValues(double *values, int n);
+
+// a state starts with "PDVSTATE", the version and the number of parameter
+// values that follow. parameter values are 0 to 1, so no state without
+// this header (LEGACYSTATEPARAMS values) starts with these 8 bytes
+static const char stateMagic[8] = {'P', 'D', 'V', 'S', 'T', 'A', 'T', 'E'};
+
+// the values of a state, new[]'ed, NULL if the stream ends first
+double *pdvstReadStateValues(IBStreamer &streamer, int *nValues)
+{
+    char magic[8];
+    int32 version = 0, n = LEGACYSTATEPARAMS;
+    double *values;
+    int start = 0;
+
+    if (streamer.readRaw (magic, 8) != 8)
+        return NULL;
+    if (memcmp(magic, stateMagic, 8) == 0)
+    {
+        if (!streamer.readInt32 (version) || !streamer.readInt32 (n) ||
+            version < 1 || version > PDVSTSTATEVERSION || n < 0 || n > MAXPARAMETERS)
+            return NULL;
+    }
+    else
+        start = 1;  // the first value of a state without header
+    values = new double[n > 0 ? n : 1];
+    if (start)
+        memcpy(values, magic, sizeof(double));
+    if (n > start && streamer.readRaw (values + start, (n - start) * sizeof(double)) !=
+        (int32)((n - start) * sizeof(double)))
+    {
+        delete[] values;
+        return NULL;
+    }
+    swapStateValues(values, n);
+    *nValues = n;
+    return values;
+}
+
+void pdvstWriteStateValues(IBStreamer &streamer, const double *values, int nValues)
+{
+    double *swapped = new double[nValues > 0 ? nValues : 1];
+
+    memcpy(swapped, values, nValues * sizeof(double));
+    swapStateValues(swapped, nValues);
+    streamer.writeRaw (stateMagic, 8);
+    streamer.writeInt32 (PDVSTSTATEVERSION);
+    streamer.writeInt32 (nValues);
+    streamer.writeRaw (swapped, nValues * sizeof(double));
+    delete[] swapped;
+}
+
+static void swapStateValues(double *values, int n)
+{
+#if BYTEORDER == kBigEndian
+    for (int i = 0; i < n; i++)
+    {
+        unsigned char *b = (unsigned char *)(values + i);
+        for (int j = 0; j < 4; j++)
+        {
+            unsigned char t = b[j];
+            b[j] = b[7 - j];
+            b[7 - j] = t;
+        }
+    }
+#endif
+}
+
 //------------------------------------------------------------------------
 tresult PLUGIN_API pdvst3Processor::setState (IBStream* state)
 {
@@ -870,38 +2637,53 @@ tresult PLUGIN_API pdvst3Processor::setState (IBStream* state)
 
     IBStreamer streamer (state, kLittleEndian);
 
-    xxWaitForSingleObject(PDVSTTRANSFERMUTEX, 10);
+    // the values are staged without the transfer mutex, process() takes
+    // them all at once (see applyStagedState()). wait only if it is
+    // taking the previous ones right now
     int i;
-    for (i = 0; i < pdvstData->nParameters; i++)
+    for (;;)
+    {
+        int stage = stateStage;
+        if (stage != STAGE_APPLYING && stage != STAGE_WRITING &&
+            stateStage.compare_exchange_weak(stage, STAGE_WRITING))
+            break;
+        std::this_thread::yield();
+    }
+    int nValues = 0;
+    double *values = pdvstReadStateValues(streamer, &nValues);
+    if (!values)
     {
-        double value = 0;
-        streamer.readDouble (value);
-        pdvstData->vstParameters[i].type = FLOAT_TYPE;
-        pdvstData->vstParameters[i].value.floatData = (float)value;
-        pdvstData->vstParameters[i].direction = PD_RECEIVE;
-        pdvstData->vstParameters[i].updated = 1;
+        stateStage = STAGE_FREE;
+        return kResultFalse;
     }
-    // advance until chunk
-    for (i = pdvstData->nParameters; i < MAXPARAMS; i++)
+    // parameters the state doesn't have (PARAMETERS grew) go to 0
+    for (i = 0; i < nParameters; i++)
     {
-        double unused = 0;
-        streamer.readDouble (unused);
+        stagedParams[i] = (i < nValues) ? (float)values[i] : 0.f;
+        stateParams[i] = stagedParams[i];
     }
-    // read chunk
+    stateStage = STAGE_READY;
+    delete[] values;
+    // read chunk, the chunk thread sends it to Pd
     int chunklen = 0;
+    int capacity = 0;
+    char *staged = NULL;
     streamer.readInt32 (chunklen); // read length of chunk
-    pdvstData->datachunk.size = (int)chunklen;
-    for (i = 0; i < chunklen; i++)
+    if (chunklen < 0 || chunklen > MAXCHUNKSIZE || !chunkReserve(&staged, &capacity, chunklen))
+        chunklen = 0;
+    if (chunklen > 0)
     {
-        char v = 0;
-        streamer.readChar8 (v);
-        pdvstData->datachunk.data[i] = v;
+        int32 got = streamer.readRaw (staged, chunklen);
+        chunklen = (got > 0) ? got : 0;
     }
-    i++;
-    pdvstData->datachunk.data[i] = '\0';
-    pdvstData->datachunk.direction = PD_RECEIVE;
-    pdvstData->datachunk.updated = 1;
-    xxReleaseMutex(PDVSTTRANSFERMUTEX);
+    chunkLock.lock();
+    free(chunk);
+    chunk = staged;
+    chunkCapacity = capacity;
+    chunkSize = chunklen;
+    chunkSent = 0;
+    chunkToPd = true;
+    chunkLock.unlock();
 
     return kResultOk;
 }
@@ -911,30 +2693,26 @@ tresult PLUGIN_API pdvst3Processor::getState (IBStream* state)
 {
     // here we need to save the model (preset or project)
 
+    // nothing here waits for the audio thread nor for Pd
     IBStreamer streamer (state, kLittleEndian);
-    xxWaitForSingleObject(PDVSTTRANSFERMUTEX, 10);
-    //write params (also zero the rest of the unused ones)
-    for (int i = 0; i < pdvstData->nParameters; i++)
-    {
-        double v = (double)pdvstData->vstParameters[i].value.floatData;
-        streamer.writeDouble (v);
-    }
-    for (int i = pdvstData->nParameters; i < MAXPARAMS; i++)
-    {
-        double v = 0;
-        streamer.writeDouble (v);
-    }
+    //write params
+    double *values = new double[nParameters > 0 ? nParameters : 1];
+    for (int i = 0; i < nParameters; i++)
+        values[i] = (double)stateParams[i];
+    pdvstWriteStateValues(streamer, values, nParameters);
+    delete[] values;
+    // [vstarray]: the arrays are in the last snapshot Pd sent (at most
+    // PDARRAYSNAPSHOTMS old), the chunk thread asks for the next one now
+    if (pdRunning && pdvstData && pdvstData->chunkOnRequest)
+        arraysWanted = true;
     // write data chunk
-    int chunklen = pdvstData->datachunk.size;
-    streamer.writeInt32 (chunklen); // write length of chunk
-    for (int i = 0; i < chunklen; i++)
-    {
-        char v = pdvstData->datachunk.data[i];
-        streamer.writeChar8 (v);
-    }
+    chunkLock.lock();
+    streamer.writeInt32 (chunkSize); // write length of chunk
+    if (chunkSize > 0)
+        streamer.writeRaw (chunk, chunkSize);
     char end = '\0';
     streamer.writeChar8 (end);
-    xxReleaseMutex(PDVSTTRANSFERMUTEX);
+    chunkLock.unlock();
 
     return kResultOk;
 }
@@ -943,76 +2721,32 @@ tresult PLUGIN_API pdvst3Processor::getState (IBStream* state)
 // mutexes events semaphores
 //------------------------------------------------------------------------
 
+// before activatePd() there is no Pd to share pdvstData with
+
 int pdvst3Processor::xxWaitForSingleObject(int mutex, int ms)
 {
-    #if _WIN32
-        int ret;
-        ret = WaitForSingleObject(mu_tex[mutex], ms);
-
-        if (ret == WAIT_TIMEOUT)
-            return 0;
-        else if (ret == WAIT_OBJECT_0)
-            return 1;
-        else
-            return(ret);
-    #else
-        if (ms == -1) ms = 30000;
-        float elapsed_time = 0;
-        int wait_time = 10; // Wait time between attempts in microseconds
-        int ret= -1;
-        while (1)
-        {
-            if (sem_trywait(mu_tex[mutex]) == 0)
-                return 1;
-            if (elapsed_time >= ms)
-            {
-                // Timeout has been reached
-                return 0;
-            }
-            usleep(wait_time);
-            elapsed_time += (wait_time / 1000.);
-        }
-    #endif
+    if (!res.data)
+        return 1;
+    return waitHandle(res.mu_tex[mutex], ms);
 }
 
 int pdvst3Processor::xxReleaseMutex(int mutex)
 {
-    #if _WIN32
-        ReleaseMutex(mu_tex[mutex]);
-        return 0;
-    #else
-        sem_post(mu_tex[mutex]);
-        return 0;
-    #endif
+    if (res.data)
+        releaseHandle(res.mu_tex[mutex]);
+    return 0;
 }
 
 void pdvst3Processor::xxSetEvent(int mutex)
 {
-    #if _WIN32
-        SetEvent(mu_tex[mutex]);
-    #else
-        int value;
-        sem_getvalue(mu_tex[mutex], &value);
-        if (value == 0)
-        {
-            sem_post(mu_tex[mutex]);  // Increment to 1 (signaled)
-        }
-    #endif
+    if (res.data)
+        setHandle(res.mu_tex[mutex]);
 }
 
 void pdvst3Processor::xxResetEvent(int mutex)
 {
-    #if _WIN32
-        ResetEvent(mu_tex[mutex]);
-    #else
-        int value;
-        sem_getvalue(mu_tex[mutex], &value);
-        while (value > 0)
-        {
-            sem_wait(mu_tex[mutex]);  // Decrement until count is 0
-            sem_getvalue(mu_tex[mutex], &value);
-        }
-    #endif
+    if (res.data)
+        resetHandle(res.mu_tex[mutex]);
 }
 
 
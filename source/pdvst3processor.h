@@ -28,6 +28,9 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <cstdint>
+#include <atomic>
+#include <thread>
+#include <mutex>
 #if _WIN32
     #include <process.h>
     #include <windows.h>
@@ -41,16 +44,87 @@ extern "C"
     #include "pdvstTransfer.h"
 }
 
+#if _WIN32
+    typedef HANDLE pdvstHandle;
+#else
+    typedef sem_t *pdvstHandle;
+#endif
+
+/* transfer region and semaphores shared with one Pd process. created by
+   an instance, or ahead of time for the pool of idle Pd processes */
+typedef struct _pdvstResources
+{
+#if _WIN32
+    HANDLE  fileMap,
+            process;
+    char    mutexName[MAXFILENAMELEN],
+            fileMapName[MAXFILENAMELEN],
+            vstProcEventName[MAXFILENAMELEN],
+            pdProcEventName[MAXFILENAMELEN];
+#else
+    char    *sharedAddressesMap,
+            *fileMap;
+    char    sharedAddressesMapName[MAXFILENAMELEN];
+    pdvstSharedAddresses *shared;
+#endif
+    pdvstHandle mu_tex[3];
+    pdvstTransferData *data;
+    int size;
+} pdvstResources;
+
+/* host -> Pd state of one parameter */
+typedef struct _pdvstParamState
+{
+    float threshold;    // smaller changes are not sent
+    float rate;         // max values per second sent, 0 for all of them
+    float sent;         // last value sent to Pd
+    float held;         // latest value waiting for rate
+    bool isHeld;
+    bool inHeldList;    // in heldList until its compaction drops it
+    bool endPending;    // last point was below threshold, sent if no more come
+    float endValue;
+    int64_t pointBuffer;  // bufferTime of the last process() with points
+    int64_t sentTime;
+    int64_t lastTime;   // where the ramp to the next point starts
+} pdvstParamState;
+
+/* IMessage ID: the processor's latency changed, the controller tells the host */
+#define PDVSTLATENCYMESSAGE "pdvstLatency"
+
+/* setState hands its parameter values to the audio thread through these */
+enum
+{
+    STAGE_FREE,
+    STAGE_WRITING,      // setState is filling stagedParams
+    STAGE_READY,        // the audio thread takes them on its next process()
+    STAGE_APPLYING
+};
+
 /* program data */
 typedef struct _pdvstProgram
 {
     char name[MAXSTRLEN];
-    float paramValue[MAXPARAMETERS];
+    float *paramValue;  // one per parameter, 0 if the config has none
 } pdvstProgram;
 
 
 namespace Steinberg {
 
+class IBStreamer;
+
+void pdvstCreateResources(pdvstResources *r, const char *tag, int size);
+void pdvstDestroyResources(pdvstResources *r);
+void pdvstInitTransfer(pdvstTransferData *d, int nChannelsIn, int nChannelsOut, bool fresh);
+void pdvstSchedulerFlags(pdvstResources *r, char *extraFlags);
+void pdvstMakeCommandLine(char *commandLineArgs, const char *extraFlags,
+                          int chIn, int chOut, bool openPatch);
+void *pdvstSpawnPd(const char *commandLine);
+double *pdvstReadStateValues(IBStreamer &streamer, int *nValues);
+void pdvstWriteStateValues(IBStreamer &streamer, const double *values, int nValues);
+// pool of idle Pd processes, see pdvst3pluginfactory.cpp
+bool pdvstPoolClaim(pdvstResources *r);
+void pdvstPoolClear();
+
 
 class pdVstBuffer
 {
@@ -131,51 +205,123 @@ public:
 protected:
 
     static int referenceCount;
-    void debugLog(char *fmt, ...);
-    FILE *debugFile;
+    void debugLog(const char *fmt, ...);
+    void logMessage(int level, const char *fmt, ...);
+    void drainLog();
+    void drainTrace();
+    FILE *debugFile;        // the log file, opened by drainLog() for the first line
+    char logPath[MAXFILENAMELEN];
+    pdvstLogRing *hostLog;  // lines of this instance, Pd's are in pdvstData->pdLog
+    uint32_t logDropped[2]; // lost lines of both rings already reported
+    FILE *traceFile;        // TRACE = TRUE: the events of pdvstData->trace
+    char tracePath[MAXFILENAMELEN];
+    uint32_t traceDropped[2];
+    // rate limits of the overflow and timeout messages
+    pdvstLogLimit midiInFull;
+    pdvstLogLimit noteInFull;
+    pdvstLogLimit sysexInFull;
+    pdvstLogLimit paramQueueFull;
+    pdvstLogLimit pdTimeout;
     pdVstBuffer *audioBuffer;
     char errorMessage[MAXFILENAMELEN];
     char externalLib[MAXEXTERNS][MAXSTRLEN];
-    float vstParam[MAXPARAMS];
     char **vstParamName;
     int nParameters;
     pdvstProgram *program;
     int nPrograms;
+    int curProgram;         // -1 until the host selects one
     int nChannelsIn;
     int nChannelsOut;
     int nExternalLibs;
     bool customGui;
     bool isASynth;
     bool dspActive;
-#if _WIN32
-    HANDLE  pdvstTransferFileMap,
-            mu_tex[3];
-    char    pdvstTransferMutexName[MAXFILENAMELEN],
-            pdvstTransferFileMapName[MAXFILENAMELEN],
-            vstProcEventName[MAXFILENAMELEN],
-            pdProcEventName[MAXFILENAMELEN];
-#else
-    char    *pdvstSharedAddressesMap,
-            *pdvstTransferFileMap;
-    sem_t   *mu_tex[3];
-    int     fd;
-#endif
-    pdvstSharedAddresses *pdvstShared;
-    char pdvstSharedAddressesMapName[MAXFILENAMELEN];
+    pdvstResources res;
     pdvstTransferData *pdvstData;
     int GsampleRate;
     int stereoBusesIn;
     int stereoBusesOut;
     int bus2ch[1024];
-
+    int64_t sampleTime;     // samples since we started processing
+    int64_t bufferTime;     // sampleTime at the start of this process() call
+    pdvstParamState *paramState;
+    int *heldList;          // parameters with a held value or a pending end
+    int nHeld;
+    unsigned char *sysexBuffer;  // SysEx from Pd, read by the host until the next process()
+    // what getState saves: the latest value of each parameter, from the host
+    // or from Pd, kept without the transfer mutex
+    std::atomic<float> *stateParams;
+    float *stagedParams;
+    std::atomic<int> stateStage;
+
+    // Pd supervisor: watches the Pd process and relaunches it off the audio thread
+    std::thread supervisor;
+    std::atomic<bool> supervisorRun;
+    std::atomic<bool> pdRunning;    // false while Pd is starting, dead or hung
+    bool pdStarted;                 // Pd is launched on the first activation
+    int pdTimeouts;                 // consecutive PDPROCEVENT timeouts (audio thread)
+    int pdRestarts;
+    char pdCommandLine[MAXSTRLEN];
+
+    // state chunk (svstdata / rvstdata): any size, moved to and from Pd
+    // in segments by its own thread, away from process()
+    std::thread chunkThread;
+    std::atomic<bool> chunkRun;
+    std::mutex chunkLock;   // guards the fields below but chunkFromPd
+    char *chunk;            // the latest one, from setState or from Pd
+    int chunkSize;
+    int chunkCapacity;
+    bool chunkToPd;         // chunk has to be sent to Pd
+    int chunkSent;          // bytes of it in Pd so far
+    char *chunkFromPd;      // being received, chunk thread only
+    int chunkFromPdSize;
+    int chunkFromPdCapacity;
+    std::atomic<int> chunkAnswered;  // chunkRequest of the last chunk from Pd
+    int chunkRequests;               // chunk thread only
+    std::atomic<bool> arraysWanted;  // getState used the snapshot, ask for a fresh one
+
+    // shared Pd server (SHAREDPD = TRUE)
+    bool sharedPd;
+    int pdSlot;             // our slot in the server, -1 if none
+    int pdGeneration;       // server launch we are attached to
+    int sharedLatency;      // one host buffer, rounded up to PDBLKSIZE
+    uint32 reportedLatency; // getLatencySamples() the controller last told the host
 
     void set_resources();
     void clean_resources();
+    void activatePd();
     void startPd();
+    void launchPd();
+    void restartPd();
+    bool killPd();
+    void renewTransferMutex();
+    bool pdProcessAlive();
+    void supervise();
+    void transferChunks();
+    bool chunk_to_pd();
+    bool chunk_from_pd();
+    void replayState();
+    void applyStagedState();
+    void startServer();
+    void attachServer();
+    void detachServer();
+    void relaunchServer(int generation);
+    void latencyToHost();
+    void processShared(Vst::Sample32** input, Vst::Sample32** output,
+                       int32 numChannelsIn, int32 numChannelsOut, int32 numSamples);
     void parseSetupFile();
     void params_from_pd(Vst::ProcessData& data);
     void params_to_pd(Vst::ProcessData& data);
+    void params_to_state(Vst::ProcessData& data);
+    void param_change_to_pd(int i, float value, int64_t time);
+    void param_point_to_pd(int i, float value, int64_t time);
+    void program_to_pd(int index);
+    void program_name_to_pd(int index);
+    void midi_map_to_pd(Vst::IParamValueQueue* paramQueue);
+    void note_to_pd(Vst::Event& event);
     void midi_from_pd(Vst::ProcessData& data);
+    void sysex_from_pd(Vst::ProcessData& data);
+    void sysex_to_pd(Vst::Event& event);
     void midi_to_pd(Vst::ProcessData& data);
     void playhead_to_pd(Vst::ProcessData& data);
     void setSyncToVst(int value);
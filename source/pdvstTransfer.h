@@ -23,6 +23,9 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
 #include "pdvst3_base_defines.h"
 
 
@@ -50,6 +53,11 @@ typedef enum _pdvstMidiMessageType
     OTHER
 } pdvstMidiMessageType;
 
+/* pdvstTransferData.midiCoalesce: message types of which Pd only gets the
+   latest value per tick (and channel, controller or note) */
+#define PDVSTCOALESCE(type) (1 << (type))
+#define PDVSTCOALESCEEXPRESSION (1 << 16)  // note expression of [vstnote]
+
 typedef union _pdvstParameterData
 {
     float floatData;
@@ -71,15 +79,76 @@ typedef struct _pdvstMidiMessage
     char statusByte;
     char dataByte1;
     char dataByte2;
+    int64_t time;   // in samples like pdvstParamPoint, Pd delivers it on its tick
 } pdvstMidiMessage;
 
-typedef struct _dataChunk
+typedef enum _pdvstNoteEventType
 {
-    int updated;
+    NOTEEVENT_ON,
+    NOTEEVENT_OFF,
+    NOTEEVENT_PRESSURE,
+    NOTEEVENT_EXPRESSION
+} pdvstNoteEventType;
+
+/* a host note event at full precision, for [vstnote] */
+typedef struct _pdvstNoteEvent
+{
+    pdvstNoteEventType type;
+    int channel;
+    int pitch;
+    int noteId;         // -1 if the host doesn't give one
+    int expression;     // NOTEEVENT_EXPRESSION: the host's NoteExpressionTypeID
+    float tuning;       // in cents
+    float value;        // velocity, pressure or expression value (0..1)
+    int64_t time;
+} pdvstNoteEvent;
+
+/* one automation point of a host parameter. times are in samples counted
+   from the start of processing, like pdvstTransferData.blockTime */
+typedef struct _pdvstParamPoint
+{
+    int index;
+    float value;
+    int64_t time;   // where the parameter reaches value
+    int64_t start;  // where the ramp to it starts (previous point)
+} pdvstParamPoint;
+
+/* one SysEx message (F0 ... F7) of a pdvstSysexRing, its bytes are
+   contiguous in the ring's arena from start % MAXSYSEXBYTES */
+typedef struct _pdvstSysex
+{
+    uint32_t start;
     int size;
-    char data[MAXSTRINGSIZE];
-    pdvstParameterState direction;
-} dataChunk;
+    int64_t time;
+} pdvstSysex;
+
+/* SysEx in one direction, single writer and single reader, no mutex.
+   the counters only grow (wrapping at 2^32); the writer doesn't touch the
+   bytes before byteTail until the reader is done with them */
+typedef struct _pdvstSysexRing
+{
+    volatile uint32_t head;      // messages, written by the writer
+    volatile uint32_t tail;      // written by the reader
+    volatile uint32_t byteHead;  // written by the writer
+    volatile uint32_t byteTail;  // written by the reader
+    pdvstSysex msg[MAXSYSEXQUEUESIZE];
+    unsigned char bytes[MAXSYSEXBYTES];
+} pdvstSysexRing;
+
+/* a state chunk (svstdata / rvstdata) of any size goes through a window
+   of CHUNKSEGMENTSIZE bytes, one segment at a time, without the transfer
+   mutex: the writer fills it and sets full, the reader takes it and clears
+   full. a segment at offset 0 starts a new chunk (an unfinished one is
+   dropped) */
+typedef struct _pdvstChunkStream
+{
+    volatile int full;
+    int total;      // bytes of the whole chunk
+    int offset;     // where this segment goes in it
+    int size;       // bytes in this segment
+    int request;    // the chunkRequest Pd had answered when it made the chunk
+    char data[CHUNKSEGMENTSIZE];
+} pdvstChunkStream;
 
 typedef struct _vstTimeInfo
 {
@@ -125,41 +194,368 @@ typedef struct _vstTimeInfo
     int32_t timeSigNumerator;           ///< time signature numerator (e.g. 3 for 3/4)  (optional)
     int32_t timeSigDenominator;     ///< time signature denominator (e.g. 4 for 3/4) (optional)
 
-    int32_t chord;                  ///< musical info                               (optional)
+    int16_t chordKeyNote;           ///< key note in chord, 0 = C                   (optional)
+    int16_t chordRootNote;          ///< lowest note in chord
+    int16_t chordMask;              ///< bit 0: root note, bit 1: minor 2nd, ...
+
+    int32_t smpteOffsetSubframes;   ///< SMPTE offset in subframes (1/80 of a frame) (optional)
+    uint32_t frameRate;             ///< SMPTE frames per second                    (optional)
+    uint32_t frameRateFlags;        ///< pull down / drop frame
 
     int32_t samplesToNextClock;     ///< MIDI Clock Resolution (24 Per Quarter Note), can be negative (nearest) (optional)
 //------------------------------------------------------------------------
+    int64_t time;                   // sample time (like blockTime) of the buffer it came with
 }pdvstTimeInfo;
 
 
+/* shared memory written by one side and read by the other without the
+   transfer mutex (block FIFOs) must be published with a barrier */
+#ifdef _MSC_VER
+    #define PDVST_BARRIER() MemoryBarrier()
+    #define PDVST_CAS(p, old, new) \
+        (InterlockedCompareExchange((volatile LONG *)(p), (LONG)(new), (LONG)(old)) == (LONG)(old))
+    #define PDVST_INCREMENT(p) InterlockedIncrement((volatile LONG *)(p))
+#else
+    #define PDVST_BARRIER() __sync_synchronize()
+    #define PDVST_CAS(p, old, new) __sync_bool_compare_and_swap((p), (old), (new))
+    #define PDVST_INCREMENT(p) __sync_add_and_fetch((p), 1)
+#endif
+
+/* log lines: any thread of either process (the audio thread too) writes
+   them with pdvstLog() without blocking, the host's supervisor thread
+   takes them out with pdvstLogRead() and writes the instance's log file */
+enum
+{
+    PDVSTLOGNONE = -1,
+    PDVSTLOGERROR,
+    PDVSTLOGWARNING,
+    PDVSTLOGINFO,
+    PDVSTLOGDEBUG
+};
+
+typedef struct _pdvstLogEntry
+{
+    volatile uint32_t seq;  // its position + 1 once written
+    int level;
+    double time;            // pdvstLogNow()
+    char text[PDVSTLOGLINE];
+} pdvstLogEntry;
+
+typedef struct _pdvstLogRing
+{
+    volatile uint32_t head;     // next entry, taken by writers with PDVST_CAS
+    volatile uint32_t tail;     // written by the reader
+    volatile uint32_t dropped;  // lines lost to a full ring
+    int level;                  // lines above it are not logged
+    pdvstLogEntry entry[PDVSTLOGSIZE];
+} pdvstLogRing;
+
+/* one kind of message that may repeat on every block (queue overflows,
+   timeouts): logged at most every PDVSTLOGINTERVAL seconds */
+typedef struct _pdvstLogLimit
+{
+    double last;
+    int suppressed;     // since the last one logged
+} pdvstLogLimit;
+
+/* per-block tracing (TRACE = TRUE): the host's audio thread and the Pd
+   scheduler stamp each step of a block with pdvstLogNow() into their own
+   ring, the supervisor writes both to the instance's .trace file and the
+   pdvst3trace tool turns it into Chrome trace JSON */
+#define PDVSTTRACEVERSION 1
+
+enum
+{
+    PDVSTTRACEHOST,     // rings of pdvstTransferData.trace
+    PDVSTTRACEPD
+};
+
+enum
+{
+    PDVSTTRACEPROCESSBEGIN,  // host: process() entry, arg = numSamples
+    PDVSTTRACEPROCESSEND,    // host: process() exit
+    PDVSTTRACEVSTPOST,       // host: a block is posted to Pd, arg = its blockTime
+    PDVSTTRACEHOSTWAIT,      // host: waits for Pd
+    PDVSTTRACEHOSTWAKE,      // host: Pd answered, arg = 0 if the wait timed out
+    PDVSTTRACESCHEDWAKE,     // Pd: the scheduler takes a block, arg = its blockTime
+    PDVSTTRACETICKBEGIN,     // Pd: sched_tick(), arg = blockTime
+    PDVSTTRACETICKEND,
+    PDVSTTRACEPDPOST,        // Pd: the block is done, arg = blockTime
+    PDVSTTRACELOST,          // in .trace files only: arg events lost to a full ring
+    PDVSTTRACEEVENTS
+};
+
+typedef struct _pdvstTraceEvent
+{
+    double time;        // pdvstLogNow()
+    int32_t type;
+    int32_t arg;
+} pdvstTraceEvent;
+
+/* one writer (the audio thread or the scheduler), one reader (supervisor) */
+typedef struct _pdvstTraceRing
+{
+    volatile uint32_t head;     // written by the writer
+    volatile uint32_t tail;     // written by the reader
+    volatile uint32_t dropped;  // written by the writer
+    pdvstTraceEvent event[PDVSTTRACESIZE];
+} pdvstTraceRing;
+
 typedef struct _pdvstTransferData
 {
+    int mapSize;         // size of the whole mapping, FIFOs follow this struct
     int active;
     int syncToVst;
+    int schedulerReady;  // set by the scheduler once its receivers exist
+    int heartbeat;       // incremented on every scheduler loop
+    int pdProcessId;     // pid of the Pd process running the scheduler
     int nChannelsIn;
     int nChannelsOut;
     int sampleRate;
     int blockSize;
-    int nParameters;
+    int nParameters;     // parameter values and dirty bits follow this struct
     int midiQueueSize;
     int midiQueueUpdated;
+    int midiCoalesce;    // PDVSTCOALESCE() bits
+    int chunkCompress;   // Pd compresses the svstdata chunks it sends
+    int restoreMessages;      // rvstdata messages Pd sends per tick, 0 for all
+    int restoreMicroseconds;  // time Pd spends sending them per tick, 0 for no limit
     float samplesIn[MAXCHANNELS][MAXBLOCKSIZE];
     float samplesOut[MAXCHANNELS][MAXBLOCKSIZE];
-    pdvstParameter vstParameters[MAXPARAMETERS];
     pdvstMidiMessage midiQueue[MAXMIDIQUEUESIZE];
+    int noteQueueSize;
+    int noteQueueUpdated;
+    pdvstNoteEvent noteQueue[MAXMIDIQUEUESIZE];
+    int paramQueueSize;
+    int paramQueueUpdated;
+    pdvstParamPoint paramQueue[MAXPARAMQUEUESIZE];
+    int64_t blockTime;  // time of the first sample in samplesIn
+    // parameter changes from Pd, stamped with the blockTime of their tick.
+    // single writer (Pd) and single reader (host), no mutex needed
+    volatile int paramOutHead;  // written by Pd
+    volatile int paramOutTail;  // written by the host
+    pdvstParamPoint paramOut[MAXPARAMQUEUESIZE];
     pdvstParameter guiState;
     pdvstParameter plugName;  // transmitted by host
-    dataChunk datachunk;  // get/set chunk from .fxp .fxb files
+    pdvstChunkStream chunkIn;   // host -> Pd, written by the host
+    pdvstChunkStream chunkOut;  // Pd -> host, written by Pd
+    volatile int chunkRequest;    // written by the host: getState wants a fresh chunk
+    volatile int chunkOnRequest;  // written by Pd: it answers them ([vstarray])
     pdvstParameter progname2pd;  // send program name to Pd
     pdvstParameter prognumber2pd;  // send program name to Pd
     pdvstParameter guiName;   // transmitted by pd : name of gui window to be embedded
     int midiOutQueueSize;
     int midiOutQueueUpdated;
     pdvstMidiMessage midiOutQueue[MAXMIDIOUTQUEUESIZE];
+    pdvstSysexRing sysexIn;   // written by the host
+    pdvstSysexRing sysexOut;  // written by Pd
+    pdvstLogRing pdLog;       // Pd's log lines, written to the host's log file
+    int tracing;              // both sides fill trace[] (TRACE = TRUE)
+    pdvstTraceRing trace[2];  // PDVSTTRACEHOST, PDVSTTRACEPD
     pdvstTimeInfo  hostTimeInfo;
+    // shared Pd server mode: audio blocks go through FIFOs after this struct
+    int fifoBlocks;
+    int fifoChannels;
+    volatile int inHead;   // written by the host
+    volatile int inTail;   // written by Pd
+    volatile int outHead;  // written by Pd
+    volatile int outTail;  // written by the host
+    int64_t inTime[PDFIFOBLOCKS];  // blockTime of each input block
+    // pool of idle Pd processes: the host asks Pd to open its patch
+    int openPatch;
+    char patchName[MAXFILENAMELEN];
+    char patchDir[MAXFILENAMELEN];
 
 } pdvstTransferData;
 
+/* the parameters live after the struct, away from the strings of
+   pdvstParameter: n floats, then a bitmap of the values the host changed
+   since Pd took them. both start on a cache line */
+#define PDVSTALIGN(bytes) (((bytes) + 63) & ~(size_t)63)
+#define PDVSTDIRTYWORDS(n) (((n) + 31) / 32)
+#define PDVSTPARAMBYTES(n) (PDVSTALIGN((n) * sizeof(float)) + \
+                            PDVSTALIGN(PDVSTDIRTYWORDS(n) * sizeof(uint32_t)))
+#define PDVSTPARAMS(d) ((float *)((char *)(d) + PDVSTALIGN(sizeof(pdvstTransferData))))
+#define PDVSTDIRTY(d) ((uint32_t *)((char *)PDVSTPARAMS(d) + \
+                                    PDVSTALIGN((d)->nParameters * sizeof(float))))
+#define PDVSTSETDIRTY(d, i) (PDVSTDIRTY(d)[(i) >> 5] |= 1u << ((i) & 31))
+
+/* the whole mapping: struct, parameters and (shared server) the FIFOs */
+#define PDVSTMAPSIZE(nParameters, fifoBlocks, fifoChannels) \
+    (PDVSTALIGN(sizeof(pdvstTransferData)) + PDVSTPARAMBYTES(nParameters) + \
+     2 * (fifoBlocks) * (fifoChannels) * PDBLKSIZE * sizeof(float))
+
+/* block b of the input/output FIFO: fifoChannels x PDBLKSIZE floats */
+#define PDVSTFIFOIN(d, b) ((float *)((char *)PDVSTPARAMS(d) + PDVSTPARAMBYTES((d)->nParameters)) + \
+                           (b) * (d)->fifoChannels * PDBLKSIZE)
+#define PDVSTFIFOOUT(d, b) PDVSTFIFOIN(d, (d)->fifoBlocks + (b))
+
+/* the counter from which size bytes fit in the arena of r, at or after
+   start (a message doesn't wrap: the end of the arena is skipped if it is
+   too short). 0 if the reader hasn't freed enough yet */
+static inline int pdvstSysexFit(pdvstSysexRing *r, uint32_t start, int size, uint32_t *at)
+{
+    uint32_t offset = start % MAXSYSEXBYTES;
+
+    if (size > MAXSYSEXBYTES)
+        return 0;
+    if (offset + size > MAXSYSEXBYTES)
+        start += MAXSYSEXBYTES - offset;
+    if (start + size - r->byteTail > MAXSYSEXBYTES)
+        return 0;
+    *at = start;
+    return 1;
+}
+
+/* a clock that both processes share, in seconds */
+static inline double pdvstLogNow(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+static inline void pdvstLogReset(pdvstLogRing *r, int level)
+{
+    int i;
+
+    for (i = 0; i < PDVSTLOGSIZE; i++)
+        r->entry[i].seq = 0;
+    r->head = r->tail = r->dropped = 0;
+    r->level = level;
+}
+
+static inline void pdvstLogV(pdvstLogRing *r, int level, const char *fmt, va_list ap)
+{
+    uint32_t pos;
+    pdvstLogEntry *e;
+
+    if (level > r->level)
+        return;
+    do
+    {
+        pos = r->head;
+        if (pos - r->tail >= PDVSTLOGSIZE)
+        {
+            PDVST_INCREMENT(&r->dropped);
+            return;
+        }
+    } while (!PDVST_CAS(&r->head, pos, pos + 1));
+    e = &r->entry[pos % PDVSTLOGSIZE];
+    e->level = level;
+    e->time = pdvstLogNow();
+    vsnprintf(e->text, PDVSTLOGLINE, fmt, ap);
+    PDVST_BARRIER();
+    e->seq = pos + 1;
+}
+
+static inline void pdvstLog(pdvstLogRing *r, int level, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    pdvstLogV(r, level, fmt, ap);
+    va_end(ap);
+}
+
+/* like pdvstLog() for messages of limit, the first one after a quiet
+   PDVSTLOGINTERVAL tells how many were left out */
+static inline void pdvstLogRated(pdvstLogRing *r, pdvstLogLimit *limit, int level,
+                                 const char *fmt, ...)
+{
+    char text[PDVSTLOGLINE];
+    double now;
+    va_list ap;
+
+    if (level > r->level)
+        return;
+    now = pdvstLogNow();
+    if (limit->last != 0 && now - limit->last < PDVSTLOGINTERVAL)
+    {
+        limit->suppressed++;
+        return;
+    }
+    va_start(ap, fmt);
+    vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    if (limit->suppressed)
+        pdvstLog(r, level, "%s (%d more)", text, limit->suppressed);
+    else
+        pdvstLog(r, level, "%s", text);
+    limit->last = now;
+    limit->suppressed = 0;
+}
+
+/* the oldest line, 0 if there is none (or it is still being written) */
+static inline int pdvstLogRead(pdvstLogRing *r, pdvstLogEntry *out)
+{
+    uint32_t tail = r->tail;
+    pdvstLogEntry *e = &r->entry[tail % PDVSTLOGSIZE];
+
+    if (tail == r->head || e->seq != tail + 1)
+        return 0;
+    PDVST_BARRIER();
+    out->level = e->level;
+    out->time = e->time;
+    memcpy(out->text, e->text, PDVSTLOGLINE);
+    out->text[PDVSTLOGLINE - 1] = 0;
+    PDVST_BARRIER();
+    r->tail = tail + 1;
+    return 1;
+}
+
+static inline void pdvstTraceReset(pdvstTransferData *d, int tracing)
+{
+    int k;
+
+    for (k = 0; k < 2; k++)
+        d->trace[k].head = d->trace[k].tail = d->trace[k].dropped = 0;
+    d->tracing = tracing;
+}
+
+/* one step of side (PDVSTTRACEHOST or PDVSTTRACEPD), nothing if tracing is off */
+static inline void pdvstTrace(pdvstTransferData *d, int side, int type, int32_t arg)
+{
+    pdvstTraceRing *r = &d->trace[side];
+    uint32_t head = r->head;
+    pdvstTraceEvent *e;
+
+    if (!d->tracing)
+        return;
+    if (head - r->tail >= PDVSTTRACESIZE)
+    {
+        r->dropped++;
+        return;
+    }
+    e = &r->event[head % PDVSTTRACESIZE];
+    e->time = pdvstLogNow();
+    e->type = type;
+    e->arg = arg;
+    PDVST_BARRIER();
+    r->head = head + 1;
+}
+
+/* the oldest event of r, 0 if there is none */
+static inline int pdvstTraceRead(pdvstTraceRing *r, pdvstTraceEvent *out)
+{
+    uint32_t tail = r->tail;
+
+    if (tail == r->head)
+        return 0;
+    PDVST_BARRIER();
+    *out = r->event[tail % PDVSTTRACESIZE];
+    PDVST_BARRIER();
+    r->tail = tail + 1;
+    return 1;
+}
+
 typedef struct _pdvstSharedAddresses
 {
 	char pdvstTransferMutexName[MAXFILENAMELEN];
@@ -176,4 +572,41 @@ typedef enum _traffic
     PDPROCEVENT
 } traffic;
 
+/* shared Pd server: one Pd process runs the patches of many instances */
+
+typedef enum _pdvstSlotState
+{
+    SLOT_FREE,
+    SLOT_ATTACH,    // host asks Pd to open the instance
+    SLOT_ATTACHED,
+    SLOT_DETACH     // host asks Pd to close the instance
+} pdvstSlotState;
+
+typedef struct _pdvstServerSlot
+{
+    int state;
+    char mutexName[PDVSTNAMELEN];
+    char fileMapName[PDVSTNAMELEN];
+    char vstProcEventName[PDVSTNAMELEN];
+    char pdProcEventName[PDVSTNAMELEN];
+} pdvstServerSlot;
+
+typedef struct _pdvstServerData
+{
+    int active;
+    int schedulerReady;
+    int heartbeat;
+    int pdProcessId;
+    int channelsPerInstance;  // Pd channels reserved for every instance
+    char patchName[MAXFILENAMELEN];
+    char patchDir[MAXFILENAMELEN];
+    pdvstServerSlot slots[MAXPDINSTANCES];
+} pdvstServerData;
+
+typedef enum _servertraffic
+{
+    SERVERMUTEX,
+    SERVEREVENT
+} servertraffic;
+
 #endif
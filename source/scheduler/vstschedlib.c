@@ -42,8 +42,6 @@
 #define TIMEUNITPERSEC (32.*441000.)
 
 
-FILE *debugFile;
-
 typedef struct _midiqelem
 {
     double q_time;
@@ -59,73 +57,286 @@ typedef struct _midiqelem
 EXTERN t_midiqelem midi_outqueue[MIDIQSIZE];
 EXTERN int midi_outhead;
 int lastmidiouthead=0;
+// q_time of midi_outqueue is logical time since sys_initmidiqueue()
+double midiInitTime;
+double midiTickMs;          // q_time (in ms) where the current tick starts
+
+#ifdef _WIN32
+    typedef HANDLE t_pdvstHandle;
+#else
+    typedef sem_t *t_pdvstHandle;
+#endif
+
+int xxWaitForSingleObject(t_pdvstHandle mutex, int ms);
+int xxReleaseMutex(t_pdvstHandle mutex);
+void xxSetEvent(t_pdvstHandle mutex);
+void xxResetEvent(t_pdvstHandle mutex);
 
-int xxWaitForSingleObject(int mutex, int ms);
-int xxReleaseMutex(int mutex);
-void xxSetEvent(int mutex);
-void xxResetEvent(int mutex);
+struct _pdvstInstance;
 
 typedef struct _vstParameterReceiver
 {
     t_object x_obj;
     t_symbol *x_sym;
+    struct _pdvstInstance *x_instance;
+    int x_index;
 }t_vstParameterReceiver;
 
 typedef struct _vstGuiNameReceiver
 {
     t_object x_obj;
+    struct _pdvstInstance *x_instance;
 }t_vstGuiNameReceiver;
 
-t_vstGuiNameReceiver *vstGuiNameReceiver;
-
 typedef struct _vstChunkReceiver
 {
     t_object x_obj;
+    struct _pdvstInstance *x_instance;
 }t_vstChunkReceiver;
 
-t_vstChunkReceiver *vstChunkReceiver;
+struct _paramLane;
 
-t_vstParameterReceiver *vstParameterReceivers[MAXPARAMETERS];
+/* [vstparam~ N]: parameter N as a signal */
+typedef struct _vstParamTilde
+{
+    t_object x_obj;
+    struct _pdvstInstance *x_instance;  // 0 if not in an instance's patch
+    struct _paramLane *x_lane;
+    int x_index;
+    int x_offset;   // where the next sub-block starts in the lane ([block~] < 64)
+}t_vstParamTilde;
 
 t_class *vstParameterReceiver_class;
 t_class *vstGuiNameReceiver_class;
 t_class *vstChunkReceiver_class;
+t_class *vstParamTilde_class;
+
+/* [vstnote]: the host's note events at full precision */
+typedef struct _vstNote
+{
+    t_object x_obj;
+    t_symbol *x_sym;    // rvstnote of its instance, 0 if none
+}t_vstNote;
+
+t_class *vstNote_class;
+
+/* [vsttime]: the host's time info as one list, on bang or every tick */
+#define VSTTIMEATOMS 14
+
+typedef struct _vstTime
+{
+    t_object x_obj;
+    struct _pdvstInstance *x_instance;  // 0 if not in an instance's patch
+    t_symbol *x_sym;                    // rvsttime of its instance
+    int x_auto;                         // output on every tick
+}t_vstTime;
+
+t_class *vstTime_class;
+
+/* [vstarray name]: the array is saved in the state chunk and restored
+   from it, see sch_chunk_send() */
+typedef struct _vstArray
+{
+    t_object x_obj;
+    struct _pdvstInstance *x_instance;  // 0 if not in an instance's patch
+    t_symbol *x_name;
+    struct _vstArray *x_next;
+}t_vstArray;
+
+t_class *vstArray_class;
+
+/* [sysexout]: SysEx bytes (or whole messages as lists) to the host */
+typedef struct _sysexOut
+{
+    t_object x_obj;
+    struct _pdvstInstance *x_instance;  // 0 if not in an instance's patch
+}t_sysexOut;
+
+t_class *sysexOut_class;
+
+/* the host's automation curve of one parameter for the current tick */
+typedef struct _paramLane
+{
+    int index;
+    int users;              // [vstparam~] objects reading it
+    int pos;                // samples filled in this tick
+    float value;            // value of the last point passed
+    int64_t time;           // time of the last point passed
+    t_sample samples[PDBLKSIZE];
+    struct _paramLane *next;
+} t_paramLane;
+
+/* slots of the coalesced MIDI messages: controllers and poly aftertouch
+   of each channel and note, channel aftertouch and pitch bend of each
+   channel. note events of [vstnote] are hashed by note id and type */
+#define COALESCESLOTS (2 * 16 * 128 + 2 * 16)
+#define NOTECOALESCESLOTS 256
+
+typedef struct _noteSlot
+{
+    int stamp;
+    int noteId;
+    int type;
+} t_noteSlot;
+
+/* one plugin instance: its transfer region, receivers and (shared server) patch */
+typedef struct _pdvstInstance
+{
+    int slot;               // server slot, -1 when Pd runs a single instance
+    char prefix[32];        // receiver name prefix, empty for a single instance
+    t_pdvstHandle mu_tex[3];
+#ifdef _WIN32
+    HANDLE fileMap;
+#else
+    char *fileMap;
+#endif
+    int mapSize;
+    pdvstTransferData *data;
+    pdvstTimeInfo timeInfo; // the host's, from its last buffer
+    double timeSent[6];     // the old vstTimeInfo.* receivers
+    t_symbol *timeSyms[6];
+    t_symbol *timeSym;      // rvsttime
+    // state chunks, see sch_chunk_io()
+    char *chunkIn;          // from the host
+    int chunkInSize;
+    int chunkInCapacity;
+    int chunkInReady;       // complete, rvstdata didn't take it yet
+    char *chunkOut;         // svstdata, to the host
+    int chunkOutSize;
+    int chunkOutSent;
+    int chunkOutRequest;    // data->chunkRequest that chunkOut answers
+    int chunkRequest;       // the last one answered
+    unsigned char *chunkMsgs;  // "MSGS" section of the last svstdata
+    int chunkMsgsSize;
+    // rate limits of the overflow messages in the log
+    pdvstLogLimit paramOutFull;
+    pdvstLogLimit noteInFull;
+    pdvstLogLimit midiInFull;
+    pdvstLogLimit midiOutFull;
+    pdvstLogLimit sysexOutFull;
+    t_atom *restoreAtoms;   // messages of a restored chunk, see sch_chunk_deliver()
+    int restoreSize;
+    int restorePos;
+    int restoring;
+    struct _vstArray *arrays;  // [vstarray] objects, saved in the chunk
+    int nParams;            // parameters of the host, the arrays below have as many
+    t_vstParameterReceiver **parameterReceivers;
+    t_vstGuiNameReceiver *guiNameReceiver;
+    t_vstChunkReceiver *chunkReceiver;
+    t_canvas *canvas;       // shared server: the patch opened for this instance
+    int channelOffset;      // shared server: first Pd channel of this instance
+    int lastInHead;
+    double lastBlockTime;
+    // host automation points waiting for their tick
+    pdvstParamPoint points[MAXPARAMQUEUESIZE];
+    char ramped[MAXPARAMQUEUESIZE];
+    int nPoints;
+    // parameters read by [vstparam~] objects
+    t_paramLane *lanes;
+    // svstparameter values sent since the last tick, the latest one of each
+    float *outValue;
+    char *outPending;
+    int *outList;
+    int nOut;
+    // host midi events waiting for their tick
+    pdvstMidiMessage midiIn[MAXMIDIQUEUESIZE];
+    int nMidiIn;
+    pdvstNoteEvent noteIn[MAXMIDIQUEUESIZE];
+    int nNoteIn;
+    // coalescing: events superseded later in their tick are skipped
+    int coalesceStamp;
+    int coalesceSeen[COALESCESLOTS];
+    t_noteSlot noteSeen[NOTECOALESCESLOTS];
+    char midiSkip[MAXMIDIQUEUESIZE];
+    char noteSkip[MAXMIDIQUEUESIZE];
+    int64_t tickTime;       // blockTime of the tick Pd is running
+    // SysEx Pd is sending, written straight into the arena
+    int sysexState;         // 1 in a message, -1 dropping it, 0 outside
+    uint32_t sysexStart;
+    int sysexSize;
+    int64_t sysexTime;
+} t_pdvstInstance;
+
+t_pdvstInstance *pdvstInstances[MAXPDINSTANCES];
+t_pdvstInstance singleInstance;
 
 #ifdef _WIN32
     char    *pdvstTransferMutexName,
             *pdvstTransferFileMapName,
             *vstProcEventName,
             *pdProcEventName;
-    HANDLE  pdvstTransferFileMap,
-            mu_tex[3],
-            vstHostProcess;
+    HANDLE  vstHostProcess,
+            serverFileMap;
     int     vstHostProcessId;
 #else
     char    *pdvstSharedAddressesMap,
-            *pdvstTransferFileMap,
-            *pdvstSharedAddressesMapName;
+            *pdvstSharedAddressesMapName,
+            *serverFileMap;
     pid_t   vstHostProcessId;
     int     fd;
-    sem_t   *mu_tex[3];
     pdvstSharedAddresses *pdvstShared;
 #endif
 
-pdvstTransferData *pdvstData;
-pdvstTimeInfo  timeInfo;
+// shared Pd server
+char    *serverMapName,
+        *serverMutexName,
+        *serverEventName;
+t_pdvstHandle serverMu_tex[2];
+pdvstServerData *serverData;
+
+EXTERN void pd_doloadbang(void);
+EXTERN t_canvas *canvas_getrootfor(t_canvas *x);
+
+t_pdvstInstance *loadingInstance;  // shared server: instance whose patch is being opened
+
+
+/* a line for the log file of the instance's host (see pdvstLog()), safe
+   to call from the tick */
+void sch_log(t_pdvstInstance *x, int level, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!x || !x->data)
+        return;
+    va_start(ap, fmt);
+    pdvstLogV(&x->data->pdLog, level, fmt, ap);
+    va_end(ap);
+}
+
+/* an error of the instance to the Pd console and to its host's log */
+void sch_error(t_pdvstInstance *x, const char *fmt, ...)
+{
+    char text[PDVSTLOGLINE];
+    va_list ap;
 
+    va_start(ap, fmt);
+    vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    pd_error(NULL, "%s", text);
+    sch_log(x, PDVSTLOGERROR, "%s", text);
+}
 
-void debugLog(char *fmt, ...)
+/* not about one instance: to the log of all of them */
+void debugLog(const char *fmt, ...)
 {
     va_list ap;
+    int k;
 
-    if (debugFile)
+    if (!serverData)
     {
         va_start(ap, fmt);
-        vfprintf(debugFile, fmt, ap);
+        if (singleInstance.data)
+            pdvstLogV(&singleInstance.data->pdLog, PDVSTLOGINFO, fmt, ap);
         va_end(ap);
-        putc('\n', debugFile);
-        fflush(debugFile);
+        return;
     }
+    for (k = 0; k < MAXPDINSTANCES; k++)
+        if (pdvstInstances[k] && pdvstInstances[k]->data)
+        {
+            va_start(ap, fmt);
+            pdvstLogV(&pdvstInstances[k]->data->pdLog, PDVSTLOGINFO, fmt, ap);
+            va_end(ap);
+        }
 }
 
 void pdvst_sleep(int n)
@@ -225,6 +436,24 @@ void parseArgs(int argc, char **argv)
                 argv += 2;
             }
         #endif
+        if (strcmp(*argv, "-servermapname") == 0)
+        {
+            serverMapName = argv[1];
+            argc -= 2;
+            argv += 2;
+        }
+        if (strcmp(*argv, "-servermutexname") == 0)
+        {
+            serverMutexName = argv[1];
+            argc -= 2;
+            argv += 2;
+        }
+        if (strcmp(*argv, "-servereventname") == 0)
+        {
+            serverEventName = argv[1];
+            argc -= 2;
+            argv += 2;
+        }
         else
         {
             argc--;
@@ -233,11 +462,21 @@ void parseArgs(int argc, char **argv)
     }
 }
 
-int setPdvstGuiState(int state)
+
+/* receiver names of an instance: "rvstparameter0" or "3-rvstparameter0" */
+t_symbol *instance_gensym(t_pdvstInstance *x, const char *name)
+{
+    char string[MAXARGSTRLEN];
+
+    sprintf(string, "%s%s", x->prefix, name);
+    return gensym(string);
+}
+
+int setPdvstGuiState(t_pdvstInstance *x, int state)
 {
     t_symbol *tempSym;
 
-    tempSym = gensym("rvstopengui");
+    tempSym = instance_gensym(x, "rvstopengui");
     if (tempSym->s_thing)
     {
         pd_float(tempSym->s_thing, (float)state);
@@ -247,10 +486,10 @@ int setPdvstGuiState(int state)
         return 0;
 }
 
-int setPdvstPlugName(char* instanceName)
+int setPdvstPlugName(t_pdvstInstance *x, char* instanceName)
 {
     t_symbol *tempSym;
-    tempSym = gensym("rvstplugname");
+    tempSym = instance_gensym(x, "rvstplugname");
     if (tempSym->s_thing)
     {
         pd_symbol(tempSym->s_thing, gensym(instanceName));
@@ -260,471 +499,1951 @@ int setPdvstPlugName(char* instanceName)
         return 0;
 }
 
-/*receive data chunk from host*/
-int setPdvstChunk(const char *amsg)
+/* binary state chunk (svstdata / rvstdata), little endian:
+       "PDVB" version(1) flags(1) size(4) payload
+   the payload (size bytes, sch_lz_compress()ed with PDVBCOMPRESSED) is a
+   list of sections, tag(4) length(4) data, unknown ones are skipped.
+   "MSGS": nsym(4) {length(4) bytes} natom(4) {type(1) value}, the type
+   is 'f' (float32), 'd' (float64), 's' (symbol index), ';' or ','.
+   "ARRY": length(4) name, value size(1, 4 or 8), n(4), n values of the
+   [vstarray] of that name. they come before "MSGS", rvstdata finds the
+   arrays restored.
+   chunks without the magic are the text of older versions */
+#define PDVBMAGIC "PDVB"
+#define PDVBVERSION 1
+#define PDVBHEADER 10
+#define PDVBCOMPRESSED 1
+#define PDVBMAXMATCH 131
+#define PDVBHASHBITS 14
+
+typedef struct _sch_bytes
 {
-    t_symbol *tempSym;
-    tempSym = gensym("rvstdata");
+    unsigned char *b;
+    int size;
+    int capacity;
+} t_sch_bytes;
 
-    if (tempSym->s_thing)
+static void sch_bytes_reserve(t_sch_bytes *x, int n)
+{
+    if (x->size + n > x->capacity)
     {
-        size_t len = strlen(amsg);
-        t_binbuf* bbuf = binbuf_new();
-        binbuf_text(bbuf, amsg, len);
-
-        int msg, natom = binbuf_getnatom(bbuf);
-        t_atom *at = binbuf_getvec(bbuf);
-
-        for (msg = 0; msg < natom;) {
-            int emsg;
-            for (emsg = msg; emsg < natom && at[emsg].a_type != A_COMMA
-                && at[emsg].a_type != A_SEMI; emsg++);
-                if (emsg > msg) {
-                    int i;
-                    /* check for illegal atoms */
-                    for (i = msg; i < emsg; i++)
-                        if (at[i].a_type == A_DOLLAR || at[i].a_type == A_DOLLSYM) {
-                        pd_error(NULL, "rvstdata: got dollar sign in message");
-                        goto nodice;
-                    }
-
-                if (at[msg].a_type == A_FLOAT) {
-                    if (emsg > msg + 1)
-                    pd_list(tempSym->s_thing, 0, emsg-msg, at + msg);
-                    else pd_float(tempSym->s_thing, at[msg].a_w.w_float);
-                }
-                else if (at[msg].a_type == A_SYMBOL) {
-                pd_anything(tempSym->s_thing, at[msg].a_w.w_symbol, emsg-msg-1, at + msg + 1);
-                }
-            }
-            nodice:
-            msg = emsg + 1;
-        }
+        int capacity = x->capacity ? x->capacity : 256;
 
-        binbuf_free(bbuf);
-        return 1;
+        while (capacity < x->size + n)
+            capacity *= 2;
+        x->b = (unsigned char *)(x->b ? resizebytes(x->b, x->capacity, capacity) :
+            getbytes(capacity));
+        x->capacity = capacity;
     }
-    else
-    return 0;
 }
 
-
-int setPdvstFloatParameter(int index, float value)
+static void sch_bytes_put(t_sch_bytes *x, const void *data, int n)
 {
-    t_symbol *tempSym;
-    char string[1024];
-
-    sprintf(string, "rvstparameter%d", index);
-    tempSym = gensym(string);
-    if (tempSym->s_thing)
-    {
-        pd_float(tempSym->s_thing, value);
-        return 1;
-    }
-    else
-    {
-        return 0;
-    }
+    sch_bytes_reserve(x, n);
+    memcpy(x->b + x->size, data, n);
+    x->size += n;
 }
 
-void sendPdVstFloatParameter(t_vstParameterReceiver *x, t_float floatValue)
+static void sch_put32(unsigned char *b, uint32_t v)
 {
-    int index;
-
-    index = atoi(x->x_sym->s_name + strlen("svstParameter"));
-    xxWaitForSingleObject(PDVSTTRANSFERMUTEX, -1);
-    pdvstData->vstParameters[index].type = FLOAT_TYPE;
-    pdvstData->vstParameters[index].direction = PD_SEND;
-    pdvstData->vstParameters[index].updated = 1;
-    pdvstData->vstParameters[index].value.floatData = floatValue;
-    xxReleaseMutex(PDVSTTRANSFERMUTEX);
+    b[0] = v; b[1] = v >> 8; b[2] = v >> 16; b[3] = v >> 24;
 }
 
-/*send data chunk to host*/
-void sendPdVstChunk(t_vstChunkReceiver *x, t_symbol *s, int argc, t_atom *argv)
+static void sch_bytes_put32(t_sch_bytes *x, uint32_t v)
 {
-    char *buf;
-    int length;
-    t_atom at;
-    t_binbuf*bbuf = binbuf_new();
-
-    SETSYMBOL(&at, s);
-    binbuf_add(bbuf, 1, &at);
-    binbuf_add(bbuf, argc, argv);
-    binbuf_gettext(bbuf, &buf, &length);
-    binbuf_free(bbuf);
-
-    xxWaitForSingleObject(PDVSTTRANSFERMUTEX, -1);
-    memset(&pdvstData->datachunk.data, '\0', MAXSTRINGSIZE);
-    pdvstData->datachunk.direction = PD_SEND;
-    memcpy(pdvstData->datachunk.data, buf, length);
-    pdvstData->datachunk.size = length;
-    pdvstData->datachunk.updated = 1;
-    xxReleaseMutex(PDVSTTRANSFERMUTEX);
-
-    freebytes(buf, length+1);
-
-
+    unsigned char b[4];
 
+    sch_put32(b, v);
+    sch_bytes_put(x, b, 4);
 }
 
-void sendPdVstGuiName(t_vstGuiNameReceiver *x, t_symbol *symbolValue)
+static uint32_t sch_get32(const unsigned char *b)
 {
-    xxWaitForSingleObject(PDVSTTRANSFERMUTEX, -1);
-    pdvstData->guiName.type = STRING_TYPE;
-    pdvstData->guiName.direction = PD_SEND;
-    pdvstData->guiName.updated = 1;
-    strcpy(pdvstData->guiName.value.stringData,symbolValue->s_name);
-    xxReleaseMutex(PDVSTTRANSFERMUTEX);
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
 }
 
-void makePdvstParameterReceivers()
+/* LZ77 without entropy coding, fast both ways. a control byte below 0x80
+   is followed by that many + 1 literal bytes, from 0x80 it is a match of
+   (c & 0x7f) + 4 bytes at a 16 bit distance back.
+   returns the compressed size or -1 if it would not fit in max */
+static int sch_lz_compress(const unsigned char *in, int n, unsigned char *out, int max)
 {
-    int i;
-    char string[1024];
+    int *table = (int *)getbytes((1 << PDVBHASHBITS) * sizeof(int));
+    int i = 0, lit = 0, o = 0, j;
 
-    for (i = 0; i < MAXPARAMETERS; i++)
+    for (j = 0; j < (1 << PDVBHASHBITS); j++)
+        table[j] = -1;
+    while (i + 4 <= n)
     {
-        vstParameterReceivers[i] = (t_vstParameterReceiver *)pd_new(vstParameterReceiver_class);
-        sprintf(string, "svstparameter%d", i);
-        vstParameterReceivers[i]->x_sym = gensym(string);
-        pd_bind(&vstParameterReceivers[i]->x_obj.ob_pd, gensym(string));
+        uint32_t h = (sch_get32(in + i) * 2654435761u) >> (32 - PDVBHASHBITS);
+        int cand = table[h], len;
+
+        table[h] = i;
+        if (cand < 0 || i - cand > 0xffff || memcmp(in + cand, in + i, 4))
+        {
+            i++;
+            continue;
+        }
+        for (len = 4; i + len < n && len < PDVBMAXMATCH &&
+            in[cand + len] == in[i + len]; len++);
+        while (lit < i)
+        {
+            int run = (i - lit > 128) ? 128 : i - lit;
+            if (o + run + 1 > max)
+                goto full;
+            out[o++] = run - 1;
+            memcpy(out + o, in + lit, run);
+            o += run;
+            lit += run;
+        }
+        if (o + 3 > max)
+            goto full;
+        out[o++] = 0x80 | (len - 4);
+        out[o++] = (i - cand) & 0xff;
+        out[o++] = (i - cand) >> 8;
+        i += len;
+        lit = i;
+    }
+    while (lit < n)
+    {
+        int run = (n - lit > 128) ? 128 : n - lit;
+        if (o + run + 1 > max)
+            goto full;
+        out[o++] = run - 1;
+        memcpy(out + o, in + lit, run);
+        o += run;
+        lit += run;
     }
+    freebytes(table, (1 << PDVBHASHBITS) * sizeof(int));
+    return o;
+full:
+    freebytes(table, (1 << PDVBHASHBITS) * sizeof(int));
+    return -1;
 }
 
-void makePdvstGuiNameReceiver()
+/* returns 0 unless exactly n bytes come out */
+static int sch_lz_decompress(const unsigned char *in, int size, unsigned char *out, int n)
 {
-    vstGuiNameReceiver = (t_vstGuiNameReceiver *)pd_new(vstGuiNameReceiver_class);
-    pd_bind(&vstGuiNameReceiver->x_obj.ob_pd, gensym("guiName"));
-}
+    int i = 0, o = 0;
 
-void makevstChunkReceiver()
-{
-    vstChunkReceiver = (t_vstChunkReceiver *)pd_new(vstChunkReceiver_class);
-    pd_bind(&vstChunkReceiver->x_obj.ob_pd, gensym("svstdata"));
+    while (i < size)
+    {
+        int c = in[i++];
+        if (c < 0x80)
+        {
+            if (i + c + 1 > size || o + c + 1 > n)
+                return 0;
+            memcpy(out + o, in + i, c + 1);
+            i += c + 1;
+            o += c + 1;
+        }
+        else
+        {
+            int len = (c & 0x7f) + 4, dist, j;
+            if (i + 2 > size)
+                return 0;
+            dist = in[i] | (in[i + 1] << 8);
+            i += 2;
+            if (dist == 0 || dist > o || o + len > n)
+                return 0;
+            for (j = 0; j < len; j++, o++)  // may overlap
+                out[o] = out[o - dist];
+        }
+    }
+    return o == n;
 }
 
-void send_dacs(void)
+/* the atoms of a "MSGS" section, 0 if it is damaged */
+static t_atom *sch_chunk_atoms(const unsigned char *p, int size, int *natom)
 {
-    int i, j, sampleCount, nChannelsIn, nChannelsOut, blockSize;
-    t_sample *soundin, *soundout;
+    const unsigned char *end = p + size;
+    t_symbol **syms;
+    t_atom *at;
+    uint32_t nsym, n, i;
 
-    soundin = get_sys_soundin();
-    soundout = get_sys_soundout();
-    nChannelsIn = pdvstData->nChannelsIn;
-    nChannelsOut = pdvstData->nChannelsOut;
-    blockSize = pdvstData->blockSize;
-    if (blockSize == *(get_sys_schedblocksize()))
+    if (size < 4)
+        return 0;
+    nsym = sch_get32(p);
+    p += 4;
+    if (nsym > (uint32_t)size / 4)
+        return 0;
+    syms = (t_symbol **)getbytes((nsym ? nsym : 1) * sizeof(t_symbol *));
+    for (i = 0; i < nsym; i++)
     {
-        sampleCount = 0;
-        for (i = 0; i < nChannelsIn; i++)
+        char buf[MAXPDSTRING];
+        uint32_t len;
+        if (end - p < 4 || (len = sch_get32(p)) > (uint32_t)(end - p - 4))
+            goto damaged;
+        // longer symbols than Pd makes are cut, as binbuf_text() would
+        if (len >= MAXPDSTRING)
         {
-            for (j = 0; j < blockSize; j++)
-            {
-                soundin[sampleCount] = pdvstData->samplesIn[i][j];
-                sampleCount++;
-            }
+            memcpy(buf, p + 4, MAXPDSTRING - 1);
+            buf[MAXPDSTRING - 1] = 0;
+            syms[i] = gensym(buf);
         }
-        sampleCount = 0;
-        for (i = 0; i < nChannelsOut; i++)
+        else
         {
-            for (j = 0; j < blockSize; j++)
-            {
-                pdvstData->samplesOut[i][j] = soundout[sampleCount];
-                soundout[sampleCount] = 0;
-                sampleCount++;
-            }
+            memcpy(buf, p + 4, len);
+            buf[len] = 0;
+            syms[i] = gensym(buf);
+        }
+        p += 4 + len;
+    }
+    if (end - p < 4 || (n = sch_get32(p)) > (uint32_t)(end - p - 4))
+        goto damaged;
+    p += 4;
+    at = (t_atom *)getbytes((n ? n : 1) * sizeof(t_atom));
+    for (i = 0; i < n; i++)
+    {
+        int type;
+        if (p >= end)
+        {
+            freebytes(at, (n ? n : 1) * sizeof(t_atom));
+            goto damaged;
+        }
+        type = *p++;
+        if (type == 'f' && end - p >= 4)
+        {
+            uint32_t v = sch_get32(p);
+            float f;
+            memcpy(&f, &v, 4);
+            SETFLOAT(at + i, f);
+            p += 4;
+        }
+        else if (type == 'd' && end - p >= 8)
+        {
+            uint64_t v = sch_get32(p) | ((uint64_t)sch_get32(p + 4) << 32);
+            double d;
+            memcpy(&d, &v, 8);
+            SETFLOAT(at + i, d);
+            p += 8;
+        }
+        else if (type == 's' && end - p >= 4 && sch_get32(p) < nsym)
+        {
+            SETSYMBOL(at + i, syms[sch_get32(p)]);
+            p += 4;
+        }
+        else if (type == ';')
+            SETSEMI(at + i);
+        else if (type == ',')
+            SETCOMMA(at + i);
+        else
+        {
+            freebytes(at, (n ? n : 1) * sizeof(t_atom));
+            goto damaged;
         }
     }
+    freebytes(syms, (nsym ? nsym : 1) * sizeof(t_symbol *));
+    *natom = n;
+    return at;
+damaged:
+    freebytes(syms, (nsym ? nsym : 1) * sizeof(t_symbol *));
+    return 0;
 }
 
-#if PD_WATCHDOG
-void glob_watchdog(void *dummy);
-
-static void pollwatchdog( void)
+/* the payload of a binary chunk, size bytes after the header. 0 if the
+   chunk is damaged or of a newer version */
+static unsigned char *sch_chunk_payload(t_pdvstInstance *x, const unsigned char *chunk,
+                                         int length, uint32_t *size)
 {
-    static int sched_diddsp, sched_nextpingtime;
-    sched_diddsp++;
-    if (!sys_havegui() && sys_hipriority &&
-        (sched_diddsp - sched_nextpingtime > 0))
+    unsigned char *payload;
+
+    if (chunk[4] > PDVBVERSION)
     {
-        glob_watchdog(0);
-            /* ping every 2 seconds */
-        sched_nextpingtime = sched_diddsp +
-            2 * (int)(STUFF->st_dacsr /(double)STUFF->st_schedblocksize);
+        sch_error(x, "rvstdata: state of a newer pdvst3 (version %d)", chunk[4]);
+        return 0;
     }
+    *size = sch_get32(chunk + 6);
+    if (*size > MAXCHUNKSIZE ||
+        (!(chunk[5] & PDVBCOMPRESSED) && *size != (uint32_t)(length - PDVBHEADER)))
+        goto damaged;
+    payload = (unsigned char *)getbytes(*size ? *size : 1);
+    if (chunk[5] & PDVBCOMPRESSED)
+    {
+        if (!sch_lz_decompress(chunk + PDVBHEADER, length - PDVBHEADER, payload, *size))
+        {
+            freebytes(payload, *size ? *size : 1);
+            goto damaged;
+        }
+    }
+    else
+        memcpy(payload, chunk + PDVBHEADER, *size);
+    return payload;
+damaged:
+    sch_error(x, "rvstdata: damaged state");
+    return 0;
 }
-#else /* ! PD_WATCHDOG */
-static void pollwatchdog( void)
-{
-    /* dummy */
-}
-#endif /* PD_WATCHDOG */
 
-void scheduler_tick( void)
+/* index of s in the symbol table of a chunk, added if new. table holds
+   tableSize (a power of two) symbols, more than there can be */
+static int sch_chunk_symbol(t_symbol **table, int *index, int tableSize,
+                            t_symbol *s, t_sch_bytes *out, int *nsym)
 {
-    send_dacs();
-    sched_tick();
-    sys_pollmidiqueue();
-    sys_pollgui();
-    pollwatchdog();
+    unsigned int h = (unsigned int)(((size_t)s >> 3) * 2654435761u) & (tableSize - 1);
+    int len;
+
+    while (table[h] && table[h] != s)
+        h = (h + 1) & (tableSize - 1);
+    if (table[h])
+        return index[h];
+    table[h] = s;
+    index[h] = (*nsym)++;
+    len = strlen(s->s_name);
+    sch_bytes_put32(out, len);
+    sch_bytes_put(out, s->s_name, len);
+    return index[h];
 }
 
-void sch_general_receivers(void)
+/* the "MSGS" section of a message (s, which may be 0, and argv), kept
+   for the chunks sch_chunk_send() makes until the next one */
+static void sch_chunk_msgs(t_pdvstInstance *x, t_symbol *s, int argc, t_atom *argv)
 {
-    // check for gui?
-    if (pdvstData->guiState.direction == PD_RECEIVE && \
-        pdvstData->guiState.updated)
-    {
-        if(setPdvstGuiState((int)pdvstData->guiState.value.floatData))
-            pdvstData->guiState.updated=0;
-    }
-    // JYG {  check for vstplug instance name
-    if (pdvstData->plugName.direction == PD_RECEIVE && \
-        pdvstData->plugName.updated)
+    t_sch_bytes payload = {0, 0, 0}, atoms = {0, 0, 0};
+    t_symbol **table;
+    int *index;
+    int tableSize = 16, nsym = 0, i;
+
+    while (tableSize < 2 * (argc + 1))
+        tableSize *= 2;
+    table = (t_symbol **)getbytes(tableSize * sizeof(t_symbol *));
+    index = (int *)getbytes(tableSize * sizeof(int));
+    // the symbol table is written as the atoms find new symbols
+    sch_bytes_put(&payload, "MSGS\0\0\0\0\0\0\0\0", 12);
+    sch_bytes_put32(&atoms, argc + (s != 0));
+    for (i = s ? -1 : 0; i < argc; i++)
     {
-         if (setPdvstPlugName((char*)pdvstData->plugName.value.stringData))
-            pdvstData->plugName.updated=0;
+        t_atom *a = (i < 0) ? 0 : argv + i;
+        unsigned char type;
+
+        if (!a || a->a_type == A_SYMBOL)
+        {
+            type = 's';
+            sch_bytes_put(&atoms, &type, 1);
+            sch_bytes_put32(&atoms, sch_chunk_symbol(table, index, tableSize,
+                a ? a->a_w.w_symbol : s, &payload, &nsym));
+        }
+        else if (a->a_type == A_FLOAT)
+        {
+#if PD_FLOATSIZE == 64
+            double d = a->a_w.w_float;
+            uint64_t v;
+            type = 'd';
+            memcpy(&v, &d, 8);
+            sch_bytes_put(&atoms, &type, 1);
+            sch_bytes_put32(&atoms, (uint32_t)v);
+            sch_bytes_put32(&atoms, (uint32_t)(v >> 32));
+#else
+            float f = a->a_w.w_float;
+            uint32_t v;
+            type = 'f';
+            memcpy(&v, &f, 4);
+            sch_bytes_put(&atoms, &type, 1);
+            sch_bytes_put32(&atoms, v);
+#endif
+        }
+        else if (a->a_type == A_SEMI || a->a_type == A_COMMA)
+        {
+            type = (a->a_type == A_SEMI) ? ';' : ',';
+            sch_bytes_put(&atoms, &type, 1);
+        }
+        else
+        {
+            // pointers can't be saved, they are sent back as symbols
+            type = 's';
+            sch_bytes_put(&atoms, &type, 1);
+            sch_bytes_put32(&atoms, sch_chunk_symbol(table, index, tableSize,
+                gensym("pointer"), &payload, &nsym));
+        }
     }
-    // check for data chunk from file
-    if (pdvstData->datachunk.direction == PD_RECEIVE && \
-        pdvstData->datachunk.updated)
+    freebytes(table, tableSize * sizeof(t_symbol *));
+    freebytes(index, tableSize * sizeof(int));
+    sch_bytes_put(&payload, atoms.b, atoms.size);
+    freebytes(atoms.b, atoms.capacity);
+    // section length and symbol count, now that they are known
+    sch_put32(payload.b + 4, payload.size - 8);
+    sch_put32(payload.b + 8, nsym);
+
+    if (x->chunkMsgs)
+        freebytes(x->chunkMsgs, x->chunkMsgsSize);
+    x->chunkMsgs = (unsigned char *)resizebytes(payload.b, payload.capacity, payload.size);
+    x->chunkMsgsSize = payload.size;
+}
+
+/* the same, copied from a chunk of the host */
+static void sch_chunk_keep_msgs(t_pdvstInstance *x, const unsigned char *section, int size)
+{
+    if (x->chunkMsgs)
+        freebytes(x->chunkMsgs, x->chunkMsgsSize);
+    x->chunkMsgs = (unsigned char *)getbytes(8 + size);
+    x->chunkMsgsSize = 8 + size;
+    memcpy(x->chunkMsgs, section - 8, 8 + size);
+}
+
+/* "ARRY" section of a [vstarray], the values copied straight from it */
+static void sch_chunk_put_array(t_pdvstInstance *x, t_sch_bytes *out, t_symbol *name)
+{
+    t_garray *a = (t_garray *)pd_findbyclass(name, garray_class);
+    t_word *vec;
+    unsigned char *p;
+    int n, i, len = strlen(name->s_name);
+
+    if (!a || !garray_getfloatwords(a, &n, &vec))
     {
-         if (setPdvstChunk((char*)pdvstData->datachunk.data))
-            pdvstData->datachunk.updated=0;
+        sch_error(x, "vstarray: %s: no such array", name->s_name);
+        return;
     }
-    // check for vst program name changed
-    if (pdvstData->prognumber2pd.direction == PD_RECEIVE && \
-        pdvstData->prognumber2pd.updated)
+    if (n > (MAXCHUNKSIZE - len - 64) / (int)sizeof(t_float))
     {
-        t_symbol *tempSym;
-        tempSym = gensym("rvstprognumber");
-        if (tempSym->s_thing)
-            pd_float(tempSym->s_thing, (t_float)pdvstData->prognumber2pd.value.floatData);
-        pdvstData->prognumber2pd.updated=0;
+        sch_error(x, "vstarray: %s: too large to save", name->s_name);
+        return;
     }
-    // check for vst program number changed
-    if (pdvstData->progname2pd.direction == PD_RECEIVE && \
-        pdvstData->progname2pd.updated)
+    sch_bytes_put(out, "ARRY", 4);
+    sch_bytes_put32(out, 4 + len + 1 + 4 + n * sizeof(t_float));
+    sch_bytes_put32(out, len);
+    sch_bytes_put(out, name->s_name, len);
+    sch_bytes_reserve(out, 5 + n * sizeof(t_float));
+    p = out->b + out->size;
+    *p++ = sizeof(t_float);
+    sch_put32(p, n);
+    p += 4;
+    for (i = 0; i < n; i++)
     {
-        t_symbol *tempSym;
-        tempSym = gensym("rvstprogname");
-        if (tempSym->s_thing)
-            pd_symbol(tempSym->s_thing, \
-                gensym(pdvstData->progname2pd.value.stringData));
-        pdvstData->progname2pd.updated=0;
+#if PD_FLOATSIZE == 64
+        uint64_t v;
+        memcpy(&v, &vec[i].w_float, 8);
+        sch_put32(p, (uint32_t)v);
+        sch_put32(p + 4, (uint32_t)(v >> 32));
+        p += 8;
+#else
+        uint32_t v;
+        memcpy(&v, &vec[i].w_float, 4);
+        sch_put32(p, v);
+        p += 4;
+#endif
     }
+    out->size = p - out->b;
 }
 
-void sch_playhead_in(void)
+/* restores the array of an "ARRY" section, resized to the saved one.
+   0 if it couldn't */
+static int sch_chunk_array(t_pdvstInstance *x, const unsigned char *p, uint32_t size)
 {
-    // playhead from host -----------
-    if (pdvstData->hostTimeInfo.updated)
+    char name[MAXPDSTRING];
+    uint32_t len, n, i;
+    int valueSize, got;
+    t_garray *a;
+    t_word *vec;
+
+    if (size < 4 || (len = sch_get32(p)) >= MAXPDSTRING || size < 4 + len + 5)
+        goto damaged;
+    memcpy(name, p + 4, len);
+    name[len] = 0;
+    p += 4 + len;
+    valueSize = *p++;
+    n = sch_get32(p);
+    p += 4;
+    if ((valueSize != 4 && valueSize != 8) || n > (size - 9 - len) / valueSize)
+        goto damaged;
+    a = (t_garray *)pd_findbyclass(gensym(name), garray_class);
+    if (!a || !garray_getfloatwords(a, &got, &vec))
     {
-        pdvstData->hostTimeInfo.updated=0;
-        t_symbol *tempSym;
-        if (timeInfo.state!=pdvstData->hostTimeInfo.state)
+        sch_error(x, "vstarray: %s: no such array", name);
+        return 0;
+    }
+    if ((uint32_t)got != n)
+    {
+        garray_resize_long(a, n);
+        if (!garray_getfloatwords(a, &got, &vec) || (uint32_t)got != n)
         {
-            timeInfo.state=pdvstData->hostTimeInfo.state;
-            tempSym = gensym("vstTimeInfo.state");
-            if (tempSym->s_thing)
-            {
-                pd_float(tempSym->s_thing, (float)timeInfo.state);
-            }
-            else
-            {
-                timeInfo.state=0;
-                pdvstData->hostTimeInfo.updated=1;  // keep flag as updated
-            }
+            sch_error(x, "vstarray: %s: can't resize to %u", name, n);
+            return 0;
         }
-        if (timeInfo.tempo!=pdvstData->hostTimeInfo.tempo)
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (valueSize == 4)
         {
-            timeInfo.tempo=pdvstData->hostTimeInfo.tempo;
-            tempSym = gensym("vstTimeInfo.tempo");
-            if (tempSym->s_thing)
-            {
-                pd_float(tempSym->s_thing, (float)timeInfo.tempo);
-            }
-            else
+            uint32_t v = sch_get32(p);
+            float f;
+            memcpy(&f, &v, 4);
+            vec[i].w_float = f;
+        }
+        else
+        {
+            uint64_t v = sch_get32(p) | ((uint64_t)sch_get32(p + 4) << 32);
+            double d;
+            memcpy(&d, &v, 8);
+            vec[i].w_float = d;
+        }
+        p += valueSize;
+    }
+    garray_redraw(a);
+    return 1;
+damaged:
+    sch_error(x, "rvstdata: damaged state");
+    return 0;
+}
+
+/* a new chunk for the host: the arrays of the [vstarray] objects as they
+   are now and the last svstdata. sch_chunk_io() sends it in segments */
+static void sch_chunk_send(t_pdvstInstance *x)
+{
+    t_sch_bytes payload = {0, 0, 0};
+    t_vstArray *array, *other;
+    int compressed = -1, i;
+    unsigned char *buf;
+
+    for (array = x->arrays; array; array = array->x_next)
+    {
+        for (other = x->arrays; other != array && other->x_name != array->x_name;
+            other = other->x_next);
+        if (other == array && array->x_name != &s_)
+            sch_chunk_put_array(x, &payload, array->x_name);
+    }
+    if (x->chunkMsgs)
+        sch_bytes_put(&payload, x->chunkMsgs, x->chunkMsgsSize);
+
+    buf = (unsigned char *)getbytes(PDVBHEADER + payload.size + 1);
+    if (x->data->chunkCompress && payload.size > 1)
+        compressed = sch_lz_compress(payload.b, payload.size, buf + PDVBHEADER,
+            payload.size - 1);
+    memcpy(buf, PDVBMAGIC, 4);
+    buf[4] = PDVBVERSION;
+    buf[5] = (compressed >= 0) ? PDVBCOMPRESSED : 0;
+    sch_put32(buf + 6, payload.size);
+    if (compressed < 0 && payload.size)
+        memcpy(buf + PDVBHEADER, payload.b, payload.size);
+    if (payload.b)
+        freebytes(payload.b, payload.capacity);
+
+    // a chunk still being sent is replaced, the host starts over
+    if (x->chunkOut)
+        freebytes(x->chunkOut, x->chunkOutSize + 1);
+    i = PDVBHEADER + payload.size + 1;
+    x->chunkOutSize = PDVBHEADER + ((compressed >= 0) ? compressed : payload.size);
+    // the rest of buf is not sent, freeing takes the size it was given
+    x->chunkOut = (char *)resizebytes(buf, i, x->chunkOutSize + 1);
+    x->chunkOutSent = 0;
+    x->chunkOutRequest = x->chunkRequest;
+}
+
+/* the atoms of a restored chunk, rvstdata gets them from sch_chunk_deliver().
+   at = 0 only drops the ones still waiting */
+static void sch_chunk_restore(t_pdvstInstance *x, t_atom *at, int natom)
+{
+    if (x->restoreAtoms)
+        freebytes(x->restoreAtoms, (x->restoreSize ? x->restoreSize : 1) * sizeof(t_atom));
+    x->restoreAtoms = at;
+    x->restoreSize = natom;
+    x->restorePos = 0;
+    x->restoring = (at != 0);
+}
+
+/* the messages of the chunk being restored, one by one like a message box,
+   until the budget of this tick (data->restoreMessages messages and
+   data->restoreMicroseconds, 0 for no limit) is used up. at least one goes
+   on every call. rvstdata_done gets a bang after the last one */
+static void sch_chunk_deliver(t_pdvstInstance *x)
+{
+    t_symbol *dest, *done;
+    t_atom *at = x->restoreAtoms;
+    int natom = x->restoreSize, msg = x->restorePos, sent = 0;
+    int maxMessages = x->data->restoreMessages;
+    int maxMicroseconds = x->data->restoreMicroseconds;
+    double start;
+
+    if (!x->restoring)
+        return;
+    dest = instance_gensym(x, "rvstdata");
+    start = sys_getrealtime();
+    while (msg < natom)
+    {
+        int emsg;
+        if (sent > 0 && ((maxMessages > 0 && sent >= maxMessages) || (maxMicroseconds > 0 &&
+            (sys_getrealtime() - start) * 1000000. >= maxMicroseconds)))
+            break;
+        for (emsg = msg; emsg < natom && at[emsg].a_type != A_COMMA
+            && at[emsg].a_type != A_SEMI; emsg++);
+        if (emsg > msg)
+        {
+            int i;
+            sent++;
+            // check for illegal atoms
+            for (i = msg; i < emsg; i++)
+                if (at[i].a_type == A_DOLLAR || at[i].a_type == A_DOLLSYM)
+                    break;
+            if (i < emsg)
+                sch_error(x, "rvstdata: got dollar sign in message");
+            else if (dest->s_thing && at[msg].a_type == A_FLOAT)
             {
-                timeInfo.tempo=0;
-                pdvstData->hostTimeInfo.updated=1;  // keep flag as updated
+                if (emsg > msg + 1)
+                    pd_list(dest->s_thing, 0, emsg - msg, at + msg);
+                else
+                    pd_float(dest->s_thing, at[msg].a_w.w_float);
             }
+            else if (dest->s_thing && at[msg].a_type == A_SYMBOL)
+                pd_anything(dest->s_thing, at[msg].a_w.w_symbol, emsg - msg - 1, at + msg + 1);
         }
-        if (timeInfo.projectTimeMusic!=pdvstData->hostTimeInfo.projectTimeMusic)
+        msg = emsg + 1;
+        // a message may have restored another chunk
+        if (x->restoreAtoms != at)
+            return;
+    }
+    x->restorePos = msg;
+    if (msg < natom)
+        return;
+    sch_chunk_restore(x, 0, 0);
+    x->restoring = 0;
+    done = instance_gensym(x, "rvstdata_done");
+    if (done->s_thing)
+        pd_bang(done->s_thing);
+}
+
+/*receive data chunk from host*/
+int setPdvstChunk(t_pdvstInstance *x, const char *amsg, int length)
+{
+    t_symbol *tempSym;
+    tempSym = instance_gensym(x, "rvstdata");
+
+    // the arrays of [vstarray] are restored even if nothing gets rvstdata
+    if (tempSym->s_thing || x->arrays)
+    {
+        const unsigned char *chunk = (const unsigned char *)amsg;
+
+        // messages of an older chunk that are still waiting are dropped
+        sch_chunk_restore(x, 0, 0);
+
+        if (length >= PDVBHEADER && !memcmp(chunk, PDVBMAGIC, 4))
         {
-            timeInfo.projectTimeMusic=pdvstData->hostTimeInfo.projectTimeMusic;
-            tempSym = gensym("vstTimeInfo.projectTimeMusic");
-            if (tempSym->s_thing)
+            uint32_t size, pos = 0;
+            unsigned char *payload = sch_chunk_payload(x, chunk, length, &size);
+            int restored = 0, failed = !payload;
+
+            while (payload && size - pos >= 8)
             {
-                pd_float(tempSym->s_thing, (float)timeInfo.projectTimeMusic);
+                uint32_t sectionSize = sch_get32(payload + pos + 4);
+                const unsigned char *section = payload + pos + 8;
+
+                if (sectionSize > size - pos - 8)
+                {
+                    sch_error(x, "rvstdata: damaged state");
+                    failed = 1;
+                    break;
+                }
+                if (!memcmp(payload + pos, "ARRY", 4))
+                {
+                    if (sch_chunk_array(x, section, sectionSize))
+                        restored = 1;
+                    else
+                        failed = 1;
+                }
+                else if (!memcmp(payload + pos, "MSGS", 4))
+                {
+                    int natom;
+                    t_atom *at = sch_chunk_atoms(section, sectionSize, &natom);
+                    if (at)
+                    {
+                        sch_chunk_restore(x, at, natom);
+                        restored = 1;
+                    }
+                    else
+                    {
+                        sch_error(x, "rvstdata: damaged state");
+                        failed = 1;
+                    }
+                    sch_chunk_keep_msgs(x, section, sectionSize);
+                }
+                pos += 8 + sectionSize;
             }
+            if (payload)
+                freebytes(payload, size ? size : 1);
+            // rvstdata_done only for a state that was (at least partly)
+            // restored, or that is intact and just empty
+            if (restored || !failed)
+                x->restoring = 1;
             else
+                sch_error(x, "rvstdata: nothing restored, no rvstdata_done");
+        }
+        else
+        {
+            t_binbuf* bbuf = binbuf_new();
+            binbuf_text(bbuf, amsg, strlen(amsg));
+            int natom = binbuf_getnatom(bbuf);
+            t_atom *at = (t_atom *)getbytes((natom ? natom : 1) * sizeof(t_atom));
+
+            memcpy(at, binbuf_getvec(bbuf), natom * sizeof(t_atom));
+            sch_chunk_msgs(x, 0, natom, at);
+            sch_chunk_restore(x, at, natom);
+            binbuf_free(bbuf);
+        }
+        return 1;
+    }
+    else
+    return 0;
+}
+
+
+int setPdvstFloatParameter(t_pdvstInstance *x, int index, float value)
+{
+    t_symbol *tempSym;
+    char string[1024];
+
+    sprintf(string, "rvstparameter%d", index);
+    tempSym = instance_gensym(x, string);
+    if (tempSym->s_thing)
+    {
+        pd_float(tempSym->s_thing, value);
+        return 1;
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+/* "value ramp-time delay" in ms for [vline~] */
+int setPdvstParameterRamp(t_pdvstInstance *x, int index, float value, float ramp, float delay)
+{
+    t_symbol *tempSym;
+    char string[1024];
+    t_atom at[3];
+
+    sprintf(string, "rvstramp%d", index);
+    tempSym = instance_gensym(x, string);
+    if (tempSym->s_thing)
+    {
+        SETFLOAT(&at[0], value);
+        SETFLOAT(&at[1], ramp);
+        SETFLOAT(&at[2], delay);
+        pd_list(tempSym->s_thing, &s_list, 3, at);
+        return 1;
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+/* kept until the end of the tick, a slider drag sends only its last value */
+void sendPdVstFloatParameter(t_vstParameterReceiver *x, t_float floatValue)
+{
+    t_pdvstInstance *y = x->x_instance;
+    int index = x->x_index;
+
+    if (!y->outPending[index])
+    {
+        y->outPending[index] = 1;
+        y->outList[y->nOut++] = index;
+    }
+    y->outValue[index] = floatValue;
+}
+
+/* hand the parameter changes of the tick at blockTime to the host. what
+   doesn't fit in the queue waits for the next tick */
+void sch_param_out(t_pdvstInstance *x, int64_t blockTime)
+{
+    pdvstTransferData *pdvstData = x->data;
+    int head = pdvstData->paramOutHead, i, n = 0;
+
+    for (i = 0; i < x->nOut; i++)
+    {
+        int index = x->outList[i];
+        if ((head + 1) % MAXPARAMQUEUESIZE == pdvstData->paramOutTail)
+        {
+            pdvstLogRated(&pdvstData->pdLog, &x->paramOutFull, PDVSTLOGINFO,
+                "parameters to the host: queue full, sent on a later tick");
+            x->outList[n++] = index;
+            continue;
+        }
+        pdvstData->paramOut[head].index = index;
+        pdvstData->paramOut[head].value = x->outValue[index];
+        pdvstData->paramOut[head].time = blockTime;
+        pdvstData->paramOut[head].start = blockTime;
+        head = (head + 1) % MAXPARAMQUEUESIZE;
+        x->outPending[index] = 0;
+    }
+    x->nOut = n;
+    PDVST_BARRIER();
+    pdvstData->paramOutHead = head;
+}
+
+/*send data chunk to host: kept here, sch_chunk_io() sends it in segments*/
+void sendPdVstChunk(t_vstChunkReceiver *x, t_symbol *s, int argc, t_atom *argv)
+{
+    sch_chunk_msgs(x->x_instance, s, argc, argv);
+    sch_chunk_send(x->x_instance);
+}
+
+void sendPdVstGuiName(t_vstGuiNameReceiver *x, t_symbol *symbolValue)
+{
+    pdvstTransferData *pdvstData = x->x_instance->data;
+
+    xxWaitForSingleObject(x->x_instance->mu_tex[PDVSTTRANSFERMUTEX], -1);
+    pdvstData->guiName.type = STRING_TYPE;
+    pdvstData->guiName.direction = PD_SEND;
+    pdvstData->guiName.updated = 1;
+    strcpy(pdvstData->guiName.value.stringData,symbolValue->s_name);
+    xxReleaseMutex(x->x_instance->mu_tex[PDVSTTRANSFERMUTEX]);
+}
+
+/* one receiver for each of the host's parameters */
+void makePdvstParameterReceivers(t_pdvstInstance *x)
+{
+    int i, n = x->data->nParameters;
+    char string[1024];
+
+    x->nParams = (n < 0) ? 0 : (n > MAXPARAMETERS) ? MAXPARAMETERS : n;
+    x->parameterReceivers = (t_vstParameterReceiver **)getbytes(x->nParams *
+                                                sizeof(t_vstParameterReceiver *));
+    x->outValue = (float *)getbytes(x->nParams * sizeof(float));
+    x->outPending = (char *)getbytes(x->nParams * sizeof(char));
+    x->outList = (int *)getbytes(x->nParams * sizeof(int));
+    x->nOut = 0;
+    for (i = 0; i < x->nParams; i++)
+    {
+        x->parameterReceivers[i] = (t_vstParameterReceiver *)pd_new(vstParameterReceiver_class);
+        sprintf(string, "svstparameter%d", i);
+        x->parameterReceivers[i]->x_sym = instance_gensym(x, string);
+        x->parameterReceivers[i]->x_instance = x;
+        x->parameterReceivers[i]->x_index = i;
+        pd_bind(&x->parameterReceivers[i]->x_obj.ob_pd, x->parameterReceivers[i]->x_sym);
+    }
+}
+
+void makePdvstGuiNameReceiver(t_pdvstInstance *x)
+{
+    x->guiNameReceiver = (t_vstGuiNameReceiver *)pd_new(vstGuiNameReceiver_class);
+    x->guiNameReceiver->x_instance = x;
+    pd_bind(&x->guiNameReceiver->x_obj.ob_pd, instance_gensym(x, "guiName"));
+}
+
+void makevstChunkReceiver(t_pdvstInstance *x)
+{
+    x->chunkReceiver = (t_vstChunkReceiver *)pd_new(vstChunkReceiver_class);
+    x->chunkReceiver->x_instance = x;
+    pd_bind(&x->chunkReceiver->x_obj.ob_pd, instance_gensym(x, "svstdata"));
+}
+
+void freeReceivers(t_pdvstInstance *x)
+{
+    int i;
+
+    for (i = 0; i < x->nParams; i++)
+    {
+        pd_unbind(&x->parameterReceivers[i]->x_obj.ob_pd, x->parameterReceivers[i]->x_sym);
+        pd_free(&x->parameterReceivers[i]->x_obj.ob_pd);
+    }
+    freebytes(x->parameterReceivers, x->nParams * sizeof(t_vstParameterReceiver *));
+    freebytes(x->outValue, x->nParams * sizeof(float));
+    freebytes(x->outPending, x->nParams * sizeof(char));
+    freebytes(x->outList, x->nParams * sizeof(int));
+    x->nParams = 0;
+    pd_unbind(&x->guiNameReceiver->x_obj.ob_pd, instance_gensym(x, "guiName"));
+    pd_free(&x->guiNameReceiver->x_obj.ob_pd);
+    pd_unbind(&x->chunkReceiver->x_obj.ob_pd, instance_gensym(x, "svstdata"));
+    pd_free(&x->chunkReceiver->x_obj.ob_pd);
+    if (x->chunkIn)
+        freebytes(x->chunkIn, x->chunkInCapacity);
+    if (x->chunkOut)
+        freebytes(x->chunkOut, x->chunkOutSize + 1);
+    if (x->chunkMsgs)
+        freebytes(x->chunkMsgs, x->chunkMsgsSize);
+    sch_chunk_restore(x, 0, 0);
+    x->restoring = 0;
+    x->chunkIn = x->chunkOut = 0;
+    x->chunkMsgs = 0;
+}
+
+void send_dacs(t_pdvstInstance *x)
+{
+    int i, j, sampleCount, nChannelsIn, nChannelsOut, blockSize;
+    t_sample *soundin, *soundout;
+    pdvstTransferData *pdvstData = x->data;
+
+    soundin = get_sys_soundin();
+    soundout = get_sys_soundout();
+    nChannelsIn = pdvstData->nChannelsIn;
+    nChannelsOut = pdvstData->nChannelsOut;
+    blockSize = pdvstData->blockSize;
+    if (blockSize == *(get_sys_schedblocksize()))
+    {
+        sampleCount = 0;
+        for (i = 0; i < nChannelsIn; i++)
+        {
+            for (j = 0; j < blockSize; j++)
             {
-                timeInfo.projectTimeMusic=0;
-                pdvstData->hostTimeInfo.updated=1;  // keep flag as updated
+                soundin[sampleCount] = pdvstData->samplesIn[i][j];
+                sampleCount++;
             }
         }
-        if (timeInfo.barPositionMusic!=pdvstData->hostTimeInfo.barPositionMusic)
+        sampleCount = 0;
+        for (i = 0; i < nChannelsOut; i++)
         {
-            timeInfo.barPositionMusic=pdvstData->hostTimeInfo.barPositionMusic;
-            tempSym = gensym("vstTimeInfo.barPositionMusic");
-            if (tempSym->s_thing)
+            for (j = 0; j < blockSize; j++)
             {
-                pd_float(tempSym->s_thing, (float)timeInfo.barPositionMusic);
+                pdvstData->samplesOut[i][j] = soundout[sampleCount];
+                soundout[sampleCount] = 0;
+                sampleCount++;
             }
-            else
+        }
+    }
+}
+
+#if PD_WATCHDOG
+void glob_watchdog(void *dummy);
+
+static void pollwatchdog( void)
+{
+    static int sched_diddsp, sched_nextpingtime;
+    sched_diddsp++;
+    if (!sys_havegui() && sys_hipriority &&
+        (sched_diddsp - sched_nextpingtime > 0))
+    {
+        glob_watchdog(0);
+            /* ping every 2 seconds */
+        sched_nextpingtime = sched_diddsp +
+            2 * (int)(STUFF->st_dacsr /(double)STUFF->st_schedblocksize);
+    }
+}
+#else /* ! PD_WATCHDOG */
+static void pollwatchdog( void)
+{
+    /* dummy */
+}
+#endif /* PD_WATCHDOG */
+
+void pd_poll( void)
+{
+    sys_pollmidiqueue();
+    sys_pollgui();
+    pollwatchdog();
+}
+
+void pd_tick( void)
+{
+    sched_tick();
+    pd_poll();
+}
+
+void scheduler_tick(t_pdvstInstance *x)
+{
+    send_dacs(x);
+    pdvstTrace(x->data, PDVSTTRACEPD, PDVSTTRACETICKBEGIN, (int32_t)x->tickTime);
+    sched_tick();
+    pdvstTrace(x->data, PDVSTTRACEPD, PDVSTTRACETICKEND, (int32_t)x->tickTime);
+    pd_poll();
+}
+
+/* one segment of state chunk each way: the one the host is sending, put
+   together in chunkIn and given to rvstdata once complete (again on the
+   next calls until rvstdata exists), and the next one of svstdata */
+void sch_chunk_io(t_pdvstInstance *x)
+{
+    pdvstChunkStream *stream = &x->data->chunkIn;
+    int size;
+
+    if (stream->full)
+    {
+        PDVST_BARRIER();
+        if (stream->offset == 0)
+        {
+            if (x->chunkIn)
+                freebytes(x->chunkIn, x->chunkInCapacity);
+            x->chunkInCapacity = (stream->total >= 0) ? stream->total + 1 : 1;
+            x->chunkIn = (char *)getbytes(x->chunkInCapacity);
+            x->chunkInSize = 0;
+            x->chunkInReady = 0;
+        }
+        if (x->chunkIn && stream->offset == x->chunkInSize &&
+            stream->size >= 0 && stream->offset + stream->size < x->chunkInCapacity)
+        {
+            memcpy(x->chunkIn + stream->offset, stream->data, stream->size);
+            x->chunkInSize += stream->size;
+            if (x->chunkInSize == stream->total)
             {
-                timeInfo.barPositionMusic=0;
-                pdvstData->hostTimeInfo.updated=1;  // keep flag as updated
+                x->chunkIn[x->chunkInSize] = 0;
+                x->chunkInReady = 1;
             }
         }
-        if (timeInfo.timeSigNumerator!=pdvstData->hostTimeInfo.timeSigNumerator)
+        PDVST_BARRIER();
+        stream->full = 0;
+    }
+    if (x->chunkInReady && setPdvstChunk(x, x->chunkIn, x->chunkInSize))
+    {
+        freebytes(x->chunkIn, x->chunkInCapacity);
+        x->chunkIn = 0;
+        x->chunkInReady = 0;
+    }
+    sch_chunk_deliver(x);
+    // getState wants the [vstarray] arrays as they are now, once the
+    // host's own chunk is in
+    x->data->chunkOnRequest = (x->arrays != 0);
+    if (x->arrays && x->data->chunkRequest != x->chunkRequest && !x->chunkIn)
+    {
+        x->chunkRequest = x->data->chunkRequest;
+        sch_chunk_send(x);
+    }
+
+    stream = &x->data->chunkOut;
+    if (x->chunkOut && !stream->full)
+    {
+        size = x->chunkOutSize - x->chunkOutSent;
+        if (size > CHUNKSEGMENTSIZE)
+            size = CHUNKSEGMENTSIZE;
+        memcpy(stream->data, x->chunkOut + x->chunkOutSent, size);
+        stream->total = x->chunkOutSize;
+        stream->offset = x->chunkOutSent;
+        stream->size = size;
+        stream->request = x->chunkOutRequest;
+        PDVST_BARRIER();
+        stream->full = 1;
+        x->chunkOutSent += size;
+        if (x->chunkOutSent >= x->chunkOutSize)
+        {
+            freebytes(x->chunkOut, x->chunkOutSize + 1);
+            x->chunkOut = 0;
+        }
+    }
+}
+
+void sch_general_receivers(t_pdvstInstance *x)
+{
+    pdvstTransferData *pdvstData = x->data;
+
+    // check for gui?
+    if (pdvstData->guiState.direction == PD_RECEIVE && \
+        pdvstData->guiState.updated)
+    {
+        if(setPdvstGuiState(x, (int)pdvstData->guiState.value.floatData))
+            pdvstData->guiState.updated=0;
+    }
+    // JYG {  check for vstplug instance name
+    if (pdvstData->plugName.direction == PD_RECEIVE && \
+        pdvstData->plugName.updated)
+    {
+         if (setPdvstPlugName(x, (char*)pdvstData->plugName.value.stringData))
+            pdvstData->plugName.updated=0;
+    }
+    // check for data chunk from file
+    sch_chunk_io(x);
+    // check for vst program name changed
+    if (pdvstData->prognumber2pd.direction == PD_RECEIVE && \
+        pdvstData->prognumber2pd.updated)
+    {
+        t_symbol *tempSym;
+        tempSym = instance_gensym(x, "rvstprognumber");
+        if (tempSym->s_thing)
+            pd_float(tempSym->s_thing, (t_float)pdvstData->prognumber2pd.value.floatData);
+        pdvstData->prognumber2pd.updated=0;
+    }
+    // check for vst program number changed
+    if (pdvstData->progname2pd.direction == PD_RECEIVE && \
+        pdvstData->progname2pd.updated)
+    {
+        t_symbol *tempSym;
+        tempSym = instance_gensym(x, "rvstprogname");
+        if (tempSym->s_thing)
+            pd_symbol(tempSym->s_thing, \
+                gensym(pdvstData->progname2pd.value.stringData));
+        pdvstData->progname2pd.updated=0;
+    }
+}
+
+/* the host's time info of the last buffer, and the old vstTimeInfo.*
+   receivers when their field changed */
+void sch_playhead_in(t_pdvstInstance *x)
+{
+    static const char *names[] = {"vstTimeInfo.state", "vstTimeInfo.tempo",
+        "vstTimeInfo.projectTimeMusic", "vstTimeInfo.barPositionMusic",
+        "vstTimeInfo.timeSigNumerator", "vstTimeInfo.timeSigDenominator"};
+    pdvstTransferData *pdvstData = x->data;
+    pdvstTimeInfo *timeInfo = &x->timeInfo;
+    double values[6];
+    int i;
+
+    if (!pdvstData->hostTimeInfo.updated)
+        return;
+    pdvstData->hostTimeInfo.updated = 0;
+    *timeInfo = pdvstData->hostTimeInfo;
+    values[0] = timeInfo->state;
+    values[1] = timeInfo->tempo;
+    values[2] = timeInfo->projectTimeMusic;
+    values[3] = timeInfo->barPositionMusic;
+    values[4] = timeInfo->timeSigNumerator;
+    values[5] = timeInfo->timeSigDenominator;
+    for (i = 0; i < 6; i++)
+    {
+        if (!x->timeSyms[i])
+            x->timeSyms[i] = instance_gensym(x, names[i]);
+        if (values[i] != x->timeSent[i] && x->timeSyms[i]->s_thing)
         {
-            timeInfo.timeSigNumerator=pdvstData->hostTimeInfo.timeSigNumerator;
-            tempSym = gensym("vstTimeInfo.timeSigNumerator");
-            if (tempSym->s_thing)
+            x->timeSent[i] = values[i];
+            pd_float(x->timeSyms[i]->s_thing, (float)values[i]);
+        }
+    }
+}
+
+/* the host's time info moved on to the tick Pd is running: the host gives
+   it once per buffer, Pd runs many ticks per buffer. positions go on at
+   the host's tempo and jump back at the end of an active cycle */
+void sch_time_at_tick(t_pdvstInstance *x, pdvstTimeInfo *t)
+{
+    int playing, cycle;
+    double sr, offset, quarters, cycleLength, barLength;
+
+    *t = x->timeInfo;
+    // ProcessContext flags, see pdvstTimeInfo
+    playing = (t->state & (1 << 1));
+    cycle = (t->state & (1 << 2)) && (t->state & (1 << 12));
+    sr = (t->sampleRate > 0) ? t->sampleRate : sys_getsr();
+    // without host blocks (free running) Pd's ticks aren't on the host's clock
+    if (!x->data->syncToVst || !sr)
+        return;
+    offset = (double)(x->tickTime - t->time);
+    t->time = x->tickTime;
+    if (t->state & (1 << 8))
+        t->systemTime += (int64_t)(offset / sr * 1000000000.);
+    if (!playing)
+        return;
+    t->projectTimeSamples += (int64_t)offset;
+    t->continousTimeSamples += (int64_t)offset;
+    if (!(t->state & (1 << 10)) || t->tempo <= 0)
+        return;
+    quarters = offset / sr * t->tempo / 60.;
+    if (t->state & (1 << 15))
+    {
+        double clock = sr * 60. / (t->tempo * 24.);  // samples between MIDI clocks
+        double next = fmod(t->samplesToNextClock - offset, clock);
+
+        if (next < -clock / 2)
+            next += clock;
+        else if (next > clock / 2)
+            next -= clock;
+        t->samplesToNextClock = (int32_t)next;
+    }
+    t->projectTimeMusic += quarters;
+    cycleLength = t->cycleEndMusic - t->cycleStartMusic;
+    if (cycle && cycleLength > 0 && offset > 0 &&
+        x->timeInfo.projectTimeMusic < t->cycleEndMusic &&
+        t->projectTimeMusic >= t->cycleEndMusic)
+    {
+        double wraps = floor((t->projectTimeMusic - t->cycleStartMusic) / cycleLength);
+
+        t->projectTimeMusic -= wraps * cycleLength;
+        t->projectTimeSamples -= (int64_t)(wraps * cycleLength * 60. / t->tempo * sr);
+    }
+    // the bar the position is in now
+    if ((t->state & (1 << 11)) && (t->state & (1 << 13)) && t->timeSigDenominator > 0)
+    {
+        barLength = 4. * t->timeSigNumerator / t->timeSigDenominator;
+        if (barLength > 0)
+            t->barPositionMusic += barLength *
+                floor((t->projectTimeMusic - t->barPositionMusic) / barLength);
+    }
+}
+
+/* the list [vsttime] outputs, VSTTIMEATOMS atoms */
+int sch_time_list(t_pdvstInstance *x, t_atom *at)
+{
+    pdvstTimeInfo tick;
+    pdvstTimeInfo *timeInfo = &tick;
+
+    sch_time_at_tick(x, timeInfo);
+
+    SETFLOAT(&at[0], timeInfo->state);
+    SETFLOAT(&at[1], timeInfo->tempo);
+    SETFLOAT(&at[2], timeInfo->projectTimeMusic);
+    SETFLOAT(&at[3], timeInfo->barPositionMusic);
+    SETFLOAT(&at[4], timeInfo->cycleStartMusic);
+    SETFLOAT(&at[5], timeInfo->cycleEndMusic);
+    SETFLOAT(&at[6], timeInfo->timeSigNumerator);
+    SETFLOAT(&at[7], timeInfo->timeSigDenominator);
+    SETFLOAT(&at[8], timeInfo->projectTimeSamples);
+    SETFLOAT(&at[9], timeInfo->continousTimeSamples);
+    SETFLOAT(&at[10], timeInfo->systemTime / 1000000.);
+    SETFLOAT(&at[11], timeInfo->samplesToNextClock);
+    SETFLOAT(&at[12], timeInfo->smpteOffsetSubframes);
+    SETFLOAT(&at[13], timeInfo->frameRate);
+    return VSTTIMEATOMS;
+}
+
+/* [vsttime] objects that output on every tick get it here */
+void sch_playhead_tick(t_pdvstInstance *x)
+{
+    if (!x->timeSym)
+        x->timeSym = instance_gensym(x, "rvsttime");
+    if (x->timeSym->s_thing)
+        pd_typedmess(x->timeSym->s_thing, gensym("tick"), 0, 0);
+}
+
+t_pdvstInstance *sch_instance_for(t_canvas *canvas);
+
+void *vsttime_new(t_floatarg f)
+{
+    t_vstTime *x = (t_vstTime *)pd_new(vstTime_class);
+
+    x->x_instance = sch_instance_for(canvas_getcurrent());
+    x->x_sym = x->x_instance ? instance_gensym(x->x_instance, "rvsttime") : 0;
+    x->x_auto = (f != 0);
+    if (x->x_sym)
+        pd_bind(&x->x_obj.ob_pd, x->x_sym);
+    outlet_new(&x->x_obj, &s_list);
+    return x;
+}
+
+void vsttime_free(t_vstTime *x)
+{
+    if (x->x_sym)
+        pd_unbind(&x->x_obj.ob_pd, x->x_sym);
+}
+
+void *vstarray_new(t_symbol *s)
+{
+    t_vstArray *x = (t_vstArray *)pd_new(vstArray_class);
+
+    x->x_instance = sch_instance_for(canvas_getcurrent());
+    x->x_name = s;
+    if (x->x_instance)
+    {
+        x->x_next = x->x_instance->arrays;
+        x->x_instance->arrays = x;
+    }
+    return x;
+}
+
+void vstarray_free(t_vstArray *x)
+{
+    t_vstArray **p;
+
+    if (x->x_instance)
+        for (p = &x->x_instance->arrays; *p; p = &(*p)->x_next)
+            if (*p == x)
             {
-                pd_float(tempSym->s_thing, (float)timeInfo.timeSigNumerator);
+                *p = x->x_next;
+                break;
             }
+}
+
+void vstarray_set(t_vstArray *x, t_symbol *s)
+{
+    x->x_name = s;
+}
+
+/* save to the host now, not only when it asks for the state */
+void vstarray_bang(t_vstArray *x)
+{
+    if (x->x_instance)
+        sch_chunk_send(x->x_instance);
+}
+
+void vsttime_bang(t_vstTime *x)
+{
+    t_atom at[VSTTIMEATOMS];
+
+    if (x->x_instance)
+        outlet_list(x->x_obj.ob_outlet, &s_list, sch_time_list(x->x_instance, at), at);
+}
+
+void vsttime_auto(t_vstTime *x, t_floatarg f)
+{
+    x->x_auto = (f != 0);
+}
+
+void vsttime_tick(t_vstTime *x)
+{
+    if (x->x_auto)
+        vsttime_bang(x);
+}
+
+/* midi from the host goes to the instance's own port (0 for a single instance) */
+/* one host midi event to Pd's midi input */
+void sch_midi_dispatch(t_pdvstInstance *x, pdvstMidiMessage *m)
+{
+    int port = (x->slot < 0) ? 0 : x->slot;
+
+    if (m->messageType == NOTE_ON)
+    {
+        inmidi_noteon(port,
+                      m->channelNumber,
+                      m->dataByte1,
+                      m->dataByte2);
+    }
+    else if (m->messageType == NOTE_OFF)
+    {
+        inmidi_noteon(port,
+                      m->channelNumber,
+                      m->dataByte1,
+                      0);
+    }
+    else if (m->messageType == CONTROLLER_CHANGE)
+    {
+        inmidi_controlchange(port,
+                             m->channelNumber,
+                             m->dataByte1,
+                             m->dataByte2);
+    }
+    else if (m->messageType == PROGRAM_CHANGE)
+    {
+        inmidi_programchange(port,
+                             m->channelNumber,
+                             m->dataByte1);
+    }
+    else if (m->messageType == PITCH_BEND)
+    {
+        int value = (((int)m->dataByte2) << 7) + \
+                    (int)m->dataByte1;
+
+        inmidi_pitchbend(port,
+                         m->channelNumber,
+                         value);
+    }
+    else if (m->messageType == CHANNEL_PRESSURE)
+    {
+        inmidi_aftertouch(port,
+                          m->channelNumber,
+                          m->dataByte1);
+    }
+    else if (m->messageType == KEY_PRESSURE)
+    {
+        inmidi_polyaftertouch(port,
+                              m->channelNumber,
+                              m->dataByte1,
+                              m->dataByte2);
+    }
+    else if (m->messageType == OTHER)
+    {
+        // FIXME: what to do?
+    }
+    else
+    {
+       sch_error(x, "pdvst3: MIDI message of unknown type %d", m->messageType);
+    }
+}
+
+/* one host note event to rvstnote ([vstnote]):
+   on <note id> <pitch> <tuning> <velocity> <channel>
+   off <note id> <pitch> <velocity> <channel>
+   pressure <note id> <pressure>
+   expression <note id> <type id> <value> */
+void sch_note_dispatch(t_pdvstInstance *x, pdvstNoteEvent *e)
+{
+    t_symbol *tempSym = instance_gensym(x, "rvstnote");
+    t_atom at[5];
+
+    if (!tempSym->s_thing)
+        return;
+    SETFLOAT(&at[0], e->noteId);
+    if (e->type == NOTEEVENT_ON)
+    {
+        SETFLOAT(&at[1], e->pitch);
+        SETFLOAT(&at[2], e->tuning);
+        SETFLOAT(&at[3], e->value);
+        SETFLOAT(&at[4], e->channel + 1);
+        pd_typedmess(tempSym->s_thing, gensym("on"), 5, at);
+    }
+    else if (e->type == NOTEEVENT_OFF)
+    {
+        SETFLOAT(&at[1], e->pitch);
+        SETFLOAT(&at[2], e->value);
+        SETFLOAT(&at[3], e->channel + 1);
+        pd_typedmess(tempSym->s_thing, gensym("off"), 4, at);
+    }
+    else if (e->type == NOTEEVENT_PRESSURE)
+    {
+        SETFLOAT(&at[1], e->value);
+        pd_typedmess(tempSym->s_thing, gensym("pressure"), 2, at);
+    }
+    else if (e->type == NOTEEVENT_EXPRESSION)
+    {
+        SETFLOAT(&at[1], e->expression);
+        SETFLOAT(&at[2], e->value);
+        pd_typedmess(tempSym->s_thing, gensym("expression"), 3, at);
+    }
+}
+
+t_pdvstInstance *sch_instance_for(t_canvas *canvas);
+
+void *vstnote_new(void)
+{
+    t_vstNote *x = (t_vstNote *)pd_new(vstNote_class);
+    t_pdvstInstance *instance = sch_instance_for(canvas_getcurrent());
+
+    x->x_sym = instance ? instance_gensym(instance, "rvstnote") : 0;
+    if (x->x_sym)
+        pd_bind(&x->x_obj.ob_pd, x->x_sym);
+    outlet_new(&x->x_obj, 0);
+    return x;
+}
+
+void vstnote_free(t_vstNote *x)
+{
+    if (x->x_sym)
+        pd_unbind(&x->x_obj.ob_pd, x->x_sym);
+}
+
+void vstnote_anything(t_vstNote *x, t_symbol *s, int argc, t_atom *argv)
+{
+    outlet_anything(x->x_obj.ob_outlet, s, argc, argv);
+}
+
+/* one byte of SysEx from Pd at time. a message is published to the host
+   at its F7, one that doesn't fit in the arena is dropped */
+void sch_sysex_byte(t_pdvstInstance *x, int c, int64_t time)
+{
+    pdvstSysexRing *r = &x->data->sysexOut;
+    uint32_t at;
+
+    c &= 0xFF;
+    if (c == 0xF0)
+    {
+        x->sysexState = 1;
+        x->sysexStart = r->byteHead;
+        x->sysexSize = 0;
+        x->sysexTime = time;
+    }
+    else if (c >= 0xF8)
+        return;  // realtime messages don't go to VST3 hosts
+    else if (c & 0x80 && c != 0xF7)
+        x->sysexState = 0;  // a status byte ends an unterminated message
+    if (x->sysexState != 1)
+        return;
+    if (!pdvstSysexFit(r, x->sysexStart, x->sysexSize + 1, &at))
+    {
+        pdvstLogRated(&x->data->pdLog, &x->sysexOutFull, PDVSTLOGWARNING,
+            "SysEx to the host dropped, the host doesn't take them fast enough");
+        x->sysexState = -1;
+        return;
+    }
+    // the message reached the end of the arena, it goes on from the start
+    if (at != x->sysexStart)
+    {
+        memmove(r->bytes + at % MAXSYSEXBYTES, r->bytes + x->sysexStart % MAXSYSEXBYTES,
+                x->sysexSize);
+        x->sysexStart = at;
+    }
+    r->bytes[(at + x->sysexSize) % MAXSYSEXBYTES] = (unsigned char)c;
+    x->sysexSize++;
+    if (c == 0xF7)
+    {
+        uint32_t head = r->head;
+
+        x->sysexState = 0;
+        if (head - r->tail >= MAXSYSEXQUEUESIZE)
+        {
+            pdvstLogRated(&x->data->pdLog, &x->sysexOutFull, PDVSTLOGWARNING,
+                "SysEx to the host dropped, the host doesn't take them fast enough");
+            return;
+        }
+        r->msg[head % MAXSYSEXQUEUESIZE].start = x->sysexStart;
+        r->msg[head % MAXSYSEXQUEUESIZE].size = x->sysexSize;
+        r->msg[head % MAXSYSEXQUEUESIZE].time = x->sysexTime;
+        r->byteHead = x->sysexStart + x->sysexSize;
+        PDVST_BARRIER();
+        r->head = head + 1;
+    }
+}
+
+/* the host's SysEx of the tick starting at blockTime to sysexin */
+void sch_sysex_events(t_pdvstInstance *x, int64_t blockTime, int flush)
+{
+    pdvstSysexRing *r = &x->data->sysexIn;
+    int port = (x->slot < 0) ? 0 : x->slot;
+    uint32_t tail = r->tail;
+    pdvstSysex *m;
+    int i;
+
+    while (tail != r->head)
+    {
+        PDVST_BARRIER();
+        m = &r->msg[tail % MAXSYSEXQUEUESIZE];
+        if (!flush && m->time >= blockTime + PDBLKSIZE)
+            break;
+        for (i = 0; i < m->size; i++)
+            inmidi_sysex(port, r->bytes[(m->start + i) % MAXSYSEXBYTES]);
+        r->byteTail = m->start + m->size;
+        PDVST_BARRIER();
+        r->tail = ++tail;
+    }
+}
+
+/* where in the current tick Pd is, or was at ms (logical time since
+   midiInitTime) */
+int sch_tick_offset(double ms)
+{
+    int offset = (int)((ms - midiTickMs) * sys_getsr() / 1000.);
+
+    if (offset < 0)
+        offset = 0;
+    if (offset >= PDBLKSIZE)
+        offset = PDBLKSIZE - 1;
+    return offset;
+}
+
+void *sysexout_new(void)
+{
+    t_sysexOut *x = (t_sysexOut *)pd_new(sysexOut_class);
+
+    x->x_instance = sch_instance_for(canvas_getcurrent());
+    return x;
+}
+
+void sysexout_float(t_sysexOut *x, t_floatarg f)
+{
+    if (x->x_instance && x->x_instance->data)
+        sch_sysex_byte(x->x_instance, (int)f, x->x_instance->tickTime +
+                       sch_tick_offset(clock_gettimesince(midiInitTime)));
+}
+
+void sysexout_list(t_sysexOut *x, t_symbol *s, int argc, t_atom *argv)
+{
+    int i;
+
+    (void)s;
+    for (i = 0; i < argc; i++)
+        sysexout_float(x, atom_getfloatarg(i, argc, argv));
+}
+
+/* take the midi and note events the host queued, call with the instance mutex */
+void sch_midi_in(t_pdvstInstance *x)
+{
+    pdvstTransferData *pdvstData = x->data;
+
+    if (pdvstData->noteQueueUpdated)
+    {
+        for (int i = 0; i < pdvstData->noteQueueSize; i++)
+        {
+            if (x->nNoteIn < MAXMIDIQUEUESIZE)
+                x->noteIn[x->nNoteIn++] = pdvstData->noteQueue[i];
             else
-            {
-                timeInfo.timeSigNumerator=0;
-                pdvstData->hostTimeInfo.updated=1;  // keep flag as updated
-            }
+                pdvstLogRated(&pdvstData->pdLog, &x->noteInFull, PDVSTLOGWARNING,
+                    "note events from the host dropped, queue full");
+        }
+        pdvstData->noteQueueSize = 0;
+        pdvstData->noteQueueUpdated = 0;
+    }
+
+    // check for new midi-in message (VSTi)
+    if (pdvstData->midiQueueUpdated)
+    {
+        for (int i = 0; i < pdvstData->midiQueueSize; i++)
+        {
+            if (x->nMidiIn < MAXMIDIQUEUESIZE)
+                x->midiIn[x->nMidiIn++] = pdvstData->midiQueue[i];
+            else
+                pdvstLogRated(&pdvstData->pdLog, &x->midiInFull, PDVSTLOGWARNING,
+                    "MIDI from the host dropped, queue full");
+        }
+        pdvstData->midiQueueSize = 0;
+        pdvstData->midiQueueUpdated = 0;
+    }
+}
+
+/* the slot of a coalesced message, -1 if its type isn't coalesced */
+int sch_coalesce_slot(pdvstMidiMessage *m, int coalesce)
+{
+    int channel = m->channelNumber & 15;
+
+    if (!(coalesce & PDVSTCOALESCE(m->messageType)))
+        return -1;
+    switch (m->messageType)
+    {
+        case CONTROLLER_CHANGE:
+            return channel * 128 + (m->dataByte1 & 127);
+        case KEY_PRESSURE:
+            return 16 * 128 + channel * 128 + (m->dataByte1 & 127);
+        case CHANNEL_PRESSURE:
+            return 2 * 16 * 128 + channel;
+        case PITCH_BEND:
+            return 2 * 16 * 128 + 16 + channel;
+        default:
+            return -1;
+    }
+}
+
+/* mark the events of the tick that a later one of the same slot makes
+   useless. walking back, the first one seen in a slot is the latest.
+   notes on and off are never skipped, so their order stays the same */
+void sch_midi_coalesce(t_pdvstInstance *x, int64_t blockTime, int flush)
+{
+    int coalesce = x->data->midiCoalesce;
+    int i, slot, type;
+    t_noteSlot *ns;
+
+    x->coalesceStamp++;
+    for (i = x->nMidiIn - 1; i >= 0; i--)
+    {
+        x->midiSkip[i] = 0;
+        if (!flush && x->midiIn[i].time >= blockTime + PDBLKSIZE)
+            continue;
+        slot = sch_coalesce_slot(&x->midiIn[i], coalesce);
+        if (slot < 0)
+            continue;
+        if (x->coalesceSeen[slot] == x->coalesceStamp)
+            x->midiSkip[i] = 1;
+        else
+            x->coalesceSeen[slot] = x->coalesceStamp;
+    }
+    for (i = x->nNoteIn - 1; i >= 0; i--)
+    {
+        x->noteSkip[i] = 0;
+        if (!flush && x->noteIn[i].time >= blockTime + PDBLKSIZE)
+            continue;
+        if (x->noteIn[i].type == NOTEEVENT_PRESSURE &&
+            (coalesce & PDVSTCOALESCE(KEY_PRESSURE)))
+            type = -1;
+        else if (x->noteIn[i].type == NOTEEVENT_EXPRESSION &&
+                 (coalesce & PDVSTCOALESCEEXPRESSION))
+            type = x->noteIn[i].expression;
+        else
+            continue;
+        // a note id can be -1: then the pitch and channel tell the note
+        slot = (x->noteIn[i].noteId >= 0) ? x->noteIn[i].noteId :
+               (x->noteIn[i].channel * 128 + x->noteIn[i].pitch);
+        ns = &x->noteSeen[(unsigned)(slot * 7 + type) % NOTECOALESCESLOTS];
+        if (ns->stamp == x->coalesceStamp && ns->noteId == slot && ns->type == type)
+            x->noteSkip[i] = 1;
+        else if (ns->stamp != x->coalesceStamp)
+        {
+            // on a collision with another note both are sent
+            ns->stamp = x->coalesceStamp;
+            ns->noteId = slot;
+            ns->type = type;
+        }
+    }
+}
+
+/* send Pd the events that fall in the tick starting at blockTime, in the
+   host's order. flush sends them all now (no host blocks) */
+void sch_midi_events(t_pdvstInstance *x, int64_t blockTime, int flush)
+{
+    int i, n = 0;
+
+    if (x->data->midiCoalesce)
+        sch_midi_coalesce(x, blockTime, flush);
+    for (i = 0; i < x->nMidiIn; i++)
+    {
+        if (flush || x->midiIn[i].time < blockTime + PDBLKSIZE)
+        {
+            if (!x->data->midiCoalesce || !x->midiSkip[i])
+                sch_midi_dispatch(x, &x->midiIn[i]);
         }
-        if (timeInfo.timeSigDenominator!=pdvstData->hostTimeInfo.timeSigDenominator)
+        else
+            x->midiIn[n++] = x->midiIn[i];
+    }
+    x->nMidiIn = n;
+    for (i = 0, n = 0; i < x->nNoteIn; i++)
+    {
+        if (flush || x->noteIn[i].time < blockTime + PDBLKSIZE)
         {
-            timeInfo.timeSigDenominator=pdvstData->hostTimeInfo.timeSigDenominator;
-            tempSym = gensym("vstTimeInfo.timeSigDenominator");
-            if (tempSym->s_thing)
+            if (!x->data->midiCoalesce || !x->noteSkip[i])
+                sch_note_dispatch(x, &x->noteIn[i]);
+        }
+        else
+            x->noteIn[n++] = x->noteIn[i];
+    }
+    x->nNoteIn = n;
+    sch_sysex_events(x, blockTime, flush);
+}
+
+void sch_midi_out(void)
+{
+    t_pdvstInstance *x;
+    pdvstTransferData *pdvstData;
+    int port, i;
+
+    while (midi_outhead != lastmidiouthead)
+    {
+        port = midi_outqueue[lastmidiouthead].q_portno;
+        x = serverData ? ((port >= 0 && port < MAXPDINSTANCES) ? pdvstInstances[port] : 0) :
+                         pdvstInstances[0];
+        // single bytes come from [midiout], they only go to the host as SysEx
+        if (x && midi_outqueue[lastmidiouthead].q_onebyte)
+            sch_sysex_byte(x, midi_outqueue[lastmidiouthead].q_byte1, x->tickTime +
+                           sch_tick_offset(midi_outqueue[lastmidiouthead].q_time * 1000.));
+        else if (x)
+        {
+            pdvstData = x->data;
+            xxWaitForSingleObject(x->mu_tex[PDVSTTRANSFERMUTEX], -1);
+            i = pdvstData->midiOutQueueSize;
+            if (i < MAXMIDIOUTQUEUESIZE)
             {
-                pd_float(tempSym->s_thing, (float)timeInfo.timeSigDenominator);
+                // where in the tick Pd sent it
+                pdvstData->midiOutQueue[i].time = x->tickTime +
+                    sch_tick_offset(midi_outqueue[lastmidiouthead].q_time * 1000.);
+                pdvstData->midiOutQueue[i].statusByte = midi_outqueue[lastmidiouthead].q_byte1;
+                pdvstData->midiOutQueue[i].dataByte1=  midi_outqueue[lastmidiouthead].q_byte2;
+                pdvstData->midiOutQueue[i].dataByte2= midi_outqueue[lastmidiouthead].q_byte3;
+                pdvstData->midiOutQueueSize = i + 1;
+                pdvstData->midiOutQueueUpdated = 1;
             }
             else
-            {
-                timeInfo.timeSigDenominator=0;
-                pdvstData->hostTimeInfo.updated=1;  // keep flag as updated
-            }
+                pdvstLogRated(&pdvstData->pdLog, &x->midiOutFull, PDVSTLOGWARNING,
+                    "MIDI to the host dropped, queue full");
+            xxReleaseMutex(x->mu_tex[PDVSTTRANSFERMUTEX]);
+        }
+        lastmidiouthead  = (lastmidiouthead + 1 == MIDIQSIZE ? 0 : lastmidiouthead + 1);
+    }
+    midiTickMs = clock_gettimesince(midiInitTime);
+}
+
+t_paramLane *sch_lane_find(t_pdvstInstance *x, int index);
+
+/* the values the host marked dirty, 32 parameters per bitmap word */
+void sch_receive_parameters(t_pdvstInstance *x)
+{
+    pdvstTransferData *pdvstData = x->data;
+    float *values = PDVSTPARAMS(pdvstData);
+    uint32_t *dirty = PDVSTDIRTY(pdvstData);
+    int w, words = PDVSTDIRTYWORDS(x->nParams);
+
+    for (w = 0; w < words; w++)
+    {
+        uint32_t bits = dirty[w];
+        int b;
+        if (!bits)
+            continue;
+        for (b = 0; b < 32 && bits; b++)
+        {
+            int i = w * 32 + b;
+            t_paramLane *l;
+            if (!(bits & (1u << b)))
+                continue;
+            bits &= ~(1u << b);
+            if (i >= x->nParams)
+                break;
+            if ((l = sch_lane_find(x, i)))
+                l->value = values[i];
+            if (setPdvstFloatParameter(x, i, values[i]))
+                dirty[w] &= ~(1u << b);
         }
     }
 }
 
-void sch_midi_in_out(void)
+/* fill a lane up to point p, or to the end of the tick, along the ramp to p */
+void sch_lane_segment(t_paramLane *l, pdvstParamPoint *p, int64_t blockTime)
 {
-    // check for new midi-in message (VSTi)
-    if (pdvstData->midiQueueUpdated)
-    {
-        for (int i = 0; i < pdvstData->midiQueueSize; i++)
-        {
-            if (pdvstData->midiQueue[i].messageType == NOTE_ON)
-            {
-                inmidi_noteon(0,
-                              pdvstData->midiQueue[i].channelNumber,
-                              pdvstData->midiQueue[i].dataByte1,
-                              pdvstData->midiQueue[i].dataByte2);
-            }
-            else if (pdvstData->midiQueue[i].messageType == NOTE_OFF)
-            {
-                inmidi_noteon(0,
-                              pdvstData->midiQueue[i].channelNumber,
-                              pdvstData->midiQueue[i].dataByte1,
-                              0);
-            }
-            else if (pdvstData->midiQueue[i].messageType == CONTROLLER_CHANGE)
-            {
-                inmidi_controlchange(0,
-                                     pdvstData->midiQueue[i].channelNumber,
-                                     pdvstData->midiQueue[i].dataByte1,
-                                     pdvstData->midiQueue[i].dataByte2);
-            }
-            else if (pdvstData->midiQueue[i].messageType == PROGRAM_CHANGE)
-            {
-                inmidi_programchange(0,
-                                     pdvstData->midiQueue[i].channelNumber,
-                                     pdvstData->midiQueue[i].dataByte1);
-            }
-            else if (pdvstData->midiQueue[i].messageType == PITCH_BEND)
-            {
-                int value = (((int)pdvstData->midiQueue[i].dataByte2) * 16) + \
-                            (int)pdvstData->midiQueue[i].dataByte1;
+    int64_t end = p->time - blockTime;
+    double slope = 0, base;
+    int i;
 
-                inmidi_pitchbend(0,
-                                 pdvstData->midiQueue[i].channelNumber,
-                                 value);
-            }
-            else if (pdvstData->midiQueue[i].messageType == CHANNEL_PRESSURE)
-            {
-                inmidi_aftertouch(0,
-                                  pdvstData->midiQueue[i].channelNumber,
-                                  pdvstData->midiQueue[i].dataByte1);
-            }
-            else if (pdvstData->midiQueue[i].messageType == KEY_PRESSURE)
-            {
-                inmidi_polyaftertouch(0,
-                                      pdvstData->midiQueue[i].channelNumber,
-                                      pdvstData->midiQueue[i].dataByte1,
-                                      pdvstData->midiQueue[i].dataByte2);
-            }
-            else if (pdvstData->midiQueue[i].messageType == OTHER)
-            {
-                // FIXME: what to do?
-            }
-            else
-            {
-               post("pdvstData->midiQueue error"); // FIXME: error?
-            }
-        }
-        pdvstData->midiQueueSize = 0;
-        pdvstData->midiQueueUpdated = 0;
+    if (end > PDBLKSIZE)
+        end = PDBLKSIZE;
+    if (p->time > l->time)
+        slope = (p->value - l->value) / (double)(p->time - l->time);
+    base = l->value + slope * (double)(blockTime - l->time);
+    for (i = l->pos; i < end; i++)
+        l->samples[i] = (t_sample)(base + slope * i);
+    if (end > l->pos)
+        l->pos = (int)end;
+    if (p->time < blockTime + PDBLKSIZE)
+    {
+        l->value = p->value;
+        l->time = p->time;
     }
-    // flush vstmidi out messages here
-    int i=pdvstData->midiOutQueueSize;
-    while (midi_outhead != lastmidiouthead)
+}
+
+t_paramLane *sch_lane_find(t_pdvstInstance *x, int index)
+{
+    t_paramLane *l;
+
+    for (l = x->lanes; l; l = l->next)
+        if (l->index == index)
+            return l;
+    return 0;
+}
+
+/* lanes exist only for the parameters some [vstparam~] reads */
+t_paramLane *sch_lane_get(t_pdvstInstance *x, int index)
+{
+    t_paramLane *l = sch_lane_find(x, index);
+    int i;
+
+    if (!l)
     {
-        pdvstData->midiOutQueue[i].statusByte = midi_outqueue[lastmidiouthead].q_byte1;
-        pdvstData->midiOutQueue[i].dataByte1=  midi_outqueue[lastmidiouthead].q_byte2;
-        pdvstData->midiOutQueue[i].dataByte2= midi_outqueue[lastmidiouthead].q_byte3;
-        lastmidiouthead  = (lastmidiouthead + 1 == MIDIQSIZE ? 0 : lastmidiouthead + 1);
-        i  = i + 1;
+        l = (t_paramLane *)getbytes(sizeof(t_paramLane));
+        l->index = index;
+        if (x->data && index < x->data->nParameters)
+            l->value = PDVSTPARAMS(x->data)[index];
+        for (i = 0; i < PDBLKSIZE; i++)
+            l->samples[i] = l->value;
+        l->next = x->lanes;
+        x->lanes = l;
     }
-    if (i>0)
+    l->users++;
+    return l;
+}
+
+void sch_lane_release(t_pdvstInstance *x, t_paramLane *l)
+{
+    t_paramLane **p;
+
+    if (--l->users > 0)
+        return;
+    for (p = &x->lanes; *p; p = &(*p)->next)
+        if (*p == l)
+        {
+            *p = l->next;
+            break;
+        }
+    freebytes(l, sizeof(t_paramLane));
+}
+
+/* the instance a new object belongs to, by the patch it is created in */
+t_pdvstInstance *sch_instance_for(t_canvas *canvas)
+{
+    t_canvas *root;
+    int k;
+
+    if (loadingInstance)
+        return loadingInstance;
+    if (!serverData)
+        return &singleInstance;
+    root = canvas ? canvas_getrootfor(canvas) : 0;
+    for (k = 0; k < MAXPDINSTANCES; k++)
+        if (pdvstInstances[k] && pdvstInstances[k]->canvas == root)
+            return pdvstInstances[k];
+    return 0;
+}
+
+void *vstparam_tilde_new(t_floatarg f)
+{
+    t_vstParamTilde *x = (t_vstParamTilde *)pd_new(vstParamTilde_class);
+    int index = (int)f;
+
+    x->x_index = (index < 0) ? 0 : (index >= MAXPARAMETERS) ? MAXPARAMETERS - 1 : index;
+    x->x_instance = sch_instance_for(canvas_getcurrent());
+    x->x_lane = x->x_instance ? sch_lane_get(x->x_instance, x->x_index) : 0;
+    outlet_new(&x->x_obj, &s_signal);
+    return x;
+}
+
+void vstparam_tilde_free(t_vstParamTilde *x)
+{
+    if (x->x_lane)
+        sch_lane_release(x->x_instance, x->x_lane);
+}
+
+t_int *vstparam_tilde_perform(t_int *w)
+{
+    t_vstParamTilde *x = (t_vstParamTilde *)(w[1]);
+    t_sample *out = (t_sample *)(w[2]);
+    int n = (int)(w[3]), i;
+
+    if (!x->x_lane)
     {
-        pdvstData->midiOutQueueSize=i;
-        pdvstData->midiOutQueueUpdated=1;
+        memset(out, 0, n * sizeof(t_sample));
+        return (w + 4);
     }
-    else
+    t_sample *lane = x->x_lane->samples;
+    for (i = 0; i < n; i++)
+        out[i] = lane[(x->x_offset + i < PDBLKSIZE) ? x->x_offset + i : PDBLKSIZE - 1];
+    x->x_offset = (n < PDBLKSIZE) ? (x->x_offset + n) % PDBLKSIZE : 0;
+    return (w + 4);
+}
+
+void vstparam_tilde_dsp(t_vstParamTilde *x, t_signal **sp)
+{
+    x->x_offset = 0;
+    dsp_add(vstparam_tilde_perform, 3, x, sp[0]->s_vec, (t_int)sp[0]->s_n);
+}
+
+/* take the automation points the host queued, call with the instance mutex */
+void sch_param_queue_in(t_pdvstInstance *x)
+{
+    pdvstTransferData *pdvstData = x->data;
+    int i;
+
+    if (!pdvstData->paramQueueUpdated)
+        return;
+    for (i = 0; i < pdvstData->paramQueueSize; i++)
     {
-        pdvstData->midiOutQueueSize=0;
-        pdvstData->midiOutQueueUpdated=0;
+        pdvstParamPoint *p = &pdvstData->paramQueue[i];
+        if (x->nPoints < MAXPARAMQUEUESIZE && p->index >= 0 && p->index < x->nParams)
+        {
+            x->points[x->nPoints] = *p;
+            x->ramped[x->nPoints] = 0;
+            x->nPoints++;
+        }
     }
+    pdvstData->paramQueueSize = 0;
+    pdvstData->paramQueueUpdated = 0;
 }
 
-void sch_receive_parameters(void)
+/* deliver the points that fall in the tick starting at blockTime: the ramp
+   to a point is sent on the tick where it starts, the value itself on the
+   tick where it is reached. flush delivers everything now (no host blocks) */
+void sch_param_points(t_pdvstInstance *x, int64_t blockTime, int flush)
 {
-    for (int i = 0; i < pdvstData->nParameters; i++)
+    int i, n = 0;
+    double msPerSample = 1000. / sys_getsr();
+    int64_t blockEnd = blockTime + PDBLKSIZE;
+    t_paramLane *l;
+
+    for (l = x->lanes; l; l = l->next)
+        l->pos = 0;
+    for (i = 0; i < x->nPoints; i++)
     {
-        if (pdvstData->vstParameters[i].direction == PD_RECEIVE && \
-            pdvstData->vstParameters[i].updated)
+        pdvstParamPoint *p = &x->points[i];
+        l = x->lanes ? sch_lane_find(x, p->index) : 0;
+        if (flush)
         {
-            if (pdvstData->vstParameters[i].type == FLOAT_TYPE)
+            if (l)
             {
-                if (setPdvstFloatParameter(i,
-                              pdvstData->vstParameters[i].value.floatData))
-                {
-                    pdvstData->vstParameters[i].updated = 0;
-                }
+                l->value = p->value;
+                l->time = p->time;
             }
+            setPdvstParameterRamp(x, p->index, p->value, 0, 0);
+            setPdvstFloatParameter(x, p->index, p->value);
+            continue;
+        }
+        if (l)
+            sch_lane_segment(l, p, blockTime);
+        if (!x->ramped[i] && p->start < blockEnd)
+        {
+            int64_t from = (p->start > blockTime) ? p->start : blockTime;
+            int64_t ramp = (p->time > from) ? p->time - from : 0;
+            setPdvstParameterRamp(x, p->index, p->value,
+                                  ramp * msPerSample, (from - blockTime) * msPerSample);
+            x->ramped[i] = 1;
+        }
+        if (p->time < blockEnd)
+            setPdvstFloatParameter(x, p->index, p->value);
+        else
+        {
+            x->points[n] = *p;
+            x->ramped[n] = x->ramped[i];
+            n++;
         }
     }
+    x->nPoints = n;
+    // lanes stay at their last value after their last point
+    for (l = x->lanes; l; l = l->next)
+        for (n = flush ? 0 : l->pos; n < PDBLKSIZE; n++)
+            l->samples[n] = l->value;
 }
 
-int scheduler()
+void sch_set_process_id(pdvstTransferData *pdvstData)
 {
-    int i, blockTime, active = 1;
-    #if _WIN32
+    #ifdef _WIN32
+        pdvstData->pdProcessId = (int)GetCurrentProcessId();
+    #else
+        pdvstData->pdProcessId = (int)getpid();
+    #endif
+}
+
+int sch_host_alive(void)
+{
+    #ifdef _WIN32
         DWORD vstHostProcessStatus = 0;
+        GetExitCodeProcess(vstHostProcess, &vstHostProcessStatus);
+        return vstHostProcessStatus == STILL_ACTIVE;
+    #else
+        return kill(vstHostProcessId, 0) != -1;
     #endif
+}
+
+void sch_makeclasses(void)
+{
     vstParameterReceiver_class = class_new(gensym("vstParameterReceiver"),
                                            0,
                                            0,
@@ -733,7 +2452,6 @@ int scheduler()
                                            (t_atomtype)0);
 
     class_addfloat(vstParameterReceiver_class, (t_method)sendPdVstFloatParameter);
-    makePdvstParameterReceivers();
 
     vstChunkReceiver_class = class_new(gensym("vstChunkReceiver"),
                                            0,
@@ -743,7 +2461,6 @@ int scheduler()
                                            (t_atomtype)0);
 
     class_addanything(vstChunkReceiver_class,(t_method)sendPdVstChunk);
-    makevstChunkReceiver();
 
     vstGuiNameReceiver_class = class_new(gensym("vstGuiNameReceiver"),
                                            0,
@@ -753,8 +2470,62 @@ int scheduler()
                                            (t_atomtype)0);
 
     class_addsymbol(vstGuiNameReceiver_class,(t_method)sendPdVstGuiName);
-    makePdvstGuiNameReceiver();
 
+    vstParamTilde_class = class_new(gensym("vstparam~"),
+                                    (t_newmethod)(void (*)(void))vstparam_tilde_new,
+                                    (t_method)vstparam_tilde_free,
+                                    sizeof(t_vstParamTilde),
+                                    0,
+                                    A_DEFFLOAT,
+                                    0);
+
+    class_addmethod(vstParamTilde_class, (t_method)vstparam_tilde_dsp, gensym("dsp"), A_CANT, 0);
+
+    vstNote_class = class_new(gensym("vstnote"),
+                              (t_newmethod)vstnote_new,
+                              (t_method)vstnote_free,
+                              sizeof(t_vstNote),
+                              0,
+                              0);
+
+    class_addanything(vstNote_class, (t_method)vstnote_anything);
+
+    sysexOut_class = class_new(gensym("sysexout"),
+                               (t_newmethod)sysexout_new,
+                               0,
+                               sizeof(t_sysexOut),
+                               0,
+                               0);
+
+    class_addfloat(sysexOut_class, (t_method)sysexout_float);
+    class_addlist(sysexOut_class, (t_method)sysexout_list);
+
+    vstTime_class = class_new(gensym("vsttime"),
+                              (t_newmethod)(void (*)(void))vsttime_new,
+                              (t_method)vsttime_free,
+                              sizeof(t_vstTime),
+                              0,
+                              A_DEFFLOAT,
+                              0);
+
+    class_addbang(vstTime_class, (t_method)vsttime_bang);
+    class_addmethod(vstTime_class, (t_method)vsttime_auto, gensym("auto"), A_FLOAT, 0);
+    class_addmethod(vstTime_class, (t_method)vsttime_tick, gensym("tick"), 0);
+
+    vstArray_class = class_new(gensym("vstarray"),
+                               (t_newmethod)(void (*)(void))vstarray_new,
+                               (t_method)vstarray_free,
+                               sizeof(t_vstArray),
+                               0,
+                               A_DEFSYMBOL,
+                               0);
+
+    class_addbang(vstArray_class, (t_method)vstarray_bang);
+    class_addmethod(vstArray_class, (t_method)vstarray_set, gensym("set"), A_SYMBOL, 0);
+}
+
+void sch_timing(void)
+{
     *(get_sys_time_per_dsp_tick()) = (TIMEUNITPERSEC) * \
                                      ((double)*(get_sys_schedblocksize())) / \
                                      *(get_sys_dacsr());
@@ -771,25 +2542,80 @@ int scheduler()
     {
         *(get_sys_sleepgrain()) = 5000;
     }
+}
+
+/* like glob_evalfile(), but keep hold of the toplevel canvas */
+t_canvas *sch_open_patch(const char *name, const char *dir, int argc, t_atom *argv)
+{
+    t_pd *canvas = 0, *boundx;
+    int dspstate;
+
+    dspstate = canvas_suspend_dsp();
+    boundx = s__X.s_thing;
+    s__X.s_thing = 0;
+    canvas_setargs(argc, argv);
+    binbuf_evalfile(gensym(name), gensym(dir));
+    canvas_setargs(0, 0);
+    while ((canvas != s__X.s_thing) && s__X.s_thing)
+    {
+        canvas = s__X.s_thing;
+        vmess(canvas, gensym("pop"), "i", 1);
+    }
+    if (!sys_noloadbang)
+        pd_doloadbang();
+    canvas_resume_dsp(dspstate);
+    s__X.s_thing = boundx;
+    return (t_canvas *)canvas;
+}
+
+int scheduler()
+{
+    int i, blockTime, active = 1, openPatch = 0;
+    char patchName[MAXFILENAMELEN], patchDir[MAXFILENAMELEN];
+    t_pdvstInstance *x = &singleInstance;
+    pdvstTransferData *pdvstData = x->data;
+
+    makePdvstParameterReceivers(x);
+    makevstChunkReceiver(x);
+    makePdvstGuiNameReceiver(x);
+    sch_timing();
     sys_initmidiqueue();
+    midiInitTime = clock_getlogicaltime();
+    midiTickMs = 0;
+    xxWaitForSingleObject(x->mu_tex[PDVSTTRANSFERMUTEX], -1);
     pdvstData->midiOutQueueSize=0;
+    sch_set_process_id(pdvstData);
+    // tell the host we can take its data now
+    pdvstData->schedulerReady = 1;
+    xxReleaseMutex(x->mu_tex[PDVSTTRANSFERMUTEX]);
     while (active)
     {
-        xxWaitForSingleObject(PDVSTTRANSFERMUTEX, -1);
+        xxWaitForSingleObject(x->mu_tex[PDVSTTRANSFERMUTEX], -1);
         active = pdvstData->active;
+        pdvstData->heartbeat++;
         // check sample rate
         if (pdvstData->sampleRate != (int)sys_getsr())
         {
             post("samplerate changed to %d", pdvstData->sampleRate);
+            sch_log(x, PDVSTLOGINFO, "samplerate changed to %d", pdvstData->sampleRate);
             sys_setchsr(pdvstData->nChannelsIn,
                         pdvstData->nChannelsOut,
                         pdvstData->sampleRate);
         }
 
-        sch_general_receivers();
-        sch_playhead_in();
-        sch_midi_in_out();
-        sch_receive_parameters();
+        sch_general_receivers(x);
+        sch_playhead_in(x);
+        sch_midi_in(x);
+        sch_receive_parameters(x);
+        sch_param_queue_in(x);
+        // a Pd from the host's pool starts empty, the patch comes later
+        if (pdvstData->openPatch)
+        {
+            strcpy(patchName, pdvstData->patchName);
+            strcpy(patchDir, pdvstData->patchDir);
+            pdvstData->openPatch = 0;
+            openPatch = 1;
+        }
 
         // run at approx. real-time
         blockTime = (int)((float)(pdvstData->blockSize) / \
@@ -801,55 +2627,491 @@ int scheduler()
         }
         if (pdvstData->syncToVst)
         {
-            xxReleaseMutex(PDVSTTRANSFERMUTEX);
-            if (xxWaitForSingleObject(VSTPROCEVENT, 1000) == 0) //WAIT_TIMEOUT
+            xxReleaseMutex(x->mu_tex[PDVSTTRANSFERMUTEX]);
+            if (xxWaitForSingleObject(x->mu_tex[VSTPROCEVENT], 1000) == 0) //WAIT_TIMEOUT
             {
                 // we have probably lost sync by now (1 sec)
-                xxWaitForSingleObject(PDVSTTRANSFERMUTEX, 100);
+                xxWaitForSingleObject(x->mu_tex[PDVSTTRANSFERMUTEX], 100);
                 pdvstData->syncToVst = 0;
-                xxReleaseMutex(PDVSTTRANSFERMUTEX);
+                xxReleaseMutex(x->mu_tex[PDVSTTRANSFERMUTEX]);
+            }
+            else
+            {
+                // not on a timeout: no block was posted, blockTime is the last one's
+                pdvstTrace(pdvstData, PDVSTTRACEPD, PDVSTTRACESCHEDWAKE,
+                           (int32_t)pdvstData->blockTime);
+            }
+            xxResetEvent(x->mu_tex[VSTPROCEVENT]);
+            // points and events the host queued along with this block
+            if (pdvstData->paramQueueUpdated || pdvstData->midiQueueUpdated ||
+                pdvstData->noteQueueUpdated)
+            {
+                xxWaitForSingleObject(x->mu_tex[PDVSTTRANSFERMUTEX], -1);
+                sch_param_queue_in(x);
+                sch_midi_in(x);
+                xxReleaseMutex(x->mu_tex[PDVSTTRANSFERMUTEX]);
             }
-            xxResetEvent(VSTPROCEVENT);
-            scheduler_tick();
-            xxSetEvent(PDPROCEVENT);
+            x->tickTime = pdvstData->blockTime;
+            sch_param_points(x, pdvstData->blockTime, 0);
+            sch_midi_events(x, pdvstData->blockTime, 0);
+            sch_playhead_tick(x);
+            scheduler_tick(x);
+            sch_midi_out();
+            sch_param_out(x, pdvstData->blockTime);
+            pdvstTrace(pdvstData, PDVSTTRACEPD, PDVSTTRACEPDPOST, (int32_t)x->tickTime);
+            xxSetEvent(x->mu_tex[PDPROCEVENT]);
         }
         else
         {
-            xxReleaseMutex(PDVSTTRANSFERMUTEX);
-            scheduler_tick();
+            xxReleaseMutex(x->mu_tex[PDVSTTRANSFERMUTEX]);
+            x->tickTime = 0;
+            sch_param_points(x, 0, 1);
+            sch_midi_events(x, 0, 1);
+            sch_playhead_tick(x);
+            scheduler_tick(x);
+            sch_midi_out();
+            sch_param_out(x, 0);
             pdvst_sleep(blockTime);
 
         }
-        #ifdef _WIN32
-            GetExitCodeProcess(vstHostProcess, &vstHostProcessStatus);
-            if (vstHostProcessStatus != STILL_ACTIVE)
+        if (openPatch)
+        {
+            logpost(NULL, PD_DEBUG, "pdvst3: opening %s", patchName);
+            sch_log(x, PDVSTLOGINFO, "opening %s", patchName);
+            sch_open_patch(patchName, patchDir, 0, 0);
+            openPatch = 0;
+        }
+        if (!sch_host_alive())
+        {
+            active = 0;
+        }
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------
+// shared Pd server
+//------------------------------------------------------------------------
+
+/* map an instance's transfer region and open its semaphores */
+int instance_map(t_pdvstInstance *x, const char *mutexName, const char *fileMapName,
+                 const char *vstProcEvent, const char *pdProcEvent)
+{
+    #ifdef _WIN32
+        x->mu_tex[PDVSTTRANSFERMUTEX] = OpenMutexA(MUTEX_ALL_ACCESS, 0, mutexName);
+        x->mu_tex[VSTPROCEVENT] = OpenEventA(EVENT_ALL_ACCESS, 0, vstProcEvent);
+        x->mu_tex[PDPROCEVENT] = OpenEventA(EVENT_ALL_ACCESS, 0, pdProcEvent);
+        x->fileMap = OpenFileMappingA(FILE_MAP_ALL_ACCESS,
+                                      0,
+                                      fileMapName);
+        if (!x->fileMap)
+            return 0;
+        // map the whole region, FIFOs included
+        x->data = (pdvstTransferData *)MapViewOfFile(x->fileMap,
+                                                     FILE_MAP_ALL_ACCESS,
+                                                     0,
+                                                     0,
+                                                     0);
+        if (!x->data)
+            return 0;
+        x->mapSize = x->data->mapSize;
+    #else //unix
+        int size = sizeof(pdvstTransferData);
+        x->mu_tex[PDVSTTRANSFERMUTEX] = sem_open(mutexName, O_CREAT, 0666, 0);
+        x->mu_tex[VSTPROCEVENT] = sem_open(vstProcEvent, O_CREAT, 0666, 1);
+        x->mu_tex[PDPROCEVENT] = sem_open(pdProcEvent, O_CREAT, 0666, 0);
+        fd = shm_open(fileMapName, O_RDWR, 0666);
+        if (fd < 0)
+            return 0;
+        x->fileMap = (char*)mmap(NULL, size,
+                                 PROT_READ | PROT_WRITE, MAP_SHARED,
+                                 fd, 0);
+        if (x->fileMap != MAP_FAILED && ((pdvstTransferData *)x->fileMap)->mapSize > size)
+        {
+            // the region is larger than the header: map it again whole
+            int mapSize = ((pdvstTransferData *)x->fileMap)->mapSize;
+            munmap(x->fileMap, size);
+            size = mapSize;
+            x->fileMap = (char*)mmap(NULL, size,
+                                     PROT_READ | PROT_WRITE, MAP_SHARED,
+                                     fd, 0);
+        }
+        close(fd);
+        if (x->fileMap == MAP_FAILED)
+            return 0;
+        mlock(x->fileMap, size);
+        x->mapSize = size;
+        x->data = (pdvstTransferData *)x->fileMap;
+    #endif
+    return 1;
+}
+
+void instance_unmap(t_pdvstInstance *x)
+{
+    #ifdef _WIN32
+        CloseHandle(x->mu_tex[PDVSTTRANSFERMUTEX]);
+        CloseHandle(x->mu_tex[VSTPROCEVENT]);
+        CloseHandle(x->mu_tex[PDPROCEVENT]);
+        if (x->data)
+            UnmapViewOfFile(x->data);
+        if (x->fileMap)
+            CloseHandle(x->fileMap);
+    #else
+        // the names belong to the host, it unlinks them
+        sem_close(x->mu_tex[VSTPROCEVENT]);
+        sem_close(x->mu_tex[PDPROCEVENT]);
+        sem_close(x->mu_tex[PDVSTTRANSFERMUTEX]);
+        if (x->data)
+        {
+            munlock(x->fileMap, x->mapSize);
+            munmap(x->fileMap, x->mapSize);
+        }
+    #endif
+    x->data = 0;
+}
+
+/* open the patch of a newly attached instance: its receivers are prefixed
+   with "<slot>-" and the canvas gets $1 = slot, $2 = its first midi channel,
+   $3... = its Pd audio channels */
+t_pdvstInstance *instance_new(int slot, pdvstServerSlot *names)
+{
+    t_pdvstInstance *x = (t_pdvstInstance *)getbytes(sizeof(t_pdvstInstance));
+    int nch = serverData->channelsPerInstance, i, argc = 0;
+    t_atom args[2 + MAXCHANNELS];
+
+    x->slot = slot;
+    sprintf(x->prefix, "%d-", slot);
+    x->channelOffset = slot * nch;
+    if (!instance_map(x, names->mutexName, names->fileMapName,
+                      names->vstProcEventName, names->pdProcEventName))
+    {
+        pd_error(NULL, "pdvst3: can't map instance %d", slot);
+        instance_unmap(x);
+        freebytes(x, sizeof(t_pdvstInstance));
+        return 0;
+    }
+    makePdvstParameterReceivers(x);
+    makevstChunkReceiver(x);
+    makePdvstGuiNameReceiver(x);
+    pdvstInstances[slot] = x;
+
+    SETFLOAT(&args[argc], slot); argc++;
+    SETFLOAT(&args[argc], slot * 16 + 1); argc++;
+    for (i = 0; i < nch && i < MAXCHANNELS; i++)
+    {
+        SETFLOAT(&args[argc], x->channelOffset + i + 1);
+        argc++;
+    }
+    loadingInstance = x;
+    x->canvas = sch_open_patch(serverData->patchName, serverData->patchDir, argc, args);
+    loadingInstance = 0;
+
+    xxWaitForSingleObject(x->mu_tex[PDVSTTRANSFERMUTEX], -1);
+    x->data->midiOutQueueSize = 0;
+    sch_set_process_id(x->data);
+    x->data->schedulerReady = 1;
+    x->lastInHead = x->data->inHead;
+    x->lastBlockTime = sys_getrealtime();
+    xxReleaseMutex(x->mu_tex[PDVSTTRANSFERMUTEX]);
+    logpost(NULL, PD_DEBUG, "pdvst3: instance %d attached", slot);
+    sch_log(x, PDVSTLOGINFO, "attached to the shared Pd as instance %d", slot);
+    return x;
+}
+
+void instance_free(t_pdvstInstance *x)
+{
+    pdvstInstances[x->slot] = 0;
+    if (x->canvas)
+        pd_free((t_pd *)x->canvas);
+    freeReceivers(x);
+    instance_unmap(x);
+    logpost(NULL, PD_DEBUG, "pdvst3: instance %d detached", x->slot);
+    freebytes(x, sizeof(t_pdvstInstance));
+}
+
+/* attach and detach instances as the hosts ask. the server mutex is only
+   held to take the requests and to answer them: a patch can take long to
+   load and the hosts wait on it to ask. a request that changed meanwhile
+   is answered on the next loop */
+void server_slots(void)
+{
+    static pdvstServerSlot request[MAXPDINSTANCES];
+    int pending[MAXPDINSTANCES], result[MAXPDINSTANCES];
+    int k, n = 0;
+
+    xxWaitForSingleObject(serverMu_tex[SERVERMUTEX], -1);
+    for (k = 0; k < MAXPDINSTANCES; k++)
+    {
+        if (serverData->slots[k].state == SLOT_ATTACH ||
+            serverData->slots[k].state == SLOT_DETACH)
+        {
+            request[k] = serverData->slots[k];
+            pending[n++] = k;
+        }
+    }
+    xxReleaseMutex(serverMu_tex[SERVERMUTEX]);
+    if (!n)
+        return;
+
+    for (k = 0; k < n; k++)
+    {
+        int slot = pending[k];
+        if (pdvstInstances[slot])
+            instance_free(pdvstInstances[slot]);
+        if (request[slot].state == SLOT_ATTACH)
+            result[k] = instance_new(slot, &request[slot]) ? SLOT_ATTACHED : SLOT_FREE;
+        else
+            result[k] = SLOT_FREE;
+    }
+
+    xxWaitForSingleObject(serverMu_tex[SERVERMUTEX], -1);
+    for (k = 0; k < n; k++)
+    {
+        pdvstServerSlot *slot = &serverData->slots[pending[k]];
+        if (!memcmp(slot, &request[pending[k]], sizeof(pdvstServerSlot)))
+            slot->state = result[k];
+    }
+    xxReleaseMutex(serverMu_tex[SERVERMUTEX]);
+}
+
+/* one DSP tick for every instance that has a block waiting: each instance
+   owns channelsPerInstance Pd channels starting at its channelOffset */
+void server_tick(void)
+{
+    t_sample *soundin = get_sys_soundin(), *soundout = get_sys_soundout();
+    int nch = serverData->channelsPerInstance, k, ch, j;
+    char ticked[MAXPDINSTANCES];
+    int64_t tickTime[MAXPDINSTANCES];
+
+    for (k = 0; k < MAXPDINSTANCES; k++)
+    {
+        t_pdvstInstance *x = pdvstInstances[k];
+        pdvstTransferData *d;
+        float *block;
+        ticked[k] = 0;
+        if (!x)
+            continue;
+        d = x->data;
+        ticked[k] = (d->syncToVst && d->inTail != d->inHead);
+        block = ticked[k] ? PDVSTFIFOIN(d, d->inTail) : 0;
+        for (ch = 0; ch < nch; ch++)
+        {
+            t_sample *in = soundin + (x->channelOffset + ch) * PDBLKSIZE;
+            if (block && ch < d->fifoChannels)
+                for (j = 0; j < PDBLKSIZE; j++)
+                    in[j] = block[ch * PDBLKSIZE + j];
+            else
+                for (j = 0; j < PDBLKSIZE; j++)
+                    in[j] = 0;
+        }
+        tickTime[k] = 0;
+        if (ticked[k])
+        {
+            tickTime[k] = d->inTime[d->inTail];
+            pdvstTrace(d, PDVSTTRACEPD, PDVSTTRACESCHEDWAKE, (int32_t)tickTime[k]);
+            x->tickTime = tickTime[k];
+            sch_param_points(x, tickTime[k], 0);
+            sch_midi_events(x, tickTime[k], 0);
+            sch_playhead_tick(x);
+            PDVST_BARRIER();
+            d->inTail = (d->inTail + 1) % d->fifoBlocks;
+        }
+    }
+    // one sched_tick() for all of them, it shows in the trace of each
+    for (k = 0; k < MAXPDINSTANCES; k++)
+        if (ticked[k])
+            pdvstTrace(pdvstInstances[k]->data, PDVSTTRACEPD, PDVSTTRACETICKBEGIN,
+                       (int32_t)tickTime[k]);
+    sched_tick();
+    for (k = 0; k < MAXPDINSTANCES; k++)
+        if (ticked[k])
+            pdvstTrace(pdvstInstances[k]->data, PDVSTTRACEPD, PDVSTTRACETICKEND,
+                       (int32_t)tickTime[k]);
+    pd_poll();
+    for (k = 0; k < MAXPDINSTANCES; k++)
+    {
+        t_pdvstInstance *x = pdvstInstances[k];
+        pdvstTransferData *d;
+        if (!x)
+            continue;
+        d = x->data;
+        if (ticked[k] && (d->outHead + 1) % d->fifoBlocks != d->outTail)
+        {
+            float *block = PDVSTFIFOOUT(d, d->outHead);
+            for (ch = 0; ch < d->fifoChannels && ch < nch; ch++)
             {
-                active = 0;
+                t_sample *out = soundout + (x->channelOffset + ch) * PDBLKSIZE;
+                for (j = 0; j < PDBLKSIZE; j++)
+                    block[ch * PDBLKSIZE + j] = out[j];
             }
-        #else
-            if (kill(vstHostProcessId, 0) == -1)
+            PDVST_BARRIER();
+            d->outHead = (d->outHead + 1) % d->fifoBlocks;
+        }
+        for (ch = 0; ch < nch; ch++)
+            memset(soundout + (x->channelOffset + ch) * PDBLKSIZE, 0, PDBLKSIZE * sizeof(t_sample));
+        sch_param_out(x, tickTime[k]);
+        if (ticked[k])
+        {
+            pdvstTrace(d, PDVSTTRACEPD, PDVSTTRACEPDPOST, (int32_t)tickTime[k]);
+            xxSetEvent(x->mu_tex[PDPROCEVENT]);
+        }
+    }
+}
+
+/* the shared server loop: ticks once all busy instances pushed a block.
+   instances that stopped sending blocks for PDSERVERIDLE are not waited for,
+   with nobody processing Pd runs at approx. real-time like a single instance */
+int server()
+{
+    int k, active = 1, sampleRate = 0, nch = serverData->channelsPerInstance;
+
+    sch_timing();
+    sys_initmidiqueue();
+    midiInitTime = clock_getlogicaltime();
+    midiTickMs = 0;
+    xxWaitForSingleObject(serverMu_tex[SERVERMUTEX], -1);
+    #ifdef _WIN32
+        serverData->pdProcessId = (int)GetCurrentProcessId();
+    #else
+        serverData->pdProcessId = (int)getpid();
+    #endif
+    serverData->schedulerReady = 1;
+    xxReleaseMutex(serverMu_tex[SERVERMUTEX]);
+    while (active)
+    {
+        int blocks = 0, waiting = 0;
+        double now = sys_getrealtime();
+
+        xxWaitForSingleObject(serverMu_tex[SERVERMUTEX], -1);
+        active = serverData->active;
+        serverData->heartbeat++;
+        xxReleaseMutex(serverMu_tex[SERVERMUTEX]);
+        server_slots();
+
+        for (k = 0; k < MAXPDINSTANCES; k++)
+        {
+            t_pdvstInstance *x = pdvstInstances[k];
+            pdvstTransferData *d;
+            if (!x)
+                continue;
+            d = x->data;
+            xxWaitForSingleObject(x->mu_tex[PDVSTTRANSFERMUTEX], -1);
+            d->heartbeat++;
+            if (!sampleRate)
+                sampleRate = d->sampleRate;
+            sch_general_receivers(x);
+            sch_playhead_in(x);
+            sch_midi_in(x);
+            sch_receive_parameters(x);
+            sch_param_queue_in(x);
+            if (d->syncToVst)
+            {
+                if (d->inHead != x->lastInHead)
+                {
+                    x->lastInHead = d->inHead;
+                    x->lastBlockTime = now;
+                }
+                if (d->inHead != d->inTail)
+                    blocks++;
+                else if (now - x->lastBlockTime < PDSERVERIDLE)
+                    waiting++;
+            }
+            xxReleaseMutex(x->mu_tex[PDVSTTRANSFERMUTEX]);
+            if (!d->syncToVst)
             {
-                active = 0;
+                x->tickTime = 0;
+                sch_param_points(x, 0, 1);
+                sch_midi_events(x, 0, 1);
+                sch_playhead_tick(x);
             }
-        #endif
+        }
+        // all instances run at the rate of the first one
+        if (sampleRate && sampleRate != (int)sys_getsr())
+        {
+            post("samplerate changed to %d", sampleRate);
+            debugLog("samplerate changed to %d", sampleRate);
+            sys_setchsr(nch * MAXPDINSTANCES, nch * MAXPDINSTANCES, sampleRate);
+        }
+        sampleRate = 0;
+
+        if (blocks && !waiting)
+            server_tick();
+        else if (!blocks && !waiting)
+        {
+            pd_tick();
+            for (k = 0; k < MAXPDINSTANCES; k++)
+                if (pdvstInstances[k])
+                    sch_param_out(pdvstInstances[k], 0);
+            pdvst_sleep((int)(PDBLKSIZE * 1000. / sys_getsr()) + 1);
+        }
+        else
+        {
+            sys_pollgui();
+            xxWaitForSingleObject(serverMu_tex[SERVEREVENT], 1);
+            xxResetEvent(serverMu_tex[SERVEREVENT]);
+        }
+        sch_midi_out();
+        if (!sch_host_alive())
+        {
+            active = 0;
+        }
     }
+    for (k = 0; k < MAXPDINSTANCES; k++)
+        if (pdvstInstances[k])
+            instance_free(pdvstInstances[k]);
     return 1;
 }
 
+int server_map(void)
+{
+    #ifdef _WIN32
+        serverMu_tex[SERVERMUTEX] = OpenMutexA(MUTEX_ALL_ACCESS, 0, serverMutexName);
+        serverMu_tex[SERVEREVENT] = OpenEventA(EVENT_ALL_ACCESS, 0, serverEventName);
+        serverFileMap = OpenFileMappingA(FILE_MAP_ALL_ACCESS, 0, serverMapName);
+        if (!serverFileMap)
+            return 0;
+        serverData = (pdvstServerData *)MapViewOfFile(serverFileMap,
+                                                      FILE_MAP_ALL_ACCESS,
+                                                      0,
+                                                      0,
+                                                      sizeof(pdvstServerData));
+    #else
+        serverMu_tex[SERVERMUTEX] = sem_open(serverMutexName, O_CREAT, 0666, 1);
+        serverMu_tex[SERVEREVENT] = sem_open(serverEventName, O_CREAT, 0666, 0);
+        fd = shm_open(serverMapName, O_RDWR, 0666);
+        if (fd < 0)
+            return 0;
+        serverFileMap = (char*)mmap(NULL, sizeof(pdvstServerData),
+                                    PROT_READ | PROT_WRITE, MAP_SHARED,
+                                    fd, 0);
+        close(fd);
+        if (serverFileMap == MAP_FAILED)
+            return 0;
+        serverData = (pdvstServerData *)serverFileMap;
+    #endif
+    return serverData != 0;
+}
+
+void server_unmap(void)
+{
+    #ifdef _WIN32
+        CloseHandle(serverMu_tex[SERVERMUTEX]);
+        CloseHandle(serverMu_tex[SERVEREVENT]);
+        UnmapViewOfFile(serverData);
+        CloseHandle(serverFileMap);
+    #else
+        sem_close(serverMu_tex[SERVERMUTEX]);
+        sem_close(serverMu_tex[SERVEREVENT]);
+        munmap(serverFileMap, sizeof(pdvstServerData));
+    #endif
+    serverData = 0;
+}
+
 void set_resources()
 {
     #ifdef _WIN32
-        mu_tex[PDVSTTRANSFERMUTEX] = OpenMutexA(MUTEX_ALL_ACCESS, 0, pdvstTransferMutexName);
-        mu_tex[VSTPROCEVENT] = OpenEventA(EVENT_ALL_ACCESS, 0, vstProcEventName);
-        mu_tex[PDPROCEVENT] = OpenEventA(EVENT_ALL_ACCESS, 0, pdProcEventName);
-        pdvstTransferFileMap = OpenFileMappingA(FILE_MAP_ALL_ACCESS,
-                                               0,
-                                               pdvstTransferFileMapName);
-        pdvstData = (pdvstTransferData *)MapViewOfFile(pdvstTransferFileMap,
-                                                       FILE_MAP_ALL_ACCESS,
-                                                       0,
-                                                       0,
-                                                       sizeof(pdvstTransferData));
+        instance_map(&singleInstance, pdvstTransferMutexName, pdvstTransferFileMapName,
+                     vstProcEventName, pdProcEventName);
     #else //unix
 
         fd = shm_open(pdvstSharedAddressesMapName, O_CREAT | O_RDWR, 0666);
@@ -859,37 +3121,27 @@ void set_resources()
                                     fd, 0);
         close(fd);
         pdvstShared = (pdvstSharedAddresses *)pdvstSharedAddressesMap;
-        mu_tex[PDVSTTRANSFERMUTEX] = sem_open(pdvstShared->pdvstTransferMutexName, O_CREAT, 0666, 0);
-        mu_tex[VSTPROCEVENT] = sem_open(pdvstShared->vstProcEventName, O_CREAT, 0666, 1);
-        mu_tex[PDPROCEVENT] = sem_open(pdvstShared->pdProcEventName, O_CREAT, 0666, 0);
-        fd = shm_open(pdvstShared->pdvstTransferFileMapName, O_CREAT | O_RDWR, 0666);
-        pdvstTransferFileMap = (char*)mmap(NULL, sizeof(pdvstTransferData),
-                                    PROT_READ | PROT_WRITE, MAP_SHARED,
-                                    fd, 0);
-        mlock(pdvstTransferFileMap, sizeof(pdvstTransferData));
-        close(fd);
-        pdvstData = (pdvstTransferData *)pdvstTransferFileMap;
+        instance_map(&singleInstance, pdvstShared->pdvstTransferMutexName,
+                     pdvstShared->pdvstTransferFileMapName,
+                     pdvstShared->vstProcEventName, pdvstShared->pdProcEventName);
     #endif
+    singleInstance.slot = -1;
+    singleInstance.prefix[0] = 0;
+    pdvstInstances[0] = &singleInstance;
 }
 
 void clean_resources()
 {
     #ifdef _WIN32
-        CloseHandle(mu_tex[PDVSTTRANSFERMUTEX]);
-        UnmapViewOfFile(pdvstTransferFileMap);
-        CloseHandle(pdvstTransferFileMap);
+        instance_unmap(&singleInstance);
     #else
-        sem_close(mu_tex[VSTPROCEVENT]);
-        sem_close(mu_tex[PDPROCEVENT]);
-        sem_close(mu_tex[PDVSTTRANSFERMUTEX]);
+        instance_unmap(&singleInstance);
         sem_unlink(pdvstShared->vstProcEventName);
         sem_unlink(pdvstShared->pdProcEventName);
         sem_unlink(pdvstShared->pdvstTransferMutexName);
-        munlock(pdvstTransferFileMap, sizeof(pdvstTransferData));
-        munmap(pdvstTransferFileMap, sizeof(pdvstTransferData));
+        shm_unlink(pdvstShared->pdvstTransferFileMapName);
         munmap(pdvstSharedAddressesMap, sizeof(pdvstSharedAddresses));
-        shm_unlink(pdvstTransferFileMap);
-        shm_unlink(pdvstSharedAddressesMap);
+        shm_unlink(pdvstSharedAddressesMapName);
     #endif
 }
 #if _MSC_VER
@@ -902,8 +3154,6 @@ int pd_extern_sched(char *flags)
     int i, argc;
     char *argv[MAXARGS];
 
-    debugFile = fopen("pdvstschedulerdebug.txt", "wt");
-
     t_audiosettings as;
     sys_get_audio_settings(&as);
     as.a_api = API_NONE;
@@ -914,19 +3164,37 @@ int pd_extern_sched(char *flags)
     }
     argc = tokenizeCommandLineString(flags, argv);
     parseArgs(argc, argv);
-    set_resources();
-    xxWaitForSingleObject(PDVSTTRANSFERMUTEX, -1);
     logpost(NULL, PD_DEBUG,"---");
     logpost(NULL, PD_DEBUG,"  pdvst3 v%d.%d.%d",PDVST3_VER_MAJ, PDVST3_VER_MIN, PDVST3_VER_PATCH);
     logpost(NULL, PD_DEBUG,"  %s %s",PDVST3_AUTH, PDVST3_DATE);
     logpost(NULL, PD_DEBUG,"---");
-    sys_setchsr(pdvstData->nChannelsIn,
-                pdvstData->nChannelsOut,
-                pdvstData->sampleRate);
-    xxReleaseMutex(PDVSTTRANSFERMUTEX);
-    scheduler();
-    // on exit
-    clean_resources();
+    sch_makeclasses();
+    if (serverMapName)
+    {
+        // shared server: the patches come and go with the plugin instances
+        if (server_map())
+        {
+            xxWaitForSingleObject(serverMu_tex[SERVERMUTEX], -1);
+            sys_setchsr(serverData->channelsPerInstance * MAXPDINSTANCES,
+                        serverData->channelsPerInstance * MAXPDINSTANCES,
+                        48000);
+            xxReleaseMutex(serverMu_tex[SERVERMUTEX]);
+            server();
+        }
+        server_unmap();
+    }
+    else
+    {
+        set_resources();
+        xxWaitForSingleObject(singleInstance.mu_tex[PDVSTTRANSFERMUTEX], -1);
+        sys_setchsr(singleInstance.data->nChannelsIn,
+                    singleInstance.data->nChannelsOut,
+                    singleInstance.data->sampleRate);
+        xxReleaseMutex(singleInstance.mu_tex[PDVSTTRANSFERMUTEX]);
+        scheduler();
+        // on exit
+        clean_resources();
+    }
     for (i = 0; i < MAXARGS; i++)
     {
         free(argv[i]);
@@ -938,11 +3206,11 @@ int pd_extern_sched(char *flags)
 // mutexes events semaphores
 //------------------------------------------------------------------------
 
-int xxWaitForSingleObject(int mutex, int ms)
+int xxWaitForSingleObject(t_pdvstHandle mutex, int ms)
 {
     #if _WIN32
         int ret;
-        ret = WaitForSingleObject(mu_tex[mutex], ms);
+        ret = WaitForSingleObject(mutex, ms);
 
         if (ret == WAIT_TIMEOUT)
             return 0;
@@ -957,7 +3225,7 @@ int xxWaitForSingleObject(int mutex, int ms)
         int ret= -1;
         while (1)
         {
-            if (sem_trywait(mu_tex[mutex]) == 0)
+            if (sem_trywait(mutex) == 0)
                 return 1;
             if (elapsed_time >= ms)
             {
@@ -970,42 +3238,42 @@ int xxWaitForSingleObject(int mutex, int ms)
     #endif
 }
 
-int xxReleaseMutex(int mutex)
+int xxReleaseMutex(t_pdvstHandle mutex)
 {
     #if _WIN32
-        ReleaseMutex(mu_tex[mutex]);
+        ReleaseMutex(mutex);
         return 0;
     #else
-        sem_post(mu_tex[mutex]);
+        sem_post(mutex);
         return 0;
     #endif
 }
 
-void xxSetEvent(int mutex)
+void xxSetEvent(t_pdvstHandle mutex)
 {
     #if _WIN32
-        SetEvent(mu_tex[mutex]);
+        SetEvent(mutex);
     #else
         int value;
-        sem_getvalue(mu_tex[mutex], &value);
+        sem_getvalue(mutex, &value);
         if (value == 0)
         {
-            sem_post(mu_tex[mutex]);  // Increment to 1 (signaled)
+            sem_post(mutex);  // Increment to 1 (signaled)
         }
     #endif
 }
 
-void xxResetEvent(int mutex)
+void xxResetEvent(t_pdvstHandle mutex)
 {
     #if _WIN32
-        ResetEvent(mu_tex[mutex]);
+        ResetEvent(mutex);
     #else
         int value;
-        sem_getvalue(mu_tex[mutex], &value);
+        sem_getvalue(mutex, &value);
         while (value > 0)
         {
-            sem_wait(mu_tex[mutex]);  // Decrement until count is 0
-            sem_getvalue(mu_tex[mutex], &value);
+            sem_wait(mutex);  // Decrement until count is 0
+            sem_getvalue(mutex, &value);
         }
     #endif
 }
@@ -0,0 +1,248 @@
+/*
+ * This file is part of pdvst3.
+ *
+ * Copyright (C) 2025 Lucas Cordiviola
+ * based on original work from 2004 by Joseph A. Sarlo and 2018 by Jean-Yves Gratius
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* pdvst3trace: turns the .trace file a plugin instance writes with
+   TRACE = TRUE into Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+   the host's audio thread and the Pd scheduler are two threads of it:
+   process() and its waits for Pd on one, each block from the scheduler
+   taking it to its PDPROCEVENT (with sched_tick() inside) on the other, and
+   an arrow from where the host posts a block to where Pd takes it.
+   a short summary goes to stdout.
+
+   usage: pdvst3trace <file.trace> [<file.json>] */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#if _WIN32
+    #include <windows.h>
+#endif
+
+extern "C"
+{
+    #include "pdvstTransfer.h"
+}
+
+#define HOSTTID 1
+#define PDTID 2
+
+pdvstTraceEvent *events;
+int nEvents;
+
+bool readTrace(const char *path)
+{
+    char magic[4];
+    uint32_t header[2];
+    int capacity = 0;
+    pdvstTraceEvent event;
+    FILE *f = fopen(path, "rb");
+
+    if (!f)
+    {
+        fprintf(stderr, "can't open %s\n", path);
+        return false;
+    }
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, "PDVT", 4) ||
+        fread(header, sizeof(uint32_t), 2, f) != 2)
+    {
+        fprintf(stderr, "%s is not a pdvst3 trace\n", path);
+        fclose(f);
+        return false;
+    }
+    if (header[0] != PDVSTTRACEVERSION || header[1] != sizeof(pdvstTraceEvent))
+    {
+        fprintf(stderr, "%s: trace version %u, this tool reads %d\n", path,
+                header[0], PDVSTTRACEVERSION);
+        fclose(f);
+        return false;
+    }
+    while (fread(&event, sizeof(pdvstTraceEvent), 1, f) == 1)
+    {
+        if (nEvents == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 65536;
+            events = (pdvstTraceEvent *)realloc(events, capacity * sizeof(pdvstTraceEvent));
+        }
+        events[nEvents++] = event;
+    }
+    fclose(f);
+    return true;
+}
+
+// one JSON event, ts in microseconds from the first event
+void writeEvent(FILE *f, bool *first, const char *name, const char *ph, int tid,
+                double us, const char *extra)
+{
+    fprintf(f, "%s\n{\"ph\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f",
+            *first ? "" : ",", ph, tid, us);
+    if (name)
+        fprintf(f, ",\"name\":\"%s\"", name);
+    if (extra)
+        fprintf(f, ",%s", extra);
+    fprintf(f, "}");
+    *first = false;
+}
+
+int main(int argc, char **argv)
+{
+    char outFile[MAXFILENAMELEN];
+    char extra[MAXSTRLEN];
+    double start, end, us;
+    double processBegin = -1, waitBegin = -1, blockBegin = -1, tickBegin = -1;
+    double maxProcess = 0, maxWait = 0, maxBlock = 0, maxTick = 0;
+    int processCalls = 0, blocks = 0, timeouts = 0, lost = 0;
+    bool first = true;
+    FILE *f;
+    int i;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <file.trace> [<file.json>]\n", argv[0]);
+        return 1;
+    }
+    if (!readTrace(argv[1]))
+        return 1;
+    if (argc > 2)
+    {
+        if (snprintf(outFile, MAXFILENAMELEN, "%s", argv[2]) >= MAXFILENAMELEN)
+        {
+            fprintf(stderr, "path too long: %s\n", argv[2]);
+            return 1;
+        }
+    }
+    else
+    {
+        int len = (int)strlen(argv[1]);
+        if (len > 6 && strcmp(argv[1] + len - 6, ".trace") == 0)
+            len -= 6;
+        if (snprintf(outFile, MAXFILENAMELEN, "%.*s.json", len, argv[1]) >= MAXFILENAMELEN)
+        {
+            fprintf(stderr, "path too long: %s\n", argv[1]);
+            return 1;
+        }
+    }
+    f = fopen(outFile, "w");
+    if (!f)
+    {
+        fprintf(stderr, "can't write %s\n", outFile);
+        return 1;
+    }
+
+    // the rings are written one after the other, the file is not in time order
+    start = end = nEvents ? events[0].time : 0;
+    for (i = 1; i < nEvents; i++)
+    {
+        if (events[i].time < start)
+            start = events[i].time;
+        if (events[i].time > end)
+            end = events[i].time;
+    }
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    writeEvent(f, &first, "thread_name", "M", HOSTTID, 0, "\"args\":{\"name\":\"host audio thread\"}");
+    writeEvent(f, &first, "thread_name", "M", PDTID, 0, "\"args\":{\"name\":\"Pd scheduler\"}");
+    for (i = 0; i < nEvents; i++)
+    {
+        pdvstTraceEvent *e = &events[i];
+        us = (e->time - start) * 1e6;
+        switch (e->type)
+        {
+        case PDVSTTRACEPROCESSBEGIN:
+            sprintf(extra, "\"args\":{\"samples\":%d}", e->arg);
+            writeEvent(f, &first, "process", "B", HOSTTID, us, extra);
+            processBegin = us;
+            processCalls++;
+            break;
+        case PDVSTTRACEPROCESSEND:
+            writeEvent(f, &first, NULL, "E", HOSTTID, us, NULL);
+            if (processBegin >= 0 && us - processBegin > maxProcess)
+                maxProcess = us - processBegin;
+            processBegin = -1;
+            break;
+        case PDVSTTRACEVSTPOST:
+            sprintf(extra, "\"s\":\"t\",\"args\":{\"block\":%d}", e->arg);
+            writeEvent(f, &first, "VSTPROCEVENT", "i", HOSTTID, us, extra);
+            sprintf(extra, "\"cat\":\"block\",\"id\":%d", e->arg);
+            writeEvent(f, &first, "block", "s", HOSTTID, us, extra);
+            break;
+        case PDVSTTRACEHOSTWAIT:
+            writeEvent(f, &first, "wait for Pd", "B", HOSTTID, us, NULL);
+            waitBegin = us;
+            break;
+        case PDVSTTRACEHOSTWAKE:
+            sprintf(extra, "\"args\":{\"answered\":%d}", e->arg);
+            writeEvent(f, &first, NULL, "E", HOSTTID, us, extra);
+            if (!e->arg)
+            {
+                writeEvent(f, &first, "Pd timeout", "i", HOSTTID, us, "\"s\":\"t\"");
+                timeouts++;
+            }
+            if (waitBegin >= 0 && us - waitBegin > maxWait)
+                maxWait = us - waitBegin;
+            waitBegin = -1;
+            break;
+        case PDVSTTRACESCHEDWAKE:
+            sprintf(extra, "\"cat\":\"block\",\"id\":%d,\"bp\":\"e\"", e->arg);
+            writeEvent(f, &first, "block", "f", PDTID, us, extra);
+            sprintf(extra, "\"args\":{\"block\":%d}", e->arg);
+            writeEvent(f, &first, "block", "B", PDTID, us, extra);
+            blockBegin = us;
+            break;
+        case PDVSTTRACETICKBEGIN:
+            writeEvent(f, &first, "sched_tick", "B", PDTID, us, NULL);
+            tickBegin = us;
+            break;
+        case PDVSTTRACETICKEND:
+            writeEvent(f, &first, NULL, "E", PDTID, us, NULL);
+            if (tickBegin >= 0 && us - tickBegin > maxTick)
+                maxTick = us - tickBegin;
+            tickBegin = -1;
+            break;
+        case PDVSTTRACEPDPOST:
+            writeEvent(f, &first, "PDPROCEVENT", "i", PDTID, us, "\"s\":\"t\"");
+            if (blockBegin >= 0)
+            {
+                writeEvent(f, &first, NULL, "E", PDTID, us, NULL);
+                if (us - blockBegin > maxBlock)
+                    maxBlock = us - blockBegin;
+                blocks++;
+            }
+            blockBegin = -1;
+            break;
+        case PDVSTTRACELOST:
+            sprintf(extra, "\"s\":\"g\",\"args\":{\"events\":%d}", e->arg);
+            writeEvent(f, &first, "trace events lost", "i", HOSTTID, us, extra);
+            lost += e->arg;
+            break;
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+
+    printf("%s: %d events, %.3f s\n", outFile, nEvents, end - start);
+    printf("process() calls: %d, longest %.1f us\n", processCalls, maxProcess);
+    printf("longest wait for Pd: %.1f us, %d timeouts\n", maxWait, timeouts);
+    printf("blocks in Pd: %d, longest %.1f us, longest sched_tick %.1f us\n",
+           blocks, maxBlock, maxTick);
+    if (lost)
+        printf("%d events lost to full trace rings\n", lost);
+    free(events);
+    return 0;
+}